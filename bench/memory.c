@@ -0,0 +1,201 @@
+// Memory benchmark for the server.
+//
+// Runs the server on a thread and keeps a number of keep-alive connections
+// busy with the requests pi_volume sees, page loads and volume taps, plus
+// chunked uploads and requests and responses too large for the
+// HTTP_STATIC_MEMORY buffers. Reports the heap allocations the server made
+// after startup and the resident set size. Allocations are counted by
+// wrapping malloc at link time so only the server's own calls are seen.
+//
+//   make bench_memory
+//
+// builds and runs it with the default and the static memory profile. An
+// optional argument sets the number of rounds, default 2000. Linux only.
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#define HTTPSERVER_IMPL
+#include "../httpserver.h"
+
+#define BENCH_PORT 8089
+#define BENCH_CONNECTIONS 16
+
+static long bench_allocs;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size) {
+  __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+  return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+  __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+  return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+  __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+  return __real_realloc(ptr, size);
+}
+
+static char bench_page[1536];
+static char bench_big[65536];
+
+static void bench_respond(struct http_request_s* request, int status, char const * body, int len) {
+  struct http_response_s* response = http_response_init();
+  http_response_status(response, status);
+  http_response_header(response, "Content-Type", "text/html");
+  http_response_body(response, body, len);
+  http_respond(request, response);
+}
+
+static void bench_upload_chunk(struct http_request_s* request) {
+  struct http_string_s chunk = http_request_chunk(request);
+  if (chunk.len == 0) return bench_respond(request, 200, "uploaded", 8);
+  http_request_read_chunk(request, bench_upload_chunk);
+}
+
+static void bench_handle_request(struct http_request_s* request) {
+  struct http_string_s target = http_request_target(request);
+  if (target.len == 4 && memcmp(target.buf, "/tap", 4) == 0) {
+    bench_respond(request, 200, "ok", 2);
+  } else if (target.len == 7 && memcmp(target.buf, "/upload", 7) == 0) {
+    http_request_read_chunk(request, bench_upload_chunk);
+  } else if (target.len == 4 && memcmp(target.buf, "/big", 4) == 0) {
+    bench_respond(request, 200, bench_big, sizeof(bench_big));
+  } else {
+    bench_respond(request, 200, bench_page, sizeof(bench_page));
+  }
+}
+
+static void* bench_serve(void* arg) {
+  http_server_listen((struct http_server_s*)arg);
+  return NULL;
+}
+
+static int bench_connect() {
+  struct sockaddr_in addr = { };
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(BENCH_PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  while (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    close(sock);
+    usleep(1000);
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+  }
+  return sock;
+}
+
+// Sends the request and reads the response. Returns the status, 0 if the
+// connection was closed before a complete response arrived.
+static int bench_exchange(int sock, char const * request, int len) {
+  static char buf[1 << 17];
+  if (write(sock, request, len) != len) return 0;
+  int bytes = 0;
+  while (1) {
+    int n = read(sock, buf + bytes, sizeof(buf) - 1 - bytes);
+    if (n <= 0) return 0;
+    bytes += n;
+    buf[bytes] = '\0';
+    char* end = strstr(buf, "\r\n\r\n");
+    if (end == NULL) continue;
+    char* length = strcasestr(buf, "Content-Length: ");
+    int body = length ? atoi(length + 16) : 0;
+    if (bytes >= end + 4 - buf + body) return atoi(buf + 9);
+  }
+}
+
+static void bench_status(char const * field, char* out) {
+  char line[256];
+  FILE* f = fopen("/proc/self/status", "r");
+  strcpy(out, "?");
+  while (f && fgets(line, sizeof(line), f)) {
+    if (strncmp(line, field, strlen(field)) == 0) {
+      sscanf(line + strlen(field) + 1, " %63[^\n]", out);
+    }
+  }
+  if (f) fclose(f);
+}
+
+int main(int argc, char** argv) {
+  int rounds = argc > 1 ? atoi(argv[1]) : 2000;
+  memset(bench_page, 'p', sizeof(bench_page));
+  memset(bench_big, 'b', sizeof(bench_big));
+
+  static char huge_head[8192];
+  int huge_len = sprintf(huge_head, "GET / HTTP/1.1\r\nHost: pi\r\nCookie: ");
+  memset(huge_head + huge_len, 'c', 6000);
+  huge_len += 6000;
+  huge_len += sprintf(huge_head + huge_len, "\r\n\r\n");
+
+  struct {
+    char const * name;
+    char const * text;
+    int len;
+    int closes;
+  } requests[] = {
+    { "page", "GET / HTTP/1.1\r\nHost: pi\r\n\r\n", 0, 0 },
+    { "tap", "POST /tap HTTP/1.1\r\nHost: pi\r\nContent-Length: 9\r\n\r\nvolume=up", 0, 0 },
+    { "upload", "POST /upload HTTP/1.1\r\nHost: pi\r\nTransfer-Encoding: chunked\r\n\r\n"
+      "5\r\nhello\r\n6\r\n world\r\n0\r\n\r\n", 0, 0 },
+    { "big response", "GET /big HTTP/1.1\r\nHost: pi\r\n\r\n", 0, 0 },
+    { "huge head", huge_head, huge_len, 1 },
+  };
+  int count = sizeof(requests) / sizeof(requests[0]);
+  for (int i = 0; i < count; i++) {
+    if (requests[i].len == 0) requests[i].len = strlen(requests[i].text);
+  }
+
+  struct http_server_s* server = http_server_init(BENCH_PORT, bench_handle_request);
+  pthread_t thread;
+  pthread_create(&thread, NULL, bench_serve, server);
+  int socks[BENCH_CONNECTIONS];
+  for (int c = 0; c < BENCH_CONNECTIONS; c++) socks[c] = bench_connect();
+  // Warm up so lazily created state doesn't count as steady state.
+  for (int c = 0; c < BENCH_CONNECTIONS; c++) {
+    bench_exchange(socks[c], requests[0].text, requests[0].len);
+  }
+  long startup = __atomic_load_n(&bench_allocs, __ATOMIC_RELAXED);
+
+  int statuses[8][600] = { };
+  long exchanges = 0;
+  for (int r = 0; r < rounds; r++) {
+    for (int c = 0; c < BENCH_CONNECTIONS; c++) {
+      int i = (r + c) % count;
+      // Mostly taps and page loads, the odd one out now and then.
+      if (i >= 2 && (r + c) % 16 >= 2) i = 1;
+      int status = bench_exchange(socks[c], requests[i].text, requests[i].len);
+      statuses[i][status]++;
+      exchanges++;
+      if (status == 0 || requests[i].closes || status >= 500) {
+        close(socks[c]);
+        socks[c] = bench_connect();
+      }
+    }
+  }
+
+  long allocs = __atomic_load_n(&bench_allocs, __ATOMIC_RELAXED) - startup;
+  char rss[64], hwm[64];
+  bench_status("VmRSS", rss);
+  bench_status("VmHWM", hwm);
+#ifdef HTTP_STATIC_MEMORY
+  printf("profile: static memory\n");
+#else
+  printf("profile: default\n");
+#endif
+  printf("requests: %ld\n", exchanges);
+  for (int i = 0; i < count; i++) {
+    printf("  %-13s", requests[i].name);
+    for (int status = 0; status < 600; status++) {
+      if (statuses[i][status]) printf(" %d x%d", status, statuses[i][status]);
+    }
+    printf("\n");
+  }
+  printf("allocations after startup: %ld\n", allocs);
+  printf("rss: %s, peak: %s\n", rss, hwm);
+  return 0;
+}
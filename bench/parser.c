@@ -0,0 +1,334 @@
+// Microbenchmark for http_parse and http_chunk_parse.
+//
+// Feeds a corpus of requests as sent by browsers, curl and fetch() through
+// the parser the way the server does: in one read, split in two at every
+// byte boundary and one byte per read, which is the worst case for
+// resumption. Every split has to produce the same tokens as the single read.
+// Chunked bodies are parsed from a ring the same three ways.
+//
+//   make bench
+//
+// builds and runs it twice, once without vectorization and once for the
+// native CPU, so changes to the parser loops can be compared by the numbers.
+// An optional argument sets the seconds spent on each case, default 0.2.
+
+#define HTTPSERVER_IMPL
+#include "../httpserver.h"
+
+#define BENCH_MAX_TOKENS (HTTP_MAX_HEADER_COUNT * 2 + 6)
+
+typedef struct {
+  char const * name;
+  char const * text;
+} bench_case_t;
+
+static bench_case_t const bench_requests[] = {
+  { "curl", "GET /manifest.json HTTP/1.1\r\n"
+    "Host: raspberrypi.local:8080\r\n"
+    "User-Agent: curl/7.88.1\r\n"
+    "Accept: */*\r\n"
+    "\r\n" },
+  { "pi-volume-tap", "POST / HTTP/1.1\r\n"
+    "Host: 192.168.1.23:8080\r\n"
+    "Connection: keep-alive\r\n"
+    "Content-Length: 9\r\n"
+    "User-Agent: Mozilla/5.0 (iPhone; CPU iPhone OS 17_4 like Mac OS X) "
+    "AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.4 Mobile/15E148 "
+    "Safari/604.1\r\n"
+    "Content-Type: application/x-www-form-urlencoded\r\n"
+    "Accept: */*\r\n"
+    "Origin: http://192.168.1.23:8080\r\n"
+    "Referer: http://192.168.1.23:8080/\r\n"
+    "Accept-Language: en-GB,en;q=0.9\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "\r\n"
+    "volume=up" },
+  { "chrome-navigate", "GET /?source=pwa HTTP/1.1\r\n"
+    "Host: 192.168.1.23:8080\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+    "(KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+    "image/avif,image/webp,image/apng,*/*;q=0.8,"
+    "application/signed-exchange;v=b3;q=0.7\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", "
+    "\"Not-A.Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: en-US,en;q=0.9,nl;q=0.8\r\n"
+    "Cookie: _ga=GA1.1.1623417805.1714046400; theme=dark; "
+    "session=9f2c1d7e4b8a4c1f9e3d2b6a7c8e9f01; "
+    "_ga_XYZ123=GS1.1.1714046400.1.1.1714046460.0.0.0\r\n"
+    "If-None-Match: \"5f2a-18f0c1d2e3\"\r\n"
+    "If-Modified-Since: Thu, 25 Apr 2024 12:00:00 GMT\r\n"
+    "\r\n" },
+  { "fetch-json", "POST /api/volume HTTP/1.1\r\n"
+    "Host: 192.168.1.23:8080\r\n"
+    "Connection: keep-alive\r\n"
+    "Content-Length: 42\r\n"
+    "sec-ch-ua-platform: \"Android\"\r\n"
+    "User-Agent: Mozilla/5.0 (Linux; Android 14; Pixel 8) "
+    "AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Mobile "
+    "Safari/537.36\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+    "Content-Type: application/json\r\n"
+    "sec-ch-ua-mobile: ?1\r\n"
+    "Accept: */*\r\n"
+    "Origin: http://192.168.1.23:8080\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: cors\r\n"
+    "Sec-Fetch-Dest: empty\r\n"
+    "Referer: http://192.168.1.23:8080/\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "\r\n"
+    "{\"step\":5,\"direction\":\"up\",\"device\":\"hw:0\"}" },
+  { "chunked-upload", "POST /upload HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "User-Agent: curl/7.88.1\r\n"
+    "Accept: */*\r\n"
+    "Transfer-Encoding: chunked\r\n"
+    "Content-Type: application/octet-stream\r\n"
+    "Expect: 100-continue\r\n"
+    "\r\n" },
+};
+
+#define BENCH_REQUEST_COUNT (sizeof(bench_requests) / sizeof(bench_requests[0]))
+
+static double bench_seconds = 0.2;
+
+static double bench_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench_same_tokens(http_token_t const * a, http_token_t const * b, int count) {
+  for (int i = 0; i < count; i++) {
+    if (a[i].type != b[i].type || a[i].index != b[i].index || a[i].len != b[i].len) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Parses the head of the request with reads ending at the given offsets, the
+// last being the whole request. Returns the number of tokens up to and
+// including the body token.
+static int bench_parse(
+  char* buf,
+  int const * reads,
+  int read_count,
+  http_token_t* tokens
+) {
+  http_parser_t parser = { };
+  int count = 0;
+  for (int r = 0; r < read_count; r++) {
+    http_token_t token;
+    do {
+      token = http_parse(&parser, buf, reads[r]);
+      if (token.type == HTTP_NONE) break;
+      tokens[count++] = token;
+      if (token.type == HTTP_BODY || token.type == HTTP_PARSE_ERROR) return count;
+    } while (1);
+  }
+  return count;
+}
+
+typedef struct {
+  char* buf;
+  int len;
+  int* reads;
+  http_token_t expect[BENCH_MAX_TOKENS];
+  int expect_count;
+} bench_input_t;
+
+// One read, every two-way split and one byte per read.
+#define BENCH_MODE_WHOLE 0
+#define BENCH_MODE_SPLIT 1
+#define BENCH_MODE_BYTES 2
+
+static char const * bench_mode_names[] = { "whole", "split", "bytewise" };
+
+// Runs one pass in the mode and returns the number of requests parsed.
+static int bench_parse_pass(bench_input_t* in, int mode) {
+  http_token_t tokens[BENCH_MAX_TOKENS];
+  int count;
+  int parsed = 0;
+  switch (mode) {
+    case BENCH_MODE_WHOLE:
+      count = bench_parse(in->buf, &in->len, 1, tokens);
+      parsed++;
+      break;
+    case BENCH_MODE_SPLIT:
+      for (int at = 1; at < in->len; at++) {
+        int reads[2] = { at, in->len };
+        count = bench_parse(in->buf, reads, 2, tokens);
+        if (count != in->expect_count || !bench_same_tokens(tokens, in->expect, count)) {
+          return -at;
+        }
+        parsed++;
+      }
+      return parsed;
+    case BENCH_MODE_BYTES:
+      count = bench_parse(in->buf, in->reads, in->len, tokens);
+      parsed++;
+      break;
+  }
+  if (count != in->expect_count || !bench_same_tokens(tokens, in->expect, count)) {
+    return -1;
+  }
+  return parsed;
+}
+
+static void bench_report(
+  char const * name,
+  int bytes,
+  char const * mode,
+  double elapsed,
+  long requests,
+  long bytes_parsed
+) {
+  printf(
+    "%-16s %6d  %-9s %10.1f %10.1f\n",
+    name, bytes, mode, elapsed * 1e9 / requests, bytes_parsed / elapsed / 1e6
+  );
+}
+
+static int bench_requests_run() {
+  for (unsigned c = 0; c < BENCH_REQUEST_COUNT; c++) {
+    bench_input_t in;
+    in.len = strlen(bench_requests[c].text);
+    // The parser isn't given a terminated string, don't hand it one.
+    in.buf = (char*)malloc(in.len);
+    memcpy(in.buf, bench_requests[c].text, in.len);
+    in.reads = (int*)malloc(in.len * sizeof(int));
+    for (int i = 0; i < in.len; i++) in.reads[i] = i + 1;
+    in.expect_count = bench_parse(in.buf, &in.len, 1, in.expect);
+    if (in.expect[in.expect_count - 1].type != HTTP_BODY) {
+      fprintf(stderr, "%s: request doesn't parse\n", bench_requests[c].name);
+      return 1;
+    }
+    for (int mode = BENCH_MODE_WHOLE; mode <= BENCH_MODE_BYTES; mode++) {
+      long requests = 0;
+      double start = bench_now();
+      double elapsed;
+      do {
+        for (int i = 0; i < 64; i++) {
+          int parsed = bench_parse_pass(&in, mode);
+          if (parsed < 0) {
+            fprintf(
+              stderr, "%s: %s parse differs (%d)\n",
+              bench_requests[c].name, bench_mode_names[mode], parsed
+            );
+            return 1;
+          }
+          requests += parsed;
+        }
+        elapsed = bench_now() - start;
+      } while (elapsed < bench_seconds);
+      bench_report(
+        bench_requests[c].name, in.len, bench_mode_names[mode],
+        elapsed, requests, requests * in.len
+      );
+    }
+    free(in.buf);
+    free(in.reads);
+  }
+  return 0;
+}
+
+// Builds a chunked body of count chunks of size bytes each, with the final
+// empty chunk. Returns its length.
+static int bench_chunked_body(char* buf, int count, int size, char const * extension) {
+  int len = 0;
+  for (int i = 0; i < count; i++) {
+    len += sprintf(buf + len, "%x%s\r\n", size, extension);
+    memset(buf + len, 'a' + i % 26, size);
+    len += size;
+    len += sprintf(buf + len, "\r\n");
+  }
+  len += sprintf(buf + len, "0\r\n\r\n");
+  return len;
+}
+
+// Parses the body with the ring filled step bytes at a time. Returns the
+// number of body bytes seen or -1 on error.
+static long bench_chunk_pass(http_request_t* request, char* body, int len, int step) {
+  request->buf = body;
+  request->capacity = len;
+  request->ring = (hs_ring_t){ 0, len, 0, 0 };
+  request->parser = (http_parser_t){ };
+  request->parser.state = HTTP_CHUNK_SIZE;
+  long seen = 0;
+  while (request->ring.wr < len) {
+    request->ring.wr += step;
+    if (request->ring.wr > len) request->ring.wr = len;
+    http_token_t token;
+    while ((token = http_chunk_parse(request)).type == HTTP_CHUNK_BODY) {
+      if (token.len == 0) return seen;
+      seen += token.len;
+    }
+    if (token.type == HTTP_PARSE_ERROR) return -1;
+  }
+  return -1;
+}
+
+static int bench_chunks_run() {
+  struct {
+    char const * name;
+    int count;
+    int size;
+    char const * extension;
+  } const shapes[] = {
+    { "chunks-16x4k", 16, 4096, "" },
+    { "chunks-256x64", 256, 64, "" },
+    { "chunks-ext", 64, 256, ";name=value" },
+  };
+  http_server_t* server = (http_server_t*)calloc(1, sizeof(http_server_t));
+  http_request_t* request = (http_request_t*)calloc(1, sizeof(http_request_t));
+  request->server = server;
+  for (unsigned s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++) {
+    int max = shapes[s].count * (shapes[s].size + 32) + 16;
+    char* body = (char*)malloc(max);
+    int len = bench_chunked_body(body, shapes[s].count, shapes[s].size, shapes[s].extension);
+    long expect = (long)shapes[s].count * shapes[s].size;
+    int steps[] = { len, 1 };
+    char const * modes[] = { "whole", "bytewise" };
+    for (int m = 0; m < 2; m++) {
+      long bodies = 0;
+      double start = bench_now();
+      double elapsed;
+      do {
+        if (bench_chunk_pass(request, body, len, steps[m]) != expect) {
+          fprintf(stderr, "%s: %s parse differs\n", shapes[s].name, modes[m]);
+          return 1;
+        }
+        bodies++;
+        elapsed = bench_now() - start;
+      } while (elapsed < bench_seconds);
+      bench_report(shapes[s].name, len, modes[m], elapsed, bodies, bodies * len);
+    }
+    free(body);
+  }
+  free(request);
+  free(server);
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  if (argc > 1) bench_seconds = atof(argv[1]);
+  printf("%s\n", argv[0]);
+  printf(
+    "%-16s %6s  %-9s %10s %10s\n", "case", "bytes", "mode", "ns/req", "MB/s"
+  );
+  if (bench_requests_run() || bench_chunks_run()) return 1;
+  return 0;
+}
@@ -45,14 +45,22 @@
 *   #define HTTPSERVER_IMPL
 *   #include "httpserver.h"
 *
+*   C++20 programs can write handlers as coroutines with httpserver.hpp.
+*
 *   There are some #defines that can be configured. This must be done in the
 *   same file that you define HTTPSERVER_IMPL These defines have default values
 *   and will need to be #undef'd and redefined to configure them.
 *
+*     HTTP_SHARED_BUF_SIZE - default 16384 (16KB) - Size in bytes of the read
+*       buffer shared by all connections on the event loop. Requests are read
+*       into it and handled in place when they arrive complete, so idle
+*       keep-alive connections hold no read buffer at all.
+*
 *     HTTP_REQUEST_BUF_SIZE - default 1024 - The initial size in bytes of the
-*       read buffer for the request. This buffer grows automatically if it's
-*       capacity is reached but it certain environments it may be optimal to
-*       change this value.
+*       read buffer a request is moved to when it has to outlive the event it
+*       was read in. i.e: it is incomplete or the response is written later.
+*       This buffer grows automatically if it's capacity is reached but it
+*       certain environments it may be optimal to change this value.
 *
 *     HTTP_RESPONSE_BUF_SIZE - default 512 - Same as above except for the
 *       response buffer.
@@ -63,21 +71,115 @@
 *       below.
 *
 *     HTTP_KEEP_ALIVE_TIMEOUT - default 120 - The amount of seconds to keep a
-*       connection alive a keep-alive request has completed.
+*       connection alive a keep-alive request has completed. Idle connections
+*       are closed sooner when room is needed for new ones, see the
+*       max_connections and fd_headroom options.
 *
 *     HTTP_MAX_CONTENT_LENGTH - default 8388608 (8MB) - The max size in bytes
 *       of the request content length. It should be noted that the request body
 *       will be fully read into memory so while this could be redefined to a
 *       value as large as INT_MAX it will allocate a lot of memory. I would
-*       reccommend using chunked encoding for large requests.
+*       reccommend using chunked encoding or the stream_body server option for
+*       large requests.
 *
-*     HTTP_MAX_TOTAL_EST_MEM_USAGE - default 4294967296 (4GB) - This is the
-*       amount of read/write buffer space that is allowed to be allocated across
-*       all requests before new requests will get 503 responses.
+*     HTTP_MAX_TOTAL_EST_MEM_USAGE - default 4294967296 (4GB) - The default
+*       for the max_memory server option.
 *
 *     HTTP_MAX_TOKEN_LENGTH - default 8192 (8KB) - This is the max size of any
 *       non body http tokens. i.e: header names, header values, url length, etc.
 *
+*     HTTP_H2_MAX_STREAMS - default 100 - The number of streams an HTTP/2
+*       client may have open at the same time. Further streams are refused.
+*
+*     HTTP_H2_HEADER_TABLE_SIZE - default 4096 - Size in bytes of the HPACK
+*       dynamic table used to decode HTTP/2 request headers.
+*
+*   On Linux the server uses epoll by default. Define HTTP_IO_URING (along with
+*   _GNU_SOURCE) before including this file to use the completion based
+*   io_uring backend instead. It needs Linux 6.0 or newer. Connections are
+*   accepted with a multishot accept, read with multishot receives into a ring
+*   of buffers shared by all connections and timed out by a single timeout
+*   operation each instead of a timerfd, so a request costs close to no
+*   syscalls beyond the one io_uring_enter per loop iteration.
+*
+*     HTTP_URING_ENTRIES - default 256 - Size of the submission queue.
+*
+*     HTTP_URING_BUF_COUNT - default 64 - Number of receive buffers in the
+*       shared buffer ring. Must be a power of two.
+*
+*     HTTP_URING_BUF_SIZE - default 2048 - Size in bytes of each receive
+*       buffer.
+*
+*     HTTP_URING_MAX_PENDING - default 65536 (64KB) - Bytes received for a
+*       connection that isn't reading at the moment, e.g. while the application
+*       works on a chunk, before its receive is cancelled. It is re-armed once
+*       the session has caught up.
+*
+*   Define HTTP_TLS before including this file, and link with -lssl -lcrypto,
+*   to serve HTTPS with OpenSSL. See the tls_cert and tls_key server options.
+*   The handshake is done by OpenSSL, after which the session keys are handed
+*   to the kernel (kTLS) when it supports the negotiated cipher, so responses
+*   are written to the socket unencrypted and encrypted in the kernel without
+*   another copy. Connections fall back to SSL_read and SSL_write otherwise.
+*   With the http2 option set h2 is offered through ALPN. Not available with
+*   the io_uring backend.
+*
+*   Clients that resume a TLS 1.3 session can send their first request in
+*   early data (0-RTT) along with the ClientHello if the tls_early_data option
+*   is set, so with the fastopen option a phone waking up gets its request to
+*   the handler in the first flight. It is answered before the client has
+*   finished the handshake.
+*
+*   Define HTTP_TRACE to timestamp the stages every request goes through:
+*   accept, first byte read, head parsed, handler entry and exit, response,
+*   first byte written and completion. Completed requests are kept in a fixed
+*   ring per server, written without locks or allocations, and can be read
+*   from any thread as Chrome trace events with http_server_trace_json, to be
+*   opened in chrome://tracing or Perfetto. See also the server_timing option.
+*
+*     HTTP_TRACE_RING_SIZE - default 1024 - Number of completed requests
+*       kept. Must be a power of two.
+*
+*   Define HTTP_WATCHDOG, and link with -lpthread on older C libraries, to
+*   time every callback the event loop dispatches. Those that take longer than
+*   the stall_threshold option, e.g. a handler that waits on a child process,
+*   are counted in http_server_stats and reported with the request they ran
+*   for. Reports go to stderr unless a callback is set with
+*   http_server_on_stall. With the stall_stacks option a watchdog thread
+*   also interrupts the loop thread with a signal while it is stalled so the
+*   report includes the stack it was stuck in, once per stall. That changes
+*   what is measured, see the option.
+*
+*     HTTP_WATCHDOG_SIGNAL - default SIGURG - Signal used to sample the stack
+*       of the loop thread. Ignored by default so a late one does no harm.
+*
+*     HTTP_WATCHDOG_STACK_DEPTH - default 32 - Frames kept of a stalled stack.
+*
+*   Define HTTP_STATIC_MEMORY on small boards where heap fragmentation and
+*   allocation latency matter. Sessions then come from a fixed table, each
+*   with request, response and token buffers of its own, and responses from
+*   a fixed pool, all allocated statically, so the server doesn't touch the
+*   heap after http_server_init. Requests that don't fit get a 431 or 413,
+*   responses that don't fit a 500, and no more connections are accepted
+*   while all sessions are in use. HTTP/2, HTTP_TLS and HTTP_IO_URING are not
+*   available. The exceptions are watches and timers the application creates
+*   with http_server_watch and http_server_timer, which are allocated when
+*   they are created, and broadcasts, whose subscribers and chunks are
+*   allocated as they come.
+*
+*     HTTP_STATIC_SESSIONS - default 32 - Number of sessions, shared by all
+*       servers in the process. Caps the max_connections option.
+*
+*     HTTP_STATIC_REQUEST_SIZE - default 4096 - Bytes per session for the
+*       request head and a buffered body, or the ring a chunked body is read
+*       into.
+*
+*     HTTP_STATIC_RESPONSE_SIZE - default 4096 - Bytes per session for a
+*       response or response chunk, head and body.
+*
+*     HTTP_STATIC_RESPONSE_HEADERS - default 16 - Headers per response,
+*       including the ones added by the server.
+*
 *   For more details see the documentation of the interface and the example
 *   below.
 *
@@ -124,12 +226,151 @@ struct http_response_s;
 //   }
 //
 //   // Set ev.data.ptr to a foo pointer when registering the event.
+//
+// With the io_uring backend this is the ring fd and it can't be used to
+// register events. See http_server_watch and http_server_timer for a way
+// that works with every backend.
 int http_server_loop(struct http_server_s* server);
 
 // Allocates and initializes the http server. Takes a port and a function
-// pointer that is called to process requests.
+// pointer that is called to process requests. A port of 0 or less doesn't
+// listen on TCP, e.g. to serve only on the unix_socket option.
 struct http_server_s* http_server_init(int port, void (*handler)(struct http_request_s*));
 
+// Options for the listening socket and the connections accepted from it.
+// Initialize with http_server_options_init, change the fields you care about
+// and pass to http_server_set_options before calling http_server_listen.
+struct http_server_options_s {
+  // Backlog passed to listen(2). Default 128.
+  int backlog;
+  // Maximum number of connections accepted per readiness event. 0 accepts
+  // until the kernel queue is empty. When set the listening socket is
+  // registered level triggered so the remainder is picked up on the next
+  // loop iteration. Default 0.
+  int accept_batch;
+  // Use accept4 with SOCK_NONBLOCK | SOCK_CLOEXEC to save the fcntl calls per
+  // connection. Only available on Linux when compiled with _GNU_SOURCE,
+  // otherwise ignored. Default 1.
+  int use_accept4;
+  // Disable Nagle's algorithm so small responses are sent immediately. This
+  // is set on the listening socket and inherited by accepted sockets.
+  // Default 0.
+  int nodelay;
+  // Seconds for TCP_DEFER_ACCEPT. The connection is not accepted until the
+  // client has sent data. Linux only. Default 0 (off).
+  int defer_accept;
+  // Queue length for TCP_FASTOPEN. Default 0 (off).
+  int fastopen;
+  // Also listen on the port over IPv6. The IPv6 socket only takes IPv6
+  // clients, IPv4 clients keep using the IPv4 one. Default 0.
+  int ipv6;
+  // Path of a Unix domain socket to listen on as well, e.g. for a reverse
+  // proxy on the same machine, which saves the requests the TCP loopback
+  // stack. A stale socket file at the path is replaced. All listeners share
+  // the event loop and the request handler. Default NULL.
+  char const * unix_socket;
+  // Permissions the Unix domain socket is given, e.g. 0660 to let the group
+  // of the proxy connect. 0 leaves them to the umask. Default 0.
+  int unix_socket_mode;
+  // Window size in bytes for streaming Content-Length request bodies. Bodies
+  // larger than this are not buffered. The request handler is called as soon
+  // as the headers are read and reads the body in windows of up to this size
+  // with http_request_read_chunk, the same as for chunked requests. Every
+  // window reuses the same buffer. 0 buffers whole bodies. Default 0.
+  int stream_body;
+  // Speak HTTP/2 over cleartext (h2c) with clients that start the connection
+  // with the HTTP/2 preface or upgrade with Upgrade: h2c. Each stream is
+  // handed to the request handler as a request of its own and answered with
+  // the usual response functions. Not available with HTTP_STATIC_MEMORY.
+  // Default 0.
+  int http2;
+  // Paths of the PEM certificate chain and private key to serve HTTPS with.
+  // Both must be set and the library compiled with HTTP_TLS, otherwise the
+  // server speaks plain HTTP. Default NULL.
+  char const * tls_cert;
+  char const * tls_key;
+  // Bytes of TLS 1.3 early data accepted from a client resuming a session.
+  // Early data can be replayed by whoever captured it. OpenSSL lets each
+  // session ticket be used once per server process, and
+  // http_request_early_data tells the handler which requests arrived this
+  // way, e.g. to answer 425 Too Early. 0 is off. Default 0.
+  int tls_early_data;
+  // Admission control. Limits are checked when a request starts to arrive,
+  // while it is still in the shared read buffer, so an overloaded server
+  // turns clients away without allocating anything for them.
+  //
+  // Maximum number of open connections. Once reached the least recently used
+  // keep-alive connection waiting for its next request is closed to make
+  // room for a new client. Without one the listening socket is not watched
+  // until a connection closes and new clients wait in the backlog. 0 is
+  // unlimited. Default 0, HTTP_STATIC_SESSIONS and at most that with
+  // HTTP_STATIC_MEMORY.
+  int max_connections;
+  // Descriptors to leave free below the process's RLIMIT_NOFILE. A new
+  // connection that leaves fewer closes the least recently used idle
+  // keep-alive connection. An accept that fails for lack of descriptors
+  // does the same, or without an idle connection accepts the client on a
+  // descriptor held in reserve and closes it right away instead of leaving
+  // it in the backlog. 0 only handles the failed accepts. Default 16.
+  int fd_headroom;
+  // Maximum number of requests handed to the request handler that haven't
+  // been responded to yet. Further requests get a canned 503 and HTTP/2
+  // streams are refused. 0 is unlimited. Default 0.
+  int max_inflight;
+  // Bytes of read and write buffers allowed across all connections before new
+  // requests get a canned 503. Default HTTP_MAX_TOTAL_EST_MEM_USAGE.
+  long max_memory;
+  // Largest request in bytes, the head plus a Content-Length body that is
+  // buffered, a single connection may read into memory. Bigger heads get a
+  // 431 and bigger bodies a 413 as soon as their size is known. 0 leaves
+  // only HTTP_MAX_CONTENT_LENGTH. Default 0.
+  int max_request_size;
+  // Seconds a client has to send the complete request head, counted from the
+  // connection or, on keep-alive connections, the first byte of the request.
+  // Unlike the request timeout it isn't extended by each read so clients
+  // trickling in a header a byte at a time don't hold on to a connection.
+  // 0 uses HTTP_REQUEST_TIMEOUT between reads. Default 0.
+  int header_timeout;
+  // Only tokenize the request line and the body framing headers while
+  // parsing. The other headers are tokenized the first time one is looked up
+  // with http_request_header or http_request_iterate_headers, so handlers
+  // that never read them don't pay for long cookie and user agent headers.
+  // Default 0.
+  int lazy_headers;
+  // Bytes a low priority response, see http_request_set_priority, writes per
+  // turn. After the first slice the rest of it is written a slice at a time
+  // when no other connection has anything ready. Default 16384.
+  int low_priority_slice;
+  // Events the loop handles while low priority responses wait before one of
+  // them gets a slice anyway, so they go on under steady normal priority
+  // traffic. 0 only writes them when nothing else is ready. Default 8.
+  int low_priority_share;
+  // Add a Server-Timing header to responses with the milliseconds spent
+  // receiving the request (recv) and in the application until it responded
+  // (app). Only with HTTP_TRACE. Default 0.
+  int server_timing;
+  // Milliseconds a callback dispatched by the event loop may take before it
+  // counts as a stall. Only with HTTP_WATCHDOG. 0 is off. Default 0.
+  int stall_threshold;
+  // Sample the stack of the loop thread during a stall by interrupting it
+  // with HTTP_WATCHDOG_SIGNAL. Calls that wait with a timeout aren't
+  // restarted after a signal, nanosleep, poll, select, epoll_wait and
+  // socket calls with SO_RCVTIMEO or SO_SNDTIMEO among them. Such a call in
+  // the stalled callback returns early with EINTR, cutting the stall short.
+  // Only with HTTP_WATCHDOG. Default 0.
+  int stall_stacks;
+};
+
+// Fills in the default options.
+void http_server_options_init(struct http_server_options_s* options);
+
+// Copies the options into the server. Must be called before
+// http_server_listen or http_server_listen_poll.
+void http_server_set_options(
+  struct http_server_s* server,
+  struct http_server_options_s const* options
+);
+
 // Starts the event loop and the server listening. During normal operation this
 // function will not return. Return value is the error code if the server fails
 // to start.
@@ -147,6 +388,96 @@ int http_server_listen_poll(struct http_server_s* server);
 // 0.
 int http_server_poll(struct http_server_s* server);
 
+struct http_watch_s;
+struct http_timer_s;
+
+#define HTTP_READABLE 1
+#define HTTP_WRITABLE 2
+
+// Watches an application fd, e.g. a pipe, an eventfd or the poll descriptors
+// of a sound card mixer, on the server's event loop so it can be handled on
+// the same thread as the requests. events is HTTP_READABLE, HTTP_WRITABLE or
+// both. cb is called with the fd, the events that are ready and data for as
+// long as they stay ready, i.e. watches are level triggered. An error or
+// hang up on the fd is reported as all watched events. Works with every
+// backend. Returns NULL if the fd can't be watched.
+struct http_watch_s* http_server_watch(
+  struct http_server_s* server,
+  int fd,
+  int events,
+  void (*cb)(int fd, int events, void* data),
+  void* data
+);
+
+// Stops watching and frees the watch. The fd is left open, close it after
+// this call. Safe to call from any watch or timer callback, including the
+// watch's own.
+void http_server_unwatch(struct http_watch_s* watch);
+
+// Calls cb with data on the server's event loop after ms milliseconds, and
+// every ms milliseconds after that if repeat is set. A one-shot timer is
+// freed once its callback is called.
+struct http_timer_s* http_server_timer(
+  struct http_server_s* server,
+  int ms,
+  int repeat,
+  void (*cb)(void* data),
+  void* data
+);
+
+// Stops the timer and frees it. Safe to call from any watch or timer
+// callback, including the timer's own if it repeats. A one-shot timer can't
+// be cancelled once its callback was called.
+void http_server_cancel_timer(struct http_timer_s* timer);
+
+// Writes the requests recorded most recently, newest first, to buf as Chrome
+// trace event JSON and returns its length. Older requests that don't fit into
+// len bytes are left out. Safe to call from any thread. Only available when
+// compiled with HTTP_TRACE.
+int http_server_trace_json(struct http_server_s* server, char* buf, int len);
+
+struct http_server_stats_s {
+  // Open connections and requests the handler hasn't responded to yet.
+  int connections;
+  int inflight;
+  // Bytes of request and response buffers in use.
+  long memused;
+  // Callbacks that took longer than the stall_threshold option and the
+  // longest of them in microseconds. Only counted with HTTP_WATCHDOG.
+  long stalls;
+  long max_stall_us;
+  // Keep-alive connections waiting for their next request, and the idle
+  // connections closed to make room for new ones.
+  int idle;
+  long evictions;
+};
+
+// Fills in the current counters of the server. Call it on the thread the
+// server runs on, e.g. from a request handler.
+void http_server_stats(struct http_server_s* server, struct http_server_stats_s* stats);
+
+// A callback of the event loop that took longer than the stall_threshold
+// option.
+struct http_stall_s {
+  long us;
+  // Method and target of the request the callback ran for, empty if it
+  // wasn't for a request, e.g. a timer.
+  char const * route;
+  // Return addresses on the loop thread while it was stalled, innermost
+  // first, as backtrace_symbols takes them. depth is 0 without the
+  // stall_stacks option or if the callback returned before the watchdog got
+  // to look.
+  void* const * stack;
+  int depth;
+};
+
+// Sets a callback that is called on the loop thread after each stall instead
+// of writing it to stderr. Only available when compiled with HTTP_WATCHDOG.
+void http_server_on_stall(
+  struct http_server_s* server,
+  void (*stall_cb)(struct http_server_s* server, struct http_stall_s const * stall)
+);
+
 // Returns the request method as it was read from the HTTP request line.
 struct http_string_s http_request_method(struct http_request_s* request);
 
@@ -155,7 +486,8 @@ struct http_string_s http_request_method(struct http_request_s* request);
 struct http_string_s http_request_target(struct http_request_s* request);
 
 // Returns the request body. If no request body was sent buf and len of the
-// string will be set to 0.
+// string will be set to 0. The same applies to chunked and streamed bodies
+// which are read with http_request_read_chunk instead.
 struct http_string_s http_request_body(struct http_request_s* request);
 
 // Returns the request header value for the given header key. The key is case
@@ -180,6 +512,22 @@ void* http_request_userdata(struct http_request_s* request);
 // of.
 void http_request_set_userdata(struct http_request_s* request, void* data);
 
+// Returns the server the request was received by.
+struct http_server_s* http_request_server(struct http_request_s* request);
+
+// Sets a callback that is called if the connection goes away, or the HTTP/2
+// stream is reset, before the response to the request has been completed.
+// This happens while the application holds on to the request between the
+// callbacks of a streamed response or request body, typically while it waits
+// on a timer or watch. The request is released once close_cb returns and
+// must not be used after. Responding with http_respond or
+// http_respond_chunk_end clears the callback, as does passing NULL. It is not
+// called for requests passed to another thread with http_request_async.
+void http_request_on_close(
+  struct http_request_s* request,
+  void (*close_cb)(struct http_request_s*)
+);
+
 #define HTTP_KEEP_ALIVE 1
 #define HTTP_CLOSE 0
 
@@ -192,6 +540,25 @@ void http_request_set_userdata(struct http_request_s* request, void* data);
 // keep the connection alive.
 void http_request_connection(struct http_request_s* request, int directive);
 
+#define HTTP_PRIORITY_NORMAL 0
+#define HTTP_PRIORITY_LOW 1
+
+// Sets the priority class of the response to the request, HTTP_PRIORITY_NORMAL
+// by default. Low priority responses, say downloads or assets, are written in
+// slices of the low_priority_slice option. The event loop gets back to them
+// once the connections with normal priority have been served, or after the
+// low_priority_share option's worth of their events, so those stay
+// responsive while large responses are under way. The class is picked
+// per request, e.g. by target or method, and has no effect on HTTP/2 streams.
+// Call it before responding.
+void http_request_set_priority(struct http_request_s* request, int priority);
+
+// Returns 1 if the request arrived in TLS 1.3 early data, before the client
+// finished the handshake, see the tls_early_data option. Such a request may
+// be a replay, it is up to the handler to decide whether it is safe to act
+// on, 0 otherwise.
+int http_request_early_data(struct http_request_s* request);
+
 // When reading in the HTTP request the server allocates a buffer to store
 // the request details such as the headers, method, body, etc. By default this
 // memory will be freed when http_respond is called. This function lets you
@@ -216,16 +583,42 @@ void http_response_header(struct http_response_s* response, char const * key, ch
 // http_respond has been called.
 void http_response_body(struct http_response_s* response, char const * body, int length);
 
+// Sets the body to the count parts one after the other, e.g. the segments of
+// a template with the values that go between them. The parts are copied
+// straight into the buffer the response is written from so the whole body
+// never has to be put together first. The array and the memory the parts
+// point to are safe to free after http_respond has been called, like a body.
+void http_response_body_parts(
+  struct http_response_s* response,
+  struct http_string_s const * parts,
+  int count
+);
+
 // Starts writing the response to the client. Any memory allocated for the
 // response body or response headers is safe to free after this call.
 void http_respond(struct http_request_s* request, struct http_response_s* response);
 
+// Thread safe version of http_respond. Queues the response to be written on
+// the server's event loop thread and wakes the loop, so slow work can be done
+// on another thread without touching any server state. The request must have
+// been marked with http_request_async in the request handler first.
+void http_respond_async(struct http_request_s* request, struct http_response_s* response);
+
+// Marks the request as being completed from another thread with
+// http_respond_async. Call this from the request handler before handing the
+// request off. The request and its data stay valid until the response has
+// been queued, even if the client disconnects or times out in the meantime,
+// in which case the response is discarded.
+void http_request_async(struct http_request_s* request);
+
 // Writes a chunk to the client. The notify_done callback will be called when
 // the write is complete. This call consumes the response so a new response
 // will need to be initialized for each chunk. The response status of the
 // request will be the response status that is set when http_respond_chunk is
 // called the first time. Any headers set for the first call will be sent as
-// the response headers. Headers set for subsequent calls will be ignored.
+// the response headers. Headers set for subsequent calls will be ignored. An
+// empty body is not written as a chunk, it would end the response, so the
+// first call can send just the head.
 void http_respond_chunk(
   struct http_request_s* request,
   struct http_response_s* response,
@@ -234,16 +627,60 @@ void http_respond_chunk(
 
 // Ends the chunked response. Any headers set before this call will be included
 // as what the HTTP spec refers to as 'trailers' which are essentially more
-// response headers.
+// response headers. Trailers are not sent on HTTP/2 streams.
 void http_respond_chunk_end(struct http_request_s* request, struct http_response_s* response);
 
+#define HTTP_BROADCAST_DROP 0
+#define HTTP_BROADCAST_DISCONNECT 1
+
+// Creates a broadcast, a group of chunked responses that all get the same
+// chunks, e.g. event streams. A chunk sent to it is serialized once into a
+// reference counted buffer that every subscriber writes out at its own pace.
+// Up to backlog chunks are queued for a subscriber that is still writing an
+// earlier one. A slow subscriber with a full backlog misses the chunk with
+// HTTP_BROADCAST_DROP or has its connection closed with
+// HTTP_BROADCAST_DISCONNECT. Broadcasts are used on the server's event loop
+// only.
+struct http_broadcast_s* http_broadcast_init(
+  struct http_server_s* server,
+  int backlog,
+  int policy
+);
+
+// Starts a chunked response like http_respond_chunk does with response and
+// subscribes the request to the broadcast. The chunks that follow are the
+// ones sent to the broadcast. The request is unsubscribed when the client
+// goes away.
+void http_broadcast_subscribe(
+  struct http_broadcast_s* broadcast,
+  struct http_request_s* request,
+  struct http_response_s* response
+);
+
+// Sends body as the next chunk of every subscribed response. The body is
+// copied once before this returns. An empty body is not sent.
+void http_broadcast_send(struct http_broadcast_s* broadcast, char const * body, int length);
+
+// Unsubscribes the request and ends its response once the chunk it is
+// writing, if any, has been written. Chunks queued for it are dropped.
+void http_broadcast_unsubscribe(struct http_request_s* request);
+
+// Returns the number of subscribed requests.
+int http_broadcast_count(struct http_broadcast_s* broadcast);
+
+// Unsubscribes all requests and frees the broadcast.
+void http_broadcast_free(struct http_broadcast_s* broadcast);
+
 // If a request has Transfer-Encoding: chunked you cannot read the body in the
 // typical way. Instead you need to call this function to read one chunk at a
 // time. You pass a callback that will be called when the chunk is ready. When
 // the callback is called you can use `http_request_chunk` to get the current
 // chunk. When done with that chunk call this function again to request the
 // next chunk. If the chunk has size 0 then the request body has been completely
-// read and you can now respond.
+// read and you can now respond. Content-Length bodies above the stream_body
+// server option are read the same way, one window at a time. HTTP/2 request
+// bodies are received in full before the handler is called and come as a
+// single chunk.
 void http_request_read_chunk(
   struct http_request_s* request,
   void (*chunk_cb)(struct http_request_s*)
@@ -253,6 +690,16 @@ void http_request_read_chunk(
 // the next call to `http_request_read_chunk`.
 struct http_string_s http_request_chunk(struct http_request_s* request);
 
+// Zero copy version of http_request_chunk. Chunked bodies are read into a ring
+// buffer so a chunk can wrap around its end. Fills in the one or two parts of
+// the current chunk in order and returns how many there are, 0 for the final
+// empty chunk. http_request_chunk has to copy a wrapped chunk to return it in
+// one piece.
+int http_request_chunk_spans(
+  struct http_request_s* request,
+  struct http_string_s spans[2]
+);
+
 #ifdef __cplusplus
 }
 #endif
@@ -283,13 +730,24 @@ int main() {
 #ifndef HTTPSERVER_IMPL_ONCE
 #define HTTPSERVER_IMPL_ONCE
 
-#ifdef __linux__
+#if defined(__linux__) && defined(HTTP_IO_URING)
+#define IO_URING
+#ifdef HTTP_TLS
+#error "HTTP_TLS is not supported by the io_uring backend"
+#endif
+#elif defined(__linux__)
 #define EPOLL
-#define _POSIX_C_SOURCE 199309L
+#define _POSIX_C_SOURCE 200112L
 #else
 #define KQUEUE
 #endif
 
+// SA_RESTART for the watchdog's signal is an XSI extension glibc hides when
+// only _POSIX_C_SOURCE is asked for.
+#if defined(__linux__) && defined(HTTP_WATCHDOG) && !defined(_XOPEN_SOURCE)
+#define _XOPEN_SOURCE 600
+#endif
+
 #include <time.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -298,21 +756,60 @@ int main() {
 #include <netdb.h>
 #include <unistd.h>
 #include <string.h>
-#include <stdarg.h>
 #include <signal.h>
 #include <limits.h>
 #include <assert.h>
+#include <stddef.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#if defined(__linux__) && defined(_GNU_SOURCE)
+#define HS_HAVE_ACCEPT4
+#endif
 
 #ifdef KQUEUE
 #include <sys/event.h>
+#elif defined(IO_URING)
+#include <poll.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 #else
 #include <sys/epoll.h>
 #include <sys/timerfd.h>
 #endif
 
+#ifndef KQUEUE
+#include <stdint.h>
+#include <sys/eventfd.h>
+#endif
+
+#ifdef HTTP_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+#ifdef HTTP_TRACE
+#include <stdint.h>
+#endif
+
+#ifdef HTTP_WATCHDOG
+#include <stdint.h>
+#include <pthread.h>
+#include <execinfo.h>
+#endif
+
+#if defined(HTTP_STATIC_MEMORY) && (defined(IO_URING) || defined(HTTP_TLS))
+#error "HTTP_STATIC_MEMORY is not supported with HTTP_IO_URING or HTTP_TLS"
+#endif
+
 // *** macro definitions
 
 // Application configurable
+#define HTTP_SHARED_BUF_SIZE 16384
 #define HTTP_REQUEST_BUF_SIZE 1024
 #define HTTP_RESPONSE_BUF_SIZE 512
 #define HTTP_REQUEST_TIMEOUT 20
@@ -320,9 +817,50 @@ int main() {
 #define HTTP_MAX_CONTENT_LENGTH 8388608 // 8mb
 #define HTTP_MAX_TOKEN_LENGTH 8192 // 8kb
 #define HTTP_MAX_TOTAL_EST_MEM_USAGE 4294967296 // 4gb
+#define HTTP_H2_MAX_STREAMS 100
+#define HTTP_H2_HEADER_TABLE_SIZE 4096
+#define HTTP_TRACE_RING_SIZE 1024
+#define HTTP_WATCHDOG_SIGNAL SIGURG
+#define HTTP_WATCHDOG_STACK_DEPTH 32
+#define HTTP_STATIC_SESSIONS 32
+#define HTTP_STATIC_REQUEST_SIZE 4096
+#define HTTP_STATIC_RESPONSE_SIZE 4096
+#define HTTP_STATIC_RESPONSE_HEADERS 16
 
 #define HTTP_MAX_HEADER_COUNT 127
 
+// Enough tokens for the request line, the maximum number of headers and the
+// body, so the shared token array never has to grow.
+#define HS_SHARED_TOKEN_COUNT (HTTP_MAX_HEADER_COUNT * 2 + 6)
+
+// Room a chunked body needs behind the head with HTTP_STATIC_MEMORY.
+#define HS_STATIC_MIN_RING 512
+
+// Responses in the static pool. Enough for every session to have one on the
+// way while another is being built.
+#define HS_STATIC_RESPONSES (HTTP_STATIC_SESSIONS * 2)
+
+// io_uring backend sizing. The provided buffer ring is shared by all
+// connections and buffers are returned to the kernel as soon as their data has
+// been copied out.
+#define HTTP_URING_ENTRIES 256
+#define HTTP_URING_BUF_COUNT 64
+#define HTTP_URING_BUF_SIZE 2048
+#define HTTP_URING_MAX_PENDING 65536
+
+// Length of an IMF-fixdate, e.g. Sun, 06 Nov 1994 08:49:37 GMT.
+#define HS_DATE_LEN 29
+
+// Room for a status line for every status, e.g. HTTP/1.1 200 OK.
+#define HS_STATUS_LINES_SIZE 8192
+
+// A server listens on IPv4, IPv6 and a Unix domain socket at most.
+#define HS_MAX_LISTENERS 3
+
+// Number of hash buckets used to index request header names. Must be a power
+// of two.
+#define HS_HEADER_BUCKETS 32
+
 #define HTTP_FLAG_SET(var, flag) var |= flag
 #define HTTP_FLAG_CLEAR(var, flag) var &= ~flag
 #define HTTP_FLAG_CHECK(var, flag) (var & flag)
@@ -353,6 +891,7 @@ int main() {
 #define HS_PF_TRANSFER_ENCODING 0x1
 #define HS_PF_CONTENT_LENGTH 0x2
 #define HS_PF_CHUNKED 0x4
+#define HS_PF_LAZY 0x8
 
 // parser sub states
 #define HTTP_LWS 2
@@ -377,17 +916,144 @@ int main() {
 #define HTTP_SESSION_WRITE 3
 #define HTTP_SESSION_READ_CHUNK 4
 #define HTTP_SESSION_NOP 5
+#define HTTP_SESSION_H2 6
+#define HTTP_SESSION_HANDSHAKE 7
 
 // http session flags
 #define HTTP_RESPONSE_READY 0x4
 #define HTTP_AUTOMATIC 0x8
 #define HTTP_RESPONSE_PAUSED 0x10
 #define HTTP_CHUNKED_RESPONSE 0x20
+#define HTTP_ASYNC 0x40
+#define HTTP_ENDED 0x80
+#define HTTP_STREAM_BODY 0x100
+#define HTTP_IN_HANDLER 0x200
+#define HTTP_INFLIGHT 0x400
+#define HTTP_DEFERRED 0x800
+#define HTTP_IDLE 0x1000
+
+// fixed token slots for the request line and body
+#define HS_SLOT_BODY 3
+#define HS_SLOT_COUNT 4
+
+// well-known header ids. These are resolved once while parsing so internal
+// lookups don't need to hash or compare the header name.
+#define HS_H_HOST 0
+#define HS_H_EXPECT 1
+#define HS_H_UPGRADE 2
+#define HS_H_CONNECTION 3
+#define HS_H_CONTENT_TYPE 4
+#define HS_H_CONTENT_LENGTH 5
+#define HS_H_TRANSFER_ENCODING 6
+#define HS_H_COUNT 7
+#define HS_H_UNKNOWN -1
+
+#define HS_HEADER_KEY_TOKEN(request, n) ((request)->header_base + 2 * ((n) - 1))
+
+// http/2 framing
+#define HS_H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HS_H2_PREFACE_LEN 24
+#define HS_H2_SWITCHING \
+  "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n"
+#define HS_H2_FRAME_HEADER 9
+#define HS_H2_MAX_FRAME 16384
+#define HS_H2_MAX_HEADER_BLOCK 65536
+#define HS_H2_DEFAULT_WINDOW 65535
+// Frame bytes queued for the socket before no more response data is framed.
+#define HS_H2_OUT_HIGH 65536
+
+// http/2 frame types
+#define HS_H2_DATA 0x0
+#define HS_H2_HEADERS 0x1
+#define HS_H2_PRIORITY 0x2
+#define HS_H2_RST_STREAM 0x3
+#define HS_H2_SETTINGS 0x4
+#define HS_H2_PUSH_PROMISE 0x5
+#define HS_H2_PING 0x6
+#define HS_H2_GOAWAY 0x7
+#define HS_H2_WINDOW_UPDATE 0x8
+#define HS_H2_CONTINUATION 0x9
+
+// http/2 frame flags
+#define HS_H2_END_STREAM 0x1
+#define HS_H2_ACK 0x1
+#define HS_H2_END_HEADERS 0x4
+#define HS_H2_PADDED 0x8
+#define HS_H2_PRIORITY_FLAG 0x20
+
+// http/2 settings
+#define HS_H2_SETTINGS_ENABLE_PUSH 0x2
+#define HS_H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define HS_H2_SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define HS_H2_SETTINGS_MAX_FRAME_SIZE 0x5
+
+// http/2 error codes
+#define HS_H2_PROTOCOL_ERROR 0x1
+#define HS_H2_FLOW_CONTROL_ERROR 0x3
+#define HS_H2_STREAM_CLOSED 0x5
+#define HS_H2_FRAME_SIZE_ERROR 0x6
+#define HS_H2_REFUSED_STREAM 0x7
+#define HS_H2_CANCEL 0x8
+#define HS_H2_COMPRESSION_ERROR 0x9
+#define HS_H2_ENHANCE_YOUR_CALM 0xb
+
+// http/2 connection flags
+#define HS_H2C_PREFACE 0x1
+#define HS_H2C_BUSY 0x2
+#define HS_H2C_FAILED 0x4
+#define HS_H2C_CLOSING 0x8
+
+// http/2 stream flags
+#define HS_H2S_END_REMOTE 0x1
+#define HS_H2S_HANDLED 0x2
+#define HS_H2S_HEADERS_SENT 0x4
+#define HS_H2S_ENDED 0x8
+#define HS_H2S_DONE 0x10
+#define HS_H2S_NOTIFY 0x20
+#define HS_H2S_BODY_READ 0x40
+
+// hpack
+#define HS_HPACK_STATIC_COUNT 62
+#define HS_HPACK_FIRST_HEADER 15
+#define HS_HPACK_STATUS 8
+#define HS_HPACK_CONTENT_LENGTH 28
+#define HS_HPACK_DATE 33
+#define HS_HPACK_MAX_ENTRIES (HTTP_H2_HEADER_TABLE_SIZE / 32)
 
 // http version indicators
 #define HTTP_1_0 0
 #define HTTP_1_1 1
 
+// request trace stages, in the order a request normally reaches them
+#define HS_TRACE_ACCEPT 0
+#define HS_TRACE_READ 1
+#define HS_TRACE_PARSED 2
+#define HS_TRACE_HANDLER 3
+#define HS_TRACE_HANDLER_EXIT 4
+#define HS_TRACE_RESPOND 5
+#define HS_TRACE_WRITE 6
+#define HS_TRACE_DONE 7
+#define HS_TRACE_COUNT 8
+#define HS_LABEL_SIZE 48
+
+#ifdef HTTP_TRACE
+#define HS_TRACE(request, stage) hs_trace_stamp(request, stage)
+#else
+#define HS_TRACE(request, stage) ((void)0)
+#endif
+
+#ifdef HTTP_WATCHDOG
+#define HS_DISPATCH_BEGIN(server) hs_watchdog_begin(server)
+#define HS_DISPATCH_END(server) hs_watchdog_end(server)
+#define HS_DISPATCH_ROUTE(request) hs_watchdog_route(request)
+#define HS_DISPATCH_SESSION(request) hs_watchdog_session(request)
+#else
+#define HS_DISPATCH_BEGIN(server) ((void)0)
+#define HS_DISPATCH_END(server) ((void)0)
+#define HS_DISPATCH_ROUTE(request) ((void)0)
+#define HS_DISPATCH_SESSION(request) ((void)0)
+#endif
+
 // *** declarations ***
 
 // structs
@@ -412,6 +1078,17 @@ typedef struct {
   char sub_state;
 } http_parser_t;
 
+// Chunked request bodies are read into a ring that takes up the read buffer
+// after the headers. Positions are logical, position p is stored at
+// buf[start + p % size]. Everything before rd has been consumed and the next
+// read goes to wr.
+typedef struct {
+  int start;
+  int size;
+  int rd;
+  int wr;
+} hs_ring_t;
+
 typedef struct {
   http_token_t* buf;
   int capacity;
@@ -422,24 +1099,97 @@ typedef struct {
 typedef void (*epoll_cb_t)(struct epoll_event*);
 #endif
 
+#ifdef HTTP_TRACE
+// Monotonic nanoseconds at which the request reached each stage, 0 if it
+// hasn't. The label is the request line, copied when the handler is called
+// since the request buffer may be gone by the time the request completes.
+typedef struct {
+  uint64_t stamps[HS_TRACE_COUNT];
+  char label[HS_LABEL_SIZE];
+  char timing[64];
+} hs_trace_t;
+
+// A completed request in the trace ring. seq is odd while the loop thread
+// writes the record so readers on other threads can tell a torn copy.
+typedef struct {
+  unsigned seq;
+  unsigned id;
+  uint64_t stamps[HS_TRACE_COUNT];
+  char label[HS_LABEL_SIZE];
+} hs_trace_record_t;
+#endif
+
+#ifdef IO_URING
+typedef void (*uring_cb_t)(struct io_uring_cqe*);
+
+typedef struct {
+  int fd;
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned sq_local_tail;
+  unsigned to_submit;
+  struct io_uring_sqe* sqes;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe* cqes;
+  struct io_uring_buf_ring* br;
+  unsigned short br_tail;
+  char* bufs;
+} hs_uring_t;
+#endif
+
 typedef struct http_ev_cb_s {
 #ifdef KQUEUE
   void (*handler)(struct kevent* ev);
+#elif defined(IO_URING)
+  uring_cb_t handler;
 #else
   epoll_cb_t handler;
 #endif
 } ev_cb_t;
 
+// A response chunk serialized once for all subscribers of a broadcast. The
+// size line is followed by the body and its CRLF. Freed once the last
+// reference is released.
+typedef struct {
+  char* buf;
+  int len;
+  int head;
+  int refs;
+} hs_shared_chunk_t;
+
 typedef struct http_request_s {
 #ifdef KQUEUE
   void (*handler)(struct kevent* ev);
+#elif defined(IO_URING)
+  uring_cb_t handler;
+  struct __kernel_timespec ts;
+  // Received bytes from the completion currently being handled. They are
+  // moved into pending if the session is not reading when they arrive.
+  char const * rx;
+  int rx_len;
+  char* pending;
+  int pending_len;
+  int inflight;
+  int timeout_start;
+  // Tick at which the armed timeout operation completes.
+  int timeout_end;
+  char uring_flags;
 #else
   epoll_cb_t handler;
   epoll_cb_t timer_handler;
   int timerfd;
 #endif
   void (*chunk_cb)(struct http_request_s*);
+  void (*close_cb)(struct http_request_s*);
   void* data;
+  // Set while the session writes a broadcast chunk straight from the shared
+  // buffer, buf then points into it.
+  hs_shared_chunk_t* shared;
+  struct hs_subscriber_s* subscriber;
   http_parser_t parser;
   int state;
   int socket;
@@ -451,40 +1201,310 @@ typedef struct http_request_s {
   struct http_server_s* server;
   http_token_t token;
   http_token_dyn_t tokens;
-  char flags;
+  http_token_t slots[HS_SLOT_COUNT];
+  hs_ring_t ring;
+  // Header names are indexed by number (1 based, 0 meaning none) into a
+  // chained hash table. Header n has its key token at
+  // HS_HEADER_KEY_TOKEN(request, n) and its value in the token directly after
+  // it. The header tokens start after the request line, or after the body
+  // token when they were tokenized lazily.
+  int header_base;
+  unsigned char header_buckets[HS_HEADER_BUCKETS];
+  unsigned char header_next[HTTP_MAX_HEADER_COUNT + 2];
+  unsigned char known_headers[HS_H_COUNT];
+  int flags;
+  int priority;
+  // Next low priority session waiting for its turn to write.
+  struct http_request_s* deferred_next;
+  // Neighbours in the server's list of idle keep-alive sessions.
+  struct http_request_s* idle_prev;
+  struct http_request_s* idle_next;
+  // Set on HTTP/2 connections and on the requests of their streams
+  // respectively.
+  struct hs_h2_conn_s* h2;
+  struct hs_h2_stream_s* stream;
+#ifdef HTTP_TLS
+  SSL* tls;
+  // Set once the handshake is done if the kernel encrypts what is written
+  // to the socket, writes then skip OpenSSL.
+  char ktls_send;
+  // Set while the session may still read early data, and from the time early
+  // data is read until data sent after the handshake is.
+  char tls_early;
+  char early_data;
+#endif
+#ifdef HTTP_TRACE
+  hs_trace_t trace;
+#endif
+#ifdef HTTP_WATCHDOG
+  // Request line of the request the connection is on, for stall reports.
+  char route[HS_LABEL_SIZE];
+#endif
 } http_request_t;
 
+// A request subscribed to a broadcast. busy is set from the time a chunk
+// starts being written until it has been, the chunks sent meanwhile wait in
+// the queue ring.
+typedef struct hs_subscriber_s {
+  struct http_broadcast_s* broadcast;
+  http_request_t* request;
+  struct hs_subscriber_s* next;
+  struct hs_subscriber_s* prev;
+  hs_shared_chunk_t** queue;
+  int head;
+  int count;
+  int busy;
+} hs_subscriber_t;
+
+typedef struct http_broadcast_s {
+  struct http_server_s* server;
+  hs_subscriber_t* subscribers;
+  // The subscriber a send visits next. Subscribers can go away during a send
+  // when their connection fails.
+  hs_subscriber_t* cursor;
+  int count;
+  int backlog;
+  int policy;
+} http_broadcast_t;
+
+// An HPACK dynamic table entry. The name and value follow it in the same
+// allocation.
+typedef struct {
+  int name_len;
+  int value_len;
+} hs_hpack_entry_t;
+
+// Ring of dynamic table entries, the newest at head.
+typedef struct {
+  hs_hpack_entry_t* entries[HS_HPACK_MAX_ENTRIES];
+  int head;
+  int count;
+  int size;
+  int max_size;
+} hs_hpack_table_t;
+
+typedef struct hs_h2_stream_s {
+  http_request_t* request;
+  // The connection session, NULL once the stream is closed while the
+  // application still has to respond.
+  http_request_t* session;
+  struct hs_h2_stream_s* next;
+  int id;
+  int flags;
+  int window;
+  int header_len;
+  // Response data that is yet to be framed.
+  char* out;
+  int out_len;
+  int out_sent;
+  int out_cap;
+} hs_h2_stream_t;
+
+typedef struct hs_h2_conn_s {
+  char rbuf[HS_H2_MAX_FRAME + HS_H2_FRAME_HEADER];
+  int rlen;
+  // Bytes read before the switch to HTTP/2. They are handled as if read
+  // from the socket before anything else is.
+  char* in;
+  int in_len;
+  int in_pos;
+  // Bytes of the upgrade request that haven't been read yet, its final LF.
+  int skip;
+  // Frames waiting for the write in progress to complete.
+  char* out;
+  int out_len;
+  int out_cap;
+  // Header block being collected from HEADERS and CONTINUATION frames.
+  char* block;
+  int block_len;
+  int block_cap;
+  int block_stream;
+  int block_flags;
+  hs_hpack_table_t hpack;
+  hs_h2_stream_t* streams;
+  int stream_count;
+  int last_stream_id;
+  int window;
+  int initial_window;
+  int flags;
+} hs_h2_conn_t;
+
+// A listening socket. Its events are handled by hs_server_listen_cb.
+typedef struct {
+#ifdef KQUEUE
+  void (*handler)(struct kevent* ev);
+#elif defined(IO_URING)
+  uring_cb_t handler;
+  char accept_armed;
+#else
+  epoll_cb_t handler;
+#endif
+  struct http_server_s* server;
+  int socket;
+} hs_listener_t;
+
 typedef struct http_server_s {
 #ifdef KQUEUE
   void (*handler)(struct kevent* ev);
+#elif defined(IO_URING)
+  uring_cb_t handler;
+  uring_cb_t timer_handler;
+  uring_cb_t async_handler;
+  hs_uring_t ring;
+  struct __kernel_timespec ts;
+  uint64_t async_count;
+  int ticks;
 #else
   epoll_cb_t handler;
   epoll_cb_t timer_handler;
+  epoll_cb_t async_handler;
 #endif
   long memused;
-  int socket;
+  // Responses queued by http_respond_async from other threads, most recent
+  // first. Pushed with a CAS and taken as a whole by the loop thread.
+  struct http_response_s* async_head;
+  int async_fd;
+  hs_listener_t listeners[HS_MAX_LISTENERS];
+  int listener_count;
   int port;
   int loop;
   int timerfd;
-  socklen_t len;
   void (*request_handler)(http_request_t*);
-  struct sockaddr_in addr;
-  char* date;
+  // The current time for the Date header, updated every tick.
+  char date[HS_DATE_LEN + 1];
+  struct http_server_options_s options;
+  // Read buffer and token array shared by all sessions. Only one session can
+  // borrow them at a time and it gives them back before the event loop moves
+  // on to the next event.
+  char* rbuf;
+  http_token_t* rtokens;
+  http_request_t* rbuf_owner;
+  // Open connections and requests the handler is working on, for the
+  // admission limits in the options.
+  int connections;
+  int inflight;
+  char accept_paused;
+  // Low priority sessions waiting to write their next slice, oldest first,
+  // and the one being given its slice.
+  http_request_t* deferred_head;
+  http_request_t* deferred_tail;
+  http_request_t* resumed;
+  // Events handled since a deferred session last had a slice.
+  int deferred_turns;
+  // Keep-alive sessions waiting for their next request, least recently used
+  // first.
+  http_request_t* idle_head;
+  http_request_t* idle_tail;
+  int idle_count;
+  long evictions;
+  // Descriptor given up to turn a client away when accepting runs out, and
+  // the soft limit on descriptors read when the server starts listening.
+  int reserve_fd;
+  int fd_limit;
+#ifdef HTTP_TLS
+  SSL_CTX* tls;
+#endif
+#ifdef HTTP_TRACE
+  // Completed requests. Only the loop thread writes, head counts the
+  // records written so far.
+  hs_trace_record_t trace_ring[HTTP_TRACE_RING_SIZE];
+  unsigned trace_head;
+#endif
+#ifdef HTTP_WATCHDOG
+  // Start of the callback being dispatched, 0 between callbacks, and the
+  // number of callbacks dispatched. Read by the watchdog thread.
+  uint64_t dispatch_start;
+  unsigned dispatch_seq;
+  pthread_t loop_thread;
+  pthread_t watchdog;
+  // Route of the callback being dispatched and the stack sampled during
+  // callback stack_seq.
+  char stall_route[HS_LABEL_SIZE];
+  void* stall_stack[HTTP_WATCHDOG_STACK_DEPTH];
+  int stall_depth;
+  unsigned stall_seq;
+  long stalls;
+  long max_stall_us;
+  void (*stall_cb)(struct http_server_s*, struct http_stall_s const *);
+#endif
 } http_server_t;
 
+// An application fd watched on the event loop.
+typedef struct http_watch_s {
+#ifdef KQUEUE
+  void (*handler)(struct kevent* ev);
+#elif defined(IO_URING)
+  uring_cb_t handler;
+  // A poll is in flight. Once closed the watch is freed by its completion.
+  char armed;
+  char closed;
+#else
+  epoll_cb_t handler;
+#endif
+  http_server_t* server;
+  void (*cb)(int fd, int events, void* data);
+  void* data;
+  int fd;
+  int events;
+} http_watch_t;
+
+typedef struct http_timer_s {
+#ifdef KQUEUE
+  void (*handler)(struct kevent* ev);
+#elif defined(IO_URING)
+  uring_cb_t handler;
+  // Absolute deadline of the timeout in flight.
+  struct __kernel_timespec ts;
+  char closed;
+#else
+  epoll_cb_t handler;
+  int timerfd;
+#endif
+  http_server_t* server;
+  void (*cb)(void* data);
+  void* data;
+  int ms;
+  int repeat;
+} http_timer_t;
+
 typedef struct http_header_s {
   char const * key;
   char const * value;
+  int key_len;
+  int value_len;
   struct http_header_s* next;
 } http_header_t;
 
 typedef struct http_response_s {
   http_header_t* headers;
   char const * body;
+  struct http_string_s const * parts;
+  int part_count;
   int content_length;
   int status;
+  http_request_t* async_request;
+  struct http_response_s* async_next;
+#ifdef HTTP_STATIC_MEMORY
+  http_header_t header_slots[HTTP_STATIC_RESPONSE_HEADERS];
+  int header_count;
+  // Set when a header didn't fit, the response is answered with a 500.
+  char overflow;
+  // Taken from the pool. Responses may be created on any thread.
+  char used;
+#endif
 } http_response_t;
 
+#ifdef HTTP_STATIC_MEMORY
+// A session with the buffers it needs so serving it never allocates.
+typedef struct {
+  http_request_t session;
+  http_token_t tokens[HS_SHARED_TOKEN_COUNT];
+  char in[HTTP_STATIC_REQUEST_SIZE];
+  char out[HTTP_STATIC_RESPONSE_SIZE];
+  char used;
+} hs_static_session_t;
+#endif
+
 typedef struct http_string_s http_string_t;
 
 // prototypes
@@ -494,19 +1514,100 @@ void hs_server_init(struct http_server_s* serv);
 void hs_delete_events(struct http_request_s* request);
 void hs_add_events(struct http_request_s* request);
 void hs_add_write_event(struct http_request_s* request);
+void hs_pause_accept(struct http_server_s* serv);
+void hs_resume_accept(struct http_server_s* serv);
+int hs_add_watch(struct http_watch_s* watch);
+void hs_delete_watch(struct http_watch_s* watch);
+int hs_add_timer(struct http_timer_s* timer);
+void hs_delete_timer(struct http_timer_s* timer);
+
+void hs_release_session(struct http_request_s* request);
+void hs_free_buffer(struct http_request_s* session);
+void hs_wake_loop(struct http_server_s* serv);
+void hs_drain_async(struct http_server_s* serv);
 
 void hs_exec_response_handler(http_request_t* request, void (*handler)(http_request_t*));
+void hs_response_ready(http_request_t* request);
+void hs_index_token(http_request_t* request, http_token_t token);
+int hs_read_client_socket(http_request_t* session);
+int hs_write_client_socket(http_request_t* session);
+int hs_write_len(http_request_t* session);
+void hs_write_response(http_request_t* request);
+void hs_unidle(http_request_t* session);
+void hs_undefer(http_request_t* request);
+int hs_run_deferred(struct http_server_s* server);
+void hs_share_deferred(struct http_server_s* server, int events);
+int hs_append_read_buffer(http_request_t* session, char const * src, int len);
+int hs_recv_client_socket(http_request_t* session, char* dst, int len);
+http_request_t* hs_new_session(struct http_server_s* server, int sock);
+int hs_ring_index(hs_ring_t* ring, int pos);
+void hs_ring_consume(http_request_t* request, int pos);
+int hs_start_chunk_body(http_request_t* request);
+void hs_end_session(http_request_t* session);
+void hs_request_done(http_request_t* request);
+void hs_notify_close(http_request_t* request);
+void hs_release_chunk(struct http_server_s* server, hs_shared_chunk_t* chunk);
+void hs_broadcast_remove(hs_subscriber_t* sub);
+void hs_free_response(struct http_response_s* response);
+void hs_init_status_lines();
+
+int hs_h2_preface(http_request_t* request);
+void hs_h2_prior_knowledge(http_request_t* session);
+int hs_h2_upgrade_requested(http_request_t* request);
+void hs_h2_upgrade(http_request_t* session);
+void hs_h2_run(http_request_t* session, int read);
+void hs_h2_close(http_request_t* session);
+void hs_h2_close_stream(hs_h2_stream_t* stream);
+void hs_h2_rst(http_request_t* session, int id, int code);
+void hs_h2_read_chunk(http_request_t* request, void (*chunk_cb)(http_request_t*));
+void hs_h2_respond(
+  http_request_t* request,
+  struct http_response_s* response,
+  void (*cb)(http_request_t*),
+  int end,
+  int content_length
+);
+
+#ifdef HTTP_TRACE
+void hs_trace_stamp(http_request_t* request, int stage);
+void hs_trace_response(http_request_t* request, struct http_response_s* response);
+#endif
+
+#ifdef HTTP_WATCHDOG
+void hs_watchdog_begin(http_server_t* server);
+void hs_watchdog_end(http_server_t* server);
+void hs_watchdog_route(http_request_t* request);
+void hs_watchdog_session(http_request_t* request);
+void hs_watchdog_start(http_server_t* server);
+#endif
+
+#ifdef HTTP_TLS
+void hs_tls_init(http_server_t* serv);
+void hs_tls_new_session(http_request_t* session);
+int hs_tls_handshake(http_request_t* session);
+int hs_tls_read(http_request_t* session, char* dst, int len);
+int hs_tls_write(http_request_t* session);
+void hs_tls_close(http_request_t* session);
+#endif
 
 #ifdef KQUEUE
 
 void hs_server_listen_cb(struct kevent* ev);
 void hs_session_io_cb(struct kevent* ev);
 
+#elif defined(IO_URING)
+
+void hs_server_listen_cb(struct io_uring_cqe* cqe);
+void hs_session_io_cb(struct io_uring_cqe* cqe);
+void hs_server_timer_cb(struct io_uring_cqe* cqe);
+void hs_uring_update_timeout(http_request_t* session, int seconds);
+
 #else
 
 void hs_server_listen_cb(struct epoll_event* ev);
 void hs_session_io_cb(struct epoll_event* ev);
 void hs_server_timer_cb(struct epoll_event* ev);
+void hs_server_async_cb(struct epoll_event* ev);
 void hs_request_timer_cb(struct epoll_event* ev);
 
 #endif
@@ -572,8 +1673,8 @@ char const * hs_status_text[] = {
 
   "Gone", "Length Required", "", "Payload Too Large", "", "", "", "", "", "",
 
-  "", "", "", "", "", "", "", "", "", "",
-  "", "", "", "", "", "", "", "", "", "",
+  "", "", "", "", "", "Too Early", "", "", "", "",
+  "", "Request Header Fields Too Large", "", "", "", "", "", "", "", "",
   "", "", "", "", "", "", "", "", "", "",
   "", "", "", "", "", "", "", "", "", "",
   "", "", "", "", "", "", "", "", "", "",
@@ -583,7 +1684,7 @@ char const * hs_status_text[] = {
 
   //500s
   "Internal Server Error", "Not Implemented", "Bad Gateway", "Service Unavailable",
-  "Gateway Timeout", "", "", "", "", ""
+  "Gateway Timeout", "", "", "", "", "",
 
   "", "", "", "", "", "", "", "", "", "",
   "", "", "", "", "", "", "", "", "", "",
@@ -611,7 +1712,9 @@ http_token_t hs_parse_error(http_parser_t* parser, int subtype) {
 }
 
 http_token_t http_parse(http_parser_t* parser, char* input, int n) {
-  for (int i = parser->start; i < n; ++i, parser->start = i + 1, parser->len++) {
+  for (int i = parser->start; i < n; ++i, parser->len++) {
+    // Parsing resumes after this byte when a token is returned for it.
+    parser->start = i + 1;
     char c = input[i];
     switch (parser->state) {
       case HTTP_METHOD:
@@ -664,6 +1767,7 @@ http_token_t http_parse(http_parser_t* parser, char* input, int n) {
           }
           parser->content_length_i = 0;
           parser->transfer_encoding_i = 0;
+          if (HTTP_FLAG_CHECK(parser->flags, HS_PF_LAZY)) break;
           http_token_t token;
           token.index = parser->token_start_index;
           token.type = HTTP_HEADER_KEY;
@@ -707,6 +1811,7 @@ http_token_t http_parse(http_parser_t* parser, char* input, int n) {
             return hs_parse_error(parser, HTTP_ERR_BAD_REQUEST);
           }
           parser->header_count++;
+          if (HTTP_FLAG_CHECK(parser->flags, HS_PF_LAZY)) break;
           http_token_t token;
           token.index = parser->token_start_index;
           token.type = HTTP_HEADER_VALUE;
@@ -761,65 +1866,56 @@ http_token_t http_parse(http_parser_t* parser, char* input, int n) {
   return token;
 }
 
-// When we detect that the full chunk exists in the read buffer we can
-// immediately emit the HTTP_CHUNK_BODY token and skip reading forward to the
-// end of the chunk
-http_token_t http_gen_body_token(http_parser_t* parser) {
-  http_token_t token;
-  token.index = parser->token_start_index;
-  token.type = HTTP_CHUNK_BODY;
-  token.len = parser->content_length;
-  parser->start = parser->token_start_index + parser->content_length;
-  parser->len = parser->content_length;
-  parser->state = HTTP_CHUNK_BODY_END;
-  return token;
-}
-
-http_token_t http_chunk_parse(http_request_t* request, char* input, int n) {
+// Chunked bodies are parsed straight out of the ring of received bytes
+// without moving them. Chunk bodies are only emitted once they have been
+// received completely and may wrap around the end of the ring.
+http_token_t http_chunk_parse(http_request_t* request) {
   http_parser_t* parser = &request->parser;
-  for (int i = parser->start; i < n; ++i, parser->start = i + 1, parser->len++) {
-    char c = input[i];
-    int remaining = n - (i + 1);
+  hs_ring_t* ring = &request->ring;
+  http_token_t token;
+  // Anything before the parse position has been handed to the application.
+  if (parser->state != HTTP_CHUNK_BODY) hs_ring_consume(request, parser->start);
+  while (1) {
+    if (parser->state == HTTP_CHUNK_BODY) {
+      if (ring->wr - parser->token_start_index < parser->content_length) break;
+      token.index = parser->token_start_index;
+      token.len = parser->content_length;
+      token.type = HTTP_CHUNK_BODY;
+      parser->start = token.index + token.len;
+      parser->state = HTTP_CHUNK_BODY_END;
+      return token;
+    }
+    if (parser->start == ring->wr) break;
+    char c = request->buf[hs_ring_index(ring, parser->start)];
+    parser->start++;
     switch (parser->state) {
       case HTTP_CHUNK_SIZE:
         if (c == ';') {
           parser->state = HTTP_CHUNK_EXTN;
-        } else if (c == '\n') {
-          parser->token_start_index = i + 1;
-          parser->len = 0;
-          if (remaining >= parser->content_length) {
-            // Full chunk exists in buffer
-            return http_gen_body_token(parser);
+        } else if (c == '\n' && parser->len > 0) {
+          if (!hs_start_chunk_body(request)) {
+            return hs_parse_error(parser, HTTP_ERR_PAYLOAD_TOO_LARGE);
           }
-          parser->state = HTTP_CHUNK_BODY;
-        } else if (c == '\r') {
-          break;
         } else if (c >= 'A' && c <= 'F') {
           parser->content_length *= 0x10;
           parser->content_length += c - 55;
+          parser->len++;
         } else if (c >= 'a' && c <= 'f') {
           parser->content_length *= 0x10;
           parser->content_length += c - 87;
+          parser->len++;
         } else if (c >= '0' && c <= '9') {
           parser->content_length *= 0x10;
           parser->content_length += c - '0';
+          parser->len++;
         }
-        break;
-      case HTTP_CHUNK_EXTN:
-        if (c == '\n') {
-          if (remaining >= parser->content_length) {
-            // Full chunk exists in buffer
-            parser->token_start_index = i + 1;
-            return http_gen_body_token(parser);
-          }
-          parser->token_start_index = i + 1;
-          parser->state = HTTP_CHUNK_BODY;
+        if (parser->content_length > HTTP_MAX_CONTENT_LENGTH) {
+          return hs_parse_error(parser, HTTP_ERR_PAYLOAD_TOO_LARGE);
         }
         break;
-      case HTTP_CHUNK_BODY:
-        if (remaining >= parser->content_length) {
-          // The remaining portion of the chunk exists in the read buffer
-          return http_gen_body_token(parser);
+      case HTTP_CHUNK_EXTN:
+        if (c == '\n' && !hs_start_chunk_body(request)) {
+          return hs_parse_error(parser, HTTP_ERR_PAYLOAD_TOO_LARGE);
         }
         break;
       case HTTP_CHUNK_BODY_END:
@@ -827,45 +1923,18 @@ http_token_t http_chunk_parse(http_request_t* request, char* input, int n) {
           parser->state = HTTP_CHUNK_SIZE;
           parser->content_length = 0;
           parser->len = 0;
-          parser->token_start_index = i + 1;
         }
         break;
     }
   }
-  // This code is reached when we come to the end of our read buffer and no
-  // token has been emitted during this call. If we are part way through parsing
-  // a token at the end of the buffer or the next token would require us to grow
-  // the buffer then we want to reset the parser to overwrite old chunks so that
-  // we don't need to grow the buffer.
-  if (parser->token_start_index != parser->body_start_index) {
-    // Next time, start parsing as if the current token has been shifted to the
-    // start of the http body.
-    parser->start = parser->body_start_index + parser->len - 1;
-    int tsi = parser->token_start_index;
-    parser->token_start_index = parser->body_start_index;
-    // This will make the next read overwrite the old bytes
-    request->bytes = parser->start;
-    // If parser->len is 1 then there is no current partial token. This is kind
-    // of ugly because len gets incremented in the for loop before we get here
-    // so we need to check for 1 instead of 0
-    if (parser->len > 1) {
-      char* dst = input + parser->body_start_index;
-      char const* src = input + tsi;
-      // Copy partial token to beginning of body
-      memcpy(dst, src, n - tsi);
-    }
-  }
-  http_token_t token = { 0, 0, 0 };
+  // Keep a partial chunk body in the ring, everything else has been parsed.
+  if (parser->state != HTTP_CHUNK_BODY) hs_ring_consume(request, parser->start);
+  token.index = 0;
+  token.len = 0;
   token.type = HTTP_NONE;
   return token;
 }
 
-void http_parse_start_chunk_mode(http_parser_t* parser) {
-  parser->token_start_index = parser->start;
-  parser->content_length = 0;
-  parser->state = HTTP_CHUNK_SIZE;
-}
-
 // *** http server ***
 
 void http_token_dyn_push(http_token_dyn_t* dyn, http_token_t a) {
@@ -885,117 +1954,649 @@ void http_token_dyn_init(http_token_dyn_t* dyn, int capacity) {
   dyn->capacity = capacity;
 }
 
-void hs_bind_localhost(int s, struct sockaddr_in* addr, int port) {
-  addr->sin_family = AF_INET;
-  addr->sin_addr.s_addr = INADDR_ANY;
-  addr->sin_port = htons(port);
-  int rc = bind(s, (struct sockaddr *)addr, sizeof(struct sockaddr_in));;
-  if (rc < 0) {
-    exit(1);
-  }
+// Written as is to turn a request away when the server is over one of its
+// limits. It is never freed.
+static char const hs_busy_response[] =
+  "HTTP/1.1 503 Service Unavailable\r\n"
+  "Content-Length: 0\r\n"
+  "Connection: close\r\n"
+  "Retry-After: 1\r\n"
+  "\r\n";
+
+int hs_shared_buffer(http_request_t* session) {
+  return session->buf != NULL && session->buf == session->server->rbuf;
 }
 
-int hs_read_client_socket(http_request_t* session) {
-  if (!session->buf) {
-    session->server->memused += HTTP_REQUEST_BUF_SIZE;
+void hs_init_read_buffer(http_request_t* session) {
+  if (session->buf) return;
+#ifdef HTTP_STATIC_MEMORY
+  hs_static_session_t* slot = (hs_static_session_t*)session;
+  session->buf = slot->in;
+  session->capacity = HTTP_STATIC_REQUEST_SIZE;
+  session->tokens.buf = slot->tokens;
+  session->tokens.capacity = HS_SHARED_TOKEN_COUNT;
+  session->tokens.size = 0;
+  return;
+#endif
+  http_server_t* server = session->server;
+  if (server->rbuf_owner == NULL) {
+    // Read into the loop's shared buffer. If the request is complete it is
+    // handled in place and no memory is allocated for it.
+    server->rbuf_owner = session;
+    session->buf = server->rbuf;
+    session->capacity = HTTP_SHARED_BUF_SIZE;
+    session->tokens.buf = server->rtokens;
+    session->tokens.capacity = HS_SHARED_TOKEN_COUNT;
+    session->tokens.size = 0;
+  } else {
+    server->memused += HTTP_REQUEST_BUF_SIZE;
     session->buf = (char*)calloc(1, HTTP_REQUEST_BUF_SIZE);
     assert(session->buf != NULL);
     session->capacity = HTTP_REQUEST_BUF_SIZE;
     http_token_dyn_init(&session->tokens, 32);
   }
-  int bytes;
-  do {
-    bytes = read(
-      session->socket,
-      session->buf + session->bytes,
-      session->capacity - session->bytes
-    );
-    if (bytes > 0) session->bytes += bytes;
-    if (session->bytes == session->capacity) {
-      session->server->memused -= session->capacity;
-      session->capacity *= 2;
-      session->server->memused += session->capacity;
-      session->buf = (char*)realloc(session->buf, session->capacity);
-      assert(session->buf != NULL);
-    }
-  } while (bytes > 0);
-  return bytes == 0 ? 0 : 1;
 }
 
-int hs_write_client_socket(http_request_t* session) {
-  int bytes = write(
-    session->socket,
-    session->buf + session->written,
-    session->bytes - session->written
-  );
-  if (bytes > 0) session->written += bytes;
-  return errno == EPIPE ? 0 : 1;
+// Moves the request out of the shared read buffer into memory owned by the
+// session. This must be called whenever a request outlives the event it was
+// read in.
+void hs_own_buffer(http_request_t* session) {
+  if (!hs_shared_buffer(session)) return;
+  // Nothing worth keeping, e.g. a keep-alive connection that woke up without
+  // data. Hand the shared buffer back without allocating.
+  if (session->bytes == 0) return hs_free_buffer(session);
+  http_server_t* server = session->server;
+  int capacity = HTTP_REQUEST_BUF_SIZE;
+  while (capacity <= session->bytes) capacity *= 2;
+  char* buf = (char*)malloc(capacity);
+  assert(buf != NULL);
+  memcpy(buf, session->buf, session->bytes);
+  server->memused += capacity;
+  session->buf = buf;
+  session->capacity = capacity;
+  int size = session->tokens.size;
+  http_token_dyn_init(&session->tokens, size < 16 ? 32 : size * 2);
+  memcpy(session->tokens.buf, server->rtokens, size * sizeof(http_token_t));
+  session->tokens.size = size;
+  server->rbuf_owner = NULL;
 }
 
-void hs_free_buffer(http_request_t* session) {
-  if (session->buf) {
-    free(session->buf);
+void hs_grow_read_buffer(http_request_t* session) {
+  if (HTTP_FLAG_CHECK(session->flags, HTTP_STREAM_BODY)) {
+    // Streamed bodies are read into a fixed window. Reading stops when it is
+    // full and resumes once the application has consumed it.
+    return;
+  } else if (session->bytes == session->capacity && hs_shared_buffer(session)) {
+    hs_own_buffer(session);
+#ifndef HTTP_STATIC_MEMORY
+  } else if (session->bytes == session->capacity) {
     session->server->memused -= session->capacity;
-    session->buf = NULL;
-    free(session->tokens.buf);
-    session->tokens.buf = NULL;
+    session->capacity *= 2;
+    session->server->memused += session->capacity;
+    session->buf = (char*)realloc(session->buf, session->capacity);
+    assert(session->buf != NULL);
+#endif
   }
+  // Static session buffers don't grow. Requests that don't fit are turned
+  // away once they have been parsed as far as they go.
 }
 
-void hs_parse_tokens(http_request_t* session) {
-  http_token_t token;
-  int chunk_start = 0;
-  do {
-    token = http_parse(&session->parser, session->buf, session->bytes);
-    if (token.type != HTTP_NONE) {
-      session->token = token;
-      http_token_dyn_push(&session->tokens, token);
-    }
-    chunk_start = token.type == HTTP_BODY && token.len == HTTP_CHUNKED_LEN;
-  } while (token.type != HTTP_NONE && !chunk_start);
+// Returns the number of bytes copied which is less than len only when the
+// buffer can't grow.
+int hs_append_read_buffer(http_request_t* session, char const * src, int len) {
+  int copied = 0;
+  while (copied < len && session->bytes < session->capacity) {
+    int n = session->capacity - session->bytes;
+    if (n > len - copied) n = len - copied;
+    memcpy(session->buf + session->bytes, src + copied, n);
+    session->bytes += n;
+    copied += n;
+    hs_grow_read_buffer(session);
+  }
+  return copied;
 }
 
-void hs_init_session(http_request_t* session) {
-  session->flags = 0;
-  session->flags |= HTTP_AUTOMATIC;
-  session->parser = (http_parser_t){ };
-  session->bytes = 0;
-  session->written = 0;
-  session->buf = NULL;
-  session->token.len = 0;
-  session->token.index = 0;
-  session->token.type = HTTP_NONE;
+int hs_ring_index(hs_ring_t* ring, int pos) {
+  // Positions are kept below twice the size by hs_ring_consume.
+  return ring->start + (pos >= ring->size ? pos - ring->size : pos);
 }
 
-int hs_parsing_headers(http_request_t* request) {
-  return request->token.type != HTTP_BODY;
+// Releases everything before pos. Positions are rebased once rd passes the end
+// of the ring so they never overflow.
+void hs_ring_consume(http_request_t* request, int pos) {
+  hs_ring_t* ring = &request->ring;
+  ring->rd = pos;
+  if (ring->rd >= ring->size) {
+    ring->rd -= ring->size;
+    ring->wr -= ring->size;
+    request->parser.start -= ring->size;
+    request->parser.token_start_index -= ring->size;
+  }
 }
 
-int hs_reading_body(http_request_t* request) {
-  if (
-    request->token.type != HTTP_BODY ||
-    request->token.len == 0 ||
-    request->token.len == HTTP_CHUNKED_LEN
-  ) {
-    return 0;
+// Grows the ring to at least size bytes. Only the part that has wrapped around
+// to the front moves, to where its positions map to in the larger ring.
+void hs_ring_grow(http_request_t* request, int size) {
+  hs_ring_t* ring = &request->ring;
+  int old = ring->size;
+  if (size < old * 2) size = old * 2;
+  int capacity = ring->start + size;
+  request->server->memused += capacity - request->capacity;
+  request->buf = (char*)realloc(request->buf, capacity);
+  assert(request->buf != NULL);
+  request->capacity = capacity;
+  ring->size = size;
+  if (ring->wr > old) {
+    char* front = request->buf + ring->start;
+    memcpy(front + old, front, ring->wr - old);
   }
-  int size = request->token.index + request->token.len;
-  return request->bytes < size;
 }
 
-void hs_end_session(http_request_t* session) {
-  hs_delete_events(session);
-  close(session->socket);
-  hs_free_buffer(session);
-  free(session);
+// Returns 0 if the chunk can't fit into the ring.
+int hs_start_chunk_body(http_request_t* request) {
+  http_parser_t* parser = &request->parser;
+  parser->state = HTTP_CHUNK_BODY;
+  parser->token_start_index = parser->start;
+  hs_ring_consume(request, parser->start);
+  // The whole chunk has to fit so it can be handed out in one piece.
+  if (parser->content_length > request->ring.size) {
+#ifdef HTTP_STATIC_MEMORY
+    return 0;
+#else
+    hs_ring_grow(request, parser->content_length);
+#endif
+  }
+  return 1;
 }
 
-void hs_reset_timeout(http_request_t* request, int time) {
-  request->timeout = time;
+// Sets up the ring after the headers of a chunked request. The bytes of the
+// body that were read with the headers are already in place.
+void hs_start_chunk_mode(http_request_t* request) {
+  http_parser_t* parser = &request->parser;
+  hs_ring_t* ring = &request->ring;
+  hs_own_buffer(request);
+  ring->start = parser->body_start_index;
+  // The final LF of the headers may not have been read yet. It will be the
+  // first byte of the ring and is skipped by the chunk size parser.
+  if (ring->start > request->bytes) ring->start = request->bytes;
+#ifndef HTTP_STATIC_MEMORY
+  if (request->capacity - ring->start < HTTP_REQUEST_BUF_SIZE) {
+    int capacity = ring->start + HTTP_REQUEST_BUF_SIZE;
+    request->server->memused += capacity - request->capacity;
+    request->buf = (char*)realloc(request->buf, capacity);
+    assert(request->buf != NULL);
+    request->capacity = capacity;
+  }
+#endif
+  ring->size = request->capacity - ring->start;
+  ring->rd = 0;
+  ring->wr = request->bytes - ring->start;
+  parser->start = 0;
+  parser->token_start_index = 0;
+  parser->content_length = 0;
+  parser->len = 0;
+  parser->state = HTTP_CHUNK_SIZE;
+}
+
+// Reads into the free part of the ring. Returns 0 on EOF, 1 once the socket
+// has been drained and 2 if the ring filled up first.
+int hs_ring_fill(http_request_t* request) {
+  hs_ring_t* ring = &request->ring;
+  while (ring->wr - ring->rd < ring->size) {
+    int at = hs_ring_index(ring, ring->wr) - ring->start;
+    int len = ring->size - (ring->wr - ring->rd);
+    if (at + len > ring->size) len = ring->size - at;
+    int bytes = hs_recv_client_socket(request, request->buf + ring->start + at, len);
+    if (bytes == 0) return 0;
+    if (bytes < 0) return 1;
+    ring->wr += bytes;
+  }
+  return 2;
+}
+
+void hs_reverse(char* from, char* to) {
+  while (from < --to) {
+    char c = *from;
+    *from++ = *to;
+    *to = c;
+  }
+}
+
+// Moves the unconsumed part of the ring to its front so the current chunk is
+// contiguous. Only needed for http_request_chunk on a chunk that wraps. The
+// ring is rotated in place with three reversals so nothing is allocated.
+void hs_ring_linearize(http_request_t* request) {
+  hs_ring_t* ring = &request->ring;
+  char* buf = request->buf + ring->start;
+  int at = hs_ring_index(ring, ring->rd) - ring->start;
+  hs_reverse(buf, buf + at);
+  hs_reverse(buf + at, buf + ring->size);
+  hs_reverse(buf, buf + ring->size);
+  int shift = ring->rd;
+  ring->rd = 0;
+  ring->wr -= shift;
+  request->parser.start -= shift;
+  request->parser.token_start_index -= shift;
+  request->token.index -= shift;
+}
+
+#ifndef IO_URING
+
+int hs_socket_read(http_request_t* session, char* dst, int len) {
+#ifdef HTTP_TLS
+  if (session->tls) return hs_tls_read(session, dst, len);
+#endif
+  return read(session->socket, dst, len);
+}
+
+int hs_read_client_socket(http_request_t* session) {
+  hs_init_read_buffer(session);
+  int bytes = 1;
+  while (bytes > 0 && session->bytes < session->capacity) {
+    bytes = hs_socket_read(
+      session,
+      session->buf + session->bytes,
+      session->capacity - session->bytes
+    );
+    if (bytes > 0) session->bytes += bytes;
+    hs_grow_read_buffer(session);
+  }
+  return bytes == 0 ? 0 : 1;
+}
+
+// Reads up to len bytes into dst. Returns 0 on EOF and -1 if nothing is
+// waiting.
+int hs_recv_client_socket(http_request_t* session, char* dst, int len) {
+  int bytes = hs_socket_read(session, dst, len);
+  return bytes < 0 ? -1 : bytes;
+}
+
+int hs_write_client_socket(http_request_t* session) {
+#ifdef HTTP_TLS
+  if (session->tls && !session->ktls_send) return hs_tls_write(session);
+#endif
+  int bytes = write(session->socket, session->buf + session->written, hs_write_len(session));
+  if (bytes > 0) session->written += bytes;
+  // errno is only set by a failed write, it may be left over from another
+  // session's otherwise.
+  return bytes < 0 && errno == EPIPE ? 0 : 1;
+}
+
+#endif
+
+void hs_free_buffer(http_request_t* session) {
+  if (hs_shared_buffer(session)) {
+    session->server->rbuf_owner = NULL;
+    session->buf = NULL;
+    session->tokens.buf = NULL;
+  } else if (session->buf == hs_busy_response) {
+    session->buf = NULL;
+  } else if (session->shared) {
+    hs_release_chunk(session->server, session->shared);
+    session->shared = NULL;
+    session->buf = NULL;
+#ifdef HTTP_STATIC_MEMORY
+  } else if (session->buf) {
+    // The buffers belong to the session.
+    session->buf = NULL;
+    session->tokens.buf = NULL;
+#else
+  } else if (session->buf) {
+    free(session->buf);
+    session->server->memused -= session->capacity;
+    session->buf = NULL;
+    free(session->tokens.buf);
+    session->tokens.buf = NULL;
+#endif
+  }
+}
+
+void hs_parse_tokens(http_request_t* session) {
+  http_token_t token;
+  int chunk_start = 0;
+  do {
+    token = http_parse(&session->parser, session->buf, session->bytes);
+    if (token.type != HTTP_NONE) {
+      session->token = token;
+      http_token_dyn_push(&session->tokens, token);
+      hs_index_token(session, token);
+    }
+    chunk_start = token.type == HTTP_BODY && token.len == HTTP_CHUNKED_LEN;
+  } while (token.type != HTTP_NONE && !chunk_start);
+}
+
+void hs_init_session(http_request_t* session) {
+  session->flags = 0;
+  session->flags |= HTTP_AUTOMATIC;
+  session->close_cb = NULL;
+  session->priority = HTTP_PRIORITY_NORMAL;
+  session->parser = (http_parser_t){ };
+  if (session->server->options.lazy_headers) {
+    HTTP_FLAG_SET(session->parser.flags, HS_PF_LAZY);
+  }
+  session->header_base = HTTP_VERSION + 1;
+  session->bytes = 0;
+  session->written = 0;
+  session->buf = NULL;
+  session->token.len = 0;
+  session->token.index = 0;
+  session->token.type = HTTP_NONE;
+  for (int i = 0; i < HS_SLOT_COUNT; i++) {
+    session->slots[i].type = HTTP_NONE;
+  }
+  memset(session->header_buckets, 0, sizeof(session->header_buckets));
+  memset(session->known_headers, 0, sizeof(session->known_headers));
+#ifdef HTTP_TRACE
+  // The accept stamp stays for the first request of the connection.
+  uint64_t* stamps = session->trace.stamps;
+  memset(stamps + HS_TRACE_READ, 0, (HS_TRACE_COUNT - HS_TRACE_READ) * sizeof(*stamps));
+#endif
+#ifdef HTTP_WATCHDOG
+  session->route[0] = '\0';
+#endif
+}
+
+int hs_parsing_headers(http_request_t* request) {
+  return request->token.type != HTTP_BODY;
+}
+
+int hs_reading_body(http_request_t* request) {
+  if (
+    request->token.type != HTTP_BODY ||
+    request->token.len == 0 ||
+    request->token.len == HTTP_CHUNKED_LEN
+  ) {
+    return 0;
+  }
+  int size = request->token.index + request->token.len;
+  return request->bytes < size;
+}
+
+// Size of the windows a streamed body is read in.
+int hs_body_window_size(http_request_t* request) {
+  int window = request->server->options.stream_body;
+#ifdef HTTP_STATIC_MEMORY
+  int room = HTTP_STATIC_REQUEST_SIZE - request->parser.body_start_index;
+  if (window > room) window = room;
+#endif
+  return window;
+}
+
+int hs_streaming_body(http_request_t* request) {
+  int window = hs_body_window_size(request);
+  return request->token.type == HTTP_BODY &&
+    window > 0 &&
+    request->token.len > window;
+}
+
+// Switches the request to reading its Content-Length body one window at a
+// time. parser->start is the first body byte not handed to the application yet
+// and parser->content_length the number of body bytes left.
+void hs_start_body_stream(http_request_t* request) {
+  http_parser_t* parser = &request->parser;
+  HTTP_FLAG_SET(request->flags, HTTP_STREAM_BODY);
+  parser->start = parser->body_start_index;
+  parser->content_length = request->token.len;
+  // The body is never in the buffer as a whole.
+  request->slots[HS_SLOT_BODY].len = 0;
+  hs_own_buffer(request);
+#ifndef HTTP_STATIC_MEMORY
+  int size = parser->body_start_index + request->server->options.stream_body;
+  if (request->capacity < size) {
+    request->server->memused += size - request->capacity;
+    request->capacity = size;
+    request->buf = (char*)realloc(request->buf, size);
+    assert(request->buf != NULL);
+  }
+#endif
+}
+
+// Returns the next window of a streamed body or HTTP_NONE if more of it has to
+// be read first. The window is empty once the whole body has been consumed.
+http_token_t hs_body_window(http_request_t* request) {
+  http_parser_t* parser = &request->parser;
+  int window = hs_body_window_size(request);
+  if (window > parser->content_length) window = parser->content_length;
+  http_token_t token;
+  token.index = parser->start;
+  token.len = window;
+  token.type = HTTP_CHUNK_BODY;
+  if (request->bytes - parser->start >= window) {
+    parser->start += window;
+    parser->content_length -= window;
+    return token;
+  }
+  // Move the partial window back to the start of the body so the next read
+  // lands behind it and the buffer never grows.
+  int partial = request->bytes - parser->start;
+  if (parser->start != parser->body_start_index) {
+    char* dst = request->buf + parser->body_start_index;
+    memmove(dst, request->buf + parser->start, partial);
+    parser->start = parser->body_start_index;
+    request->bytes = parser->start + partial;
+  }
+  token.type = HTTP_NONE;
+  return token;
+}
+
+// Returns the next chunk or window of the body, reading the socket while it
+// is incomplete and more data is waiting. HTTP_NONE means the next read event
+// has to be waited for and HTTP_PARSE_ERROR that the connection is done.
+http_token_t hs_next_chunk(http_request_t* request) {
+  int stream = HTTP_FLAG_CHECK(request->flags, HTTP_STREAM_BODY);
+  int rc = 2;
+  while (1) {
+    http_token_t token = stream ? hs_body_window(request) : http_chunk_parse(request);
+    if (token.type != HTTP_NONE || rc != 2) return token;
+    rc = stream ? hs_read_client_socket(request) : hs_ring_fill(request);
+    if (rc == 0) {
+      token.type = HTTP_PARSE_ERROR;
+      return token;
+    }
+  }
+}
+
+#ifndef IO_URING
+
+void hs_release_session(http_request_t* session) {
+  hs_free_buffer(session);
+#ifdef HTTP_STATIC_MEMORY
+  ((hs_static_session_t*)session)->used = 0;
+#else
+  free(session);
+#endif
+}
+
+#endif
+
+void hs_end_session(http_request_t* session) {
+  hs_delete_events(session);
+#ifdef HTTP_TLS
+  if (session->tls) hs_tls_close(session);
+#endif
+  close(session->socket);
+  if (session->h2) hs_h2_close(session);
+  if (session->subscriber) hs_broadcast_remove(session->subscriber);
+  if (HTTP_FLAG_CHECK(session->flags, HTTP_DEFERRED)) hs_undefer(session);
+  if (HTTP_FLAG_CHECK(session->flags, HTTP_IDLE)) hs_unidle(session);
+  hs_notify_close(session);
+  hs_request_done(session);
+  http_server_t* server = session->server;
+  server->connections--;
+  if (
+    server->accept_paused &&
+    (server->options.max_connections <= 0 ||
+      server->connections < server->options.max_connections)
+  ) {
+    server->accept_paused = 0;
+    hs_resume_accept(server);
+  }
+  if (
+    HTTP_FLAG_CHECK(session->flags, HTTP_ASYNC) ||
+    HTTP_FLAG_CHECK(session->flags, HTTP_IN_HANDLER)
+  ) {
+    // The request is still in use, either by another thread or by the
+    // request handler further up the stack. The session is released once
+    // they are done with it.
+    HTTP_FLAG_SET(session->flags, HTTP_ENDED);
+    return;
+  }
+  hs_release_session(session);
+}
+
+void hs_reset_timeout(http_request_t* request, int time) {
+  request->timeout = time;
+#ifdef IO_URING
+  // The session timer is only armed for the deadline so remember when the
+  // timeout was last reset instead of counting it down every second. A later
+  // deadline is picked up when the timer fires, an earlier one needs it
+  // moved.
+  request->timeout_start = request->server->ticks;
+  if (request->timeout_start + time < request->timeout_end) {
+    hs_uring_update_timeout(request, time);
+  }
+#endif
+}
+
+// The session's timeout has run out. A low priority response waiting in the
+// deferred list is held up by the server rather than the client, so its
+// timeout starts over.
+void hs_timeout_expired(http_request_t* request) {
+  if (HTTP_FLAG_CHECK(request->flags, HTTP_DEFERRED)) {
+    hs_reset_timeout(request, HTTP_REQUEST_TIMEOUT);
+  } else {
+    hs_end_session(request);
+  }
+}
+
+// Low priority responses get one slice per turn. Once the first has been
+// written the session waits in the deferred list for a turn in which nothing
+// else is ready or its share comes up, see hs_run_deferred and
+// hs_share_deferred, instead of writing the next slice as soon as the socket
+// takes it.
+int hs_defer_write(http_request_t* request) {
+  http_server_t* server = request->server;
+  if (
+    request->priority != HTTP_PRIORITY_LOW ||
+    request->written == 0 ||
+    request->written == request->bytes ||
+    server->resumed == request
+  ) {
+    return 0;
+  }
+  if (!HTTP_FLAG_CHECK(request->flags, HTTP_DEFERRED)) {
+    HTTP_FLAG_SET(request->flags, HTTP_DEFERRED);
+    request->deferred_next = NULL;
+    if (server->deferred_tail) {
+      server->deferred_tail->deferred_next = request;
+    } else {
+      server->deferred_head = request;
+    }
+    server->deferred_tail = request;
+  }
+  return 1;
+}
+
+void hs_undefer(http_request_t* request) {
+  http_server_t* server = request->server;
+  http_request_t* prev = NULL;
+  http_request_t* cur = server->deferred_head;
+  while (cur != request) {
+    prev = cur;
+    cur = cur->deferred_next;
+  }
+  if (prev) {
+    prev->deferred_next = request->deferred_next;
+  } else {
+    server->deferred_head = request->deferred_next;
+  }
+  if (server->deferred_tail == request) server->deferred_tail = prev;
+  HTTP_FLAG_CLEAR(request->flags, HTTP_DEFERRED);
+}
+
+// Keep-alive sessions waiting for their next request are kept in a list so
+// the one that has been idle the longest can be closed when a new client
+// needs the room. Sessions join at the tail when their response has been
+// written and leave when the next request starts or the connection ends.
+void hs_idle(http_request_t* session) {
+  http_server_t* server = session->server;
+  HTTP_FLAG_SET(session->flags, HTTP_IDLE);
+  session->idle_prev = server->idle_tail;
+  session->idle_next = NULL;
+  if (server->idle_tail) {
+    server->idle_tail->idle_next = session;
+  } else {
+    server->idle_head = session;
+  }
+  server->idle_tail = session;
+  server->idle_count++;
+}
+
+void hs_unidle(http_request_t* session) {
+  http_server_t* server = session->server;
+  if (session->idle_prev) {
+    session->idle_prev->idle_next = session->idle_next;
+  } else {
+    server->idle_head = session->idle_next;
+  }
+  if (session->idle_next) {
+    session->idle_next->idle_prev = session->idle_prev;
+  } else {
+    server->idle_tail = session->idle_prev;
+  }
+  server->idle_count--;
+  HTTP_FLAG_CLEAR(session->flags, HTTP_IDLE);
+}
+
+// Closes the least recently used idle session. Returns 0 if there is none.
+int hs_evict_idle(http_server_t* server) {
+  if (server->idle_head == NULL) return 0;
+  server->evictions++;
+  hs_end_session(server->idle_head);
+  return 1;
+}
+
+// Writes the next slice of the low priority response that has waited
+// longest. Called by the event loop when no event is ready. Returns 0 if
+// there was none.
+int hs_run_deferred(http_server_t* server) {
+  http_request_t* request = server->deferred_head;
+  if (request == NULL) return 0;
+  server->deferred_turns = 0;
+  hs_undefer(request);
+  if (request->state == HTTP_SESSION_WRITE) {
+    HS_DISPATCH_BEGIN(server);
+    HS_DISPATCH_SESSION(request);
+    server->resumed = request;
+    hs_write_response(request);
+    server->resumed = NULL;
+    HS_DISPATCH_END(server);
+  }
+  return 1;
+}
+
+// Counts the events the loop handled while low priority responses wait.
+// Once the low_priority_share option's worth have been handled the one
+// waiting longest gets a slice, even if more events are ready.
+void hs_share_deferred(http_server_t* server, int events) {
+  int share = server->options.low_priority_share;
+  if (server->deferred_head == NULL || share <= 0 || events <= 0) return;
+  server->deferred_turns += events;
+  if (server->deferred_turns >= share) hs_run_deferred(server);
+}
+
+// Bytes to hand to the socket in one write.
+int hs_write_len(http_request_t* session) {
+  int len = session->bytes - session->written;
+  int slice = session->server->options.low_priority_slice;
+  if (session->priority == HTTP_PRIORITY_LOW && slice > 0 && len > slice) return slice;
+  return len;
 }
 
 void hs_write_response(http_request_t* request) {
+  if (hs_defer_write(request)) return;
   if (!hs_write_client_socket(request)) { return hs_end_session(request); }
+  if (request->written > 0) HS_TRACE(request, HS_TRACE_WRITE);
   if (request->written != request->bytes) {
     // All bytes of the body were not written and we need to wait until the
     // socket is writable again to complete the write
@@ -1014,9 +2615,11 @@ void hs_write_response(http_request_t* request) {
     // All bytes of the response were successfully written. However the
     // keep-alive flag was set so we don't close the connection, we just clean
     // up
+    hs_request_done(request);
     request->state = HTTP_SESSION_INIT;
     hs_free_buffer(request);
     hs_reset_timeout(request, HTTP_KEEP_ALIVE_TIMEOUT);
+    hs_idle(request);
   } else {
     // All response bytes were written and the connection should be closed
     return hs_end_session(request);
@@ -1024,13 +2627,30 @@ void hs_write_response(http_request_t* request) {
 }
 
 void hs_exec_response_handler(http_request_t* request, void (*handler)(http_request_t*)) {
+  HTTP_FLAG_SET(request->flags, HTTP_IN_HANDLER);
+  HS_TRACE(request, HS_TRACE_HANDLER);
   handler(request);
-  if (HTTP_FLAG_CHECK(request->flags, HTTP_RESPONSE_READY)) {
+  HS_TRACE(request, HS_TRACE_HANDLER_EXIT);
+  HTTP_FLAG_CLEAR(request->flags, HTTP_IN_HANDLER);
+  if (
+    HTTP_FLAG_CHECK(request->flags, HTTP_ENDED) &&
+    !HTTP_FLAG_CHECK(request->flags, HTTP_ASYNC)
+  ) {
+    // The connection was closed while the handler ran, e.g. the client went
+    // away while it was reading the body.
+    return hs_release_session(request);
+  } else if (HTTP_FLAG_CHECK(request->flags, HTTP_RESPONSE_READY)) {
     // The request handler has been called and a response is immediately ready.
     hs_write_response(request);
   } else {
     // The response is not ready immediately and will be written out later.
     HTTP_FLAG_SET(request->flags, HTTP_RESPONSE_PAUSED);
+    hs_own_buffer(request);
+    if (request->state != HTTP_SESSION_READ_CHUNK) {
+      // Ignore further input until the response is written so the handler
+      // isn't run again for the same request.
+      request->state = HTTP_SESSION_NOP;
+    }
   }
 }
 
@@ -1043,29 +2663,100 @@ void hs_error_response(http_request_t* request, int code, char const * message)
   hs_write_response(request);
 }
 
+// Returns whether new requests should be turned away.
+int hs_overloaded(http_server_t* server) {
+  struct http_server_options_s* opts = &server->options;
+  return server->memused > opts->max_memory ||
+    (opts->max_inflight > 0 && server->inflight >= opts->max_inflight);
+}
+
+// Answers with the canned 503 and closes. New requests are read into the
+// shared buffer first so this costs no memory.
+void hs_shed_request(http_request_t* request) {
+  hs_free_buffer(request);
+  // Take in what else the client has sent, up to a point, so closing the
+  // socket doesn't reset the connection before the response is read.
+  char discard[512];
+  int left = HTTP_SHARED_BUF_SIZE;
+  int bytes;
+  do {
+    bytes = hs_recv_client_socket(request, discard, sizeof(discard));
+    left -= bytes;
+  } while (bytes == sizeof(discard) && left > 0);
+  request->buf = (char*)hs_busy_response;
+  request->bytes = sizeof(hs_busy_response) - 1;
+  request->written = 0;
+  request->capacity = 0;
+  request->state = HTTP_SESSION_WRITE;
+  hs_write_response(request);
+}
+
+// Passes a request whose head has been read to the application.
+void hs_handle_request(http_request_t* request) {
+  HS_DISPATCH_ROUTE(request);
+  HTTP_FLAG_SET(request->flags, HTTP_INFLIGHT);
+  request->server->inflight++;
+  hs_exec_response_handler(request, request->server->request_handler);
+}
+
+// Lets the application know it won't get to finish the response.
+void hs_notify_close(http_request_t* request) {
+  void (*close_cb)(http_request_t*) = request->close_cb;
+  if (close_cb == NULL || HTTP_FLAG_CHECK(request->flags, HTTP_ASYNC)) return;
+  request->close_cb = NULL;
+  close_cb(request);
+}
+
+void hs_request_done(http_request_t* request) {
+  if (HTTP_FLAG_CHECK(request->flags, HTTP_INFLIGHT)) {
+    HTTP_FLAG_CLEAR(request->flags, HTTP_INFLIGHT);
+    request->server->inflight--;
+    HS_TRACE(request, HS_TRACE_DONE);
+  }
+}
+
+// Returns the status to reject the request with if it won't fit into
+// max_request_size, 0 if it does.
+int hs_request_too_large(http_request_t* request) {
+  int max = request->server->options.max_request_size;
+#ifdef HTTP_STATIC_MEMORY
+  // Nothing larger than the session's buffer can be read.
+  if (max <= 0 || max > HTTP_STATIC_REQUEST_SIZE) max = HTTP_STATIC_REQUEST_SIZE;
+#endif
+  if (max <= 0) return 0;
+  // An incomplete head that has reached the limit is bound to go past it.
+  if (hs_parsing_headers(request)) return request->bytes >= max ? 431 : 0;
+  if (request->parser.body_start_index > max) return 431;
+  int len = request->token.len;
+#ifdef HTTP_STATIC_MEMORY
+  // Chunked bodies are read into a ring behind the head.
+  if (len == HTTP_CHUNKED_LEN) {
+    int room = HTTP_STATIC_REQUEST_SIZE - request->parser.body_start_index;
+    return room < HS_STATIC_MIN_RING ? 431 : 0;
+  }
+#endif
+  if (len <= 0 || hs_streaming_body(request)) return 0;
+  return request->parser.body_start_index + len > max ? 413 : 0;
+}
+
 // Application requesting next chunk of request body.
 void http_request_read_chunk(
   struct http_request_s* request,
   void (*chunk_cb)(struct http_request_s*)
 ) {
+  if (request->stream) return hs_h2_read_chunk(request, chunk_cb);
   request->chunk_cb = chunk_cb;
-  http_token_t token = http_chunk_parse(request, request->buf, request->bytes);
+  http_token_t token = hs_next_chunk(request);
   if (token.type == HTTP_CHUNK_BODY) {
-    // The next chunk was in the read buffer and is ready.
+    // The next chunk was in the read buffer or the kernel network buffer.
     request->token = token;
     chunk_cb(request);
+  } else if (token.type == HTTP_PARSE_ERROR) {
+    hs_end_session(request);
   } else {
-    // No chunk is in the read buffer, continue reading the socket.
-    if (!hs_read_client_socket(request)) { return hs_end_session(request); }
-    http_token_t token = http_chunk_parse(request, request->buf, request->bytes);
-    if (token.type == HTTP_CHUNK_BODY) {
-      // A chunk was in the kernel network buffer
-      request->token = token;
-      request->chunk_cb(request);
-    } else {
-      // No chunk ready, wait for IO.
-      request->state = HTTP_SESSION_READ_CHUNK;
-    }
+    // No chunk ready, wait for IO.
+    request->state = HTTP_SESSION_READ_CHUNK;
+    hs_own_buffer(request);
   }
 }
 
@@ -1073,18 +2764,54 @@ void http_request_read_chunk(
 // controls what happens when an IO event is received.
 void http_session(http_request_t* request) {
   http_token_t token;
+  int preface;
+  int status;
+  HS_DISPATCH_SESSION(request);
   switch (request->state) {
+#ifdef HTTP_TLS
+    case HTTP_SESSION_HANDSHAKE:
+      switch (hs_tls_handshake(request)) {
+        case -1: return hs_end_session(request);
+        case 0: return;
+      }
+      // Read the request straight away, it may have arrived with the last
+      // handshake message.
+      request->state = HTTP_SESSION_INIT;
+#endif
+      // fallthrough
     case HTTP_SESSION_INIT:
+      if (HTTP_FLAG_CHECK(request->flags, HTTP_IDLE)) hs_unidle(request);
       hs_init_session(request);
       request->state = HTTP_SESSION_READ_HEADERS;
-      if (request->server->memused > HTTP_MAX_TOTAL_EST_MEM_USAGE) {
-        return hs_error_response(request, 503, "Service Unavailable");
+      if (request->server->options.header_timeout > 0) {
+        hs_reset_timeout(request, request->server->options.header_timeout);
       }
       // fallthrough
     case HTTP_SESSION_READ_HEADERS:
       if (!hs_read_client_socket(request)) { return hs_end_session(request); }
-      hs_reset_timeout(request, HTTP_REQUEST_TIMEOUT);
+      if (request->bytes > 0) HS_TRACE(request, HS_TRACE_READ);
+      // Requests that are under way have been admitted already. New ones
+      // are still in the shared buffer.
+      if (
+        request->bytes > 0 &&
+        hs_shared_buffer(request) &&
+        hs_overloaded(request->server)
+      ) {
+        return hs_shed_request(request);
+      }
+      if (request->server->options.header_timeout <= 0) {
+        hs_reset_timeout(request, HTTP_REQUEST_TIMEOUT);
+      }
+      preface = hs_h2_preface(request);
+      if (preface == 2) {
+        return hs_h2_prior_knowledge(request);
+      } else if (preface == 1) {
+        // Could still be the HTTP/2 preface. Parse once there is enough.
+        hs_own_buffer(request);
+        break;
+      }
       hs_parse_tokens(request);
+      if (!hs_parsing_headers(request)) HS_TRACE(request, HS_TRACE_PARSED);
       if (request->token.type == HTTP_PARSE_ERROR) {
         switch (request->token.index) {
           case HTTP_ERR_BAD_REQUEST:
@@ -1092,18 +2819,37 @@ void http_session(http_request_t* request) {
           case HTTP_ERR_PAYLOAD_TOO_LARGE:
             return hs_error_response(request, 413, "Payload Too Large");
         }
+      } else if ((status = hs_request_too_large(request))) {
+        // The rest of the request is never read so the connection can't be
+        // reused.
+        http_request_connection(request, HTTP_CLOSE);
+        return status == 413
+          ? hs_error_response(request, 413, "Payload Too Large")
+          : hs_error_response(request, 431, "Request Header Fields Too Large");
+      } else if (hs_streaming_body(request)) {
+        // Like chunked requests the application reads the body itself so
+        // ignore the socket until it asks for the first window.
+        request->state = HTTP_SESSION_NOP;
+        hs_start_body_stream(request);
+        return hs_handle_request(request);
       } else if (hs_reading_body(request)) {
         // The full request body has not been ready. Need to wait for more IO.
         request->state = HTTP_SESSION_READ_BODY;
+        hs_own_buffer(request);
       } else if (!hs_parsing_headers(request)) {
         if (request->parser.flags & HS_PF_CHUNKED) {
           // Set state to NOP for chunked requests. This means we won't handle
           // any read events on the socket until the application has requested
           // to read a chunk.
           request->state = HTTP_SESSION_NOP;
-          http_parse_start_chunk_mode(&request->parser);
+          hs_start_chunk_mode(request);
+        } else if (hs_h2_upgrade_requested(request)) {
+          return hs_h2_upgrade(request);
         }
-        return hs_exec_response_handler(request, request->server->request_handler);
+        return hs_handle_request(request);
+      } else {
+        // The headers are not complete yet. Keep what has been read so far.
+        hs_own_buffer(request);
       }
       break;
     case HTTP_SESSION_READ_BODY:
@@ -1112,15 +2858,16 @@ void http_session(http_request_t* request) {
       if (!hs_reading_body(request)) {
         // Full body has been read into the read buffer. Call the application
         // request handler
-        return hs_exec_response_handler(request, request->server->request_handler);
+        return hs_handle_request(request);
       }
       // Full body has still not been read. Wait for more IO.
       break;
     case HTTP_SESSION_READ_CHUNK:
-      if (!hs_read_client_socket(request)) { return hs_end_session(request); }
       hs_reset_timeout(request, HTTP_REQUEST_TIMEOUT);
-      token = http_chunk_parse(request, request->buf, request->bytes);
-      if (token.type == HTTP_CHUNK_BODY) {
+      token = hs_next_chunk(request);
+      if (token.type == HTTP_PARSE_ERROR) {
+        return hs_end_session(request);
+      } else if (token.type == HTTP_CHUNK_BODY) {
         // Chunk is ready call the chunk handler
         request->token = token;
         request->state = HTTP_SESSION_NOP;
@@ -1130,83 +2877,435 @@ void http_session(http_request_t* request) {
     case HTTP_SESSION_WRITE:
       hs_write_response(request);
       break;
+    case HTTP_SESSION_H2:
+      hs_h2_run(request, 1);
+      break;
   }
 }
 
-void hs_accept_connections(http_server_t* server) {
-  int sock = 0;
-  do {
-    sock = accept(server->socket, (struct sockaddr *)&server->addr, &server->len);
-    if (sock > 0) {
-      http_request_t* session = (http_request_t*)calloc(1, sizeof(http_request_t));
-      assert(session != NULL);
-      session->socket = sock;
-      session->server = server;
-      session->timeout = HTTP_REQUEST_TIMEOUT;
-      session->handler = hs_session_io_cb;
-      int flags = fcntl(sock, F_GETFL, 0);
-      fcntl(sock, F_SETFL, flags | O_NONBLOCK);
-      hs_add_events(session);
-      http_session(session);
-    }
-  } while (sock > 0);
+int hs_accept(hs_listener_t* listener) {
+#ifdef HS_HAVE_ACCEPT4
+  if (listener->server->options.use_accept4) {
+    return accept4(listener->socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  }
+#endif
+  int sock = accept(listener->socket, NULL, NULL);
+  if (sock > 0) {
+    int flags = fcntl(sock, F_GETFL, 0);
+    fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+  }
+  return sock;
 }
 
-void hs_generate_date_time(char** datetime) {
-  time_t rawtime;
-  struct tm * timeinfo;
-  time(&rawtime);
-  timeinfo = localtime(&rawtime);
-  *datetime = asctime(timeinfo);
-}
+#ifdef HTTP_STATIC_MEMORY
 
-http_server_t* http_server_init(int port, void (*handler)(http_request_t*)) {
-  http_server_t* serv = (http_server_t*)malloc(sizeof(http_server_t));
-  assert(serv != NULL);
-  serv->port = port;
-  serv->memused = 0;
-  serv->handler = hs_server_listen_cb;
-  hs_server_init(serv);
-  hs_generate_date_time(&serv->date);
-  serv->request_handler = handler;
-  return serv;
-}
+static hs_static_session_t hs_static_sessions[HTTP_STATIC_SESSIONS];
 
-void http_listen(http_server_t* serv) {
-  // Ignore SIGPIPE. We handle these errors at the call site.
-  signal(SIGPIPE, SIG_IGN);
-  serv->socket = socket(AF_INET, SOCK_STREAM, 0);
-  int flag = 1;
-  setsockopt(serv->socket, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
-  hs_bind_localhost(serv->socket, &serv->addr, serv->port);
-  serv->len = sizeof(serv->addr);
-  int flags = fcntl(serv->socket, F_GETFL, 0);
-  fcntl(serv->socket, F_SETFL, flags | O_NONBLOCK);
-  listen(serv->socket, 128);
-  hs_add_server_sock_events(serv);
+// Takes a free session from the table. Only the loop threads use the table,
+// responses from other threads go through the async queue.
+http_request_t* hs_static_session() {
+  for (int i = 0; i < HTTP_STATIC_SESSIONS; i++) {
+    hs_static_session_t* slot = &hs_static_sessions[i];
+    if (slot->used) continue;
+    slot->used = 1;
+    memset(&slot->session, 0, sizeof(slot->session));
+    return &slot->session;
+  }
+  return NULL;
 }
 
-int http_server_listen_poll(http_server_t* serv) {
-  http_listen(serv);
-  return 0;
-}
+#endif
+
+// Returns NULL if the connection can't be served, it has been closed then.
+http_request_t* hs_new_session(http_server_t* server, int sock) {
+#ifdef HTTP_STATIC_MEMORY
+  http_request_t* session = hs_static_session();
+  if (session == NULL) {
+    // Only when several servers share the table, max_connections stops
+    // accepting before it runs out otherwise.
+    close(sock);
+    return NULL;
+  }
+#else
+  http_request_t* session = (http_request_t*)calloc(1, sizeof(http_request_t));
+  assert(session != NULL);
+#endif
+  // Descriptors are handed out lowest first so every one below sock is in
+  // use.
+  int headroom = server->options.fd_headroom;
+  if (headroom > 0 && sock >= server->fd_limit - headroom) hs_evict_idle(server);
+  session->socket = sock;
+  session->server = server;
+  session->handler = hs_session_io_cb;
+  HS_TRACE(session, HS_TRACE_ACCEPT);
+  hs_reset_timeout(session, HTTP_REQUEST_TIMEOUT);
+  hs_add_events(session);
+  server->connections++;
+#ifdef HTTP_TLS
+  if (server->tls) hs_tls_new_session(session);
+#endif
+  return session;
+}
+
+// Accepting resumes when a connection closes.
+void hs_stop_accepting(http_server_t* server) {
+  if (server->accept_paused) return;
+  server->accept_paused = 1;
+  hs_pause_accept(server);
+}
+
+// Makes room once max_connections is reached by closing an idle connection,
+// or stops accepting if there is none.
+int hs_connection_limit(http_server_t* server) {
+  int max = server->options.max_connections;
+  if (max <= 0 || server->connections < max) return 0;
+  if (hs_evict_idle(server)) return 0;
+  hs_stop_accepting(server);
+  return 1;
+}
+
+// Accepting failed with err. When the process is out of descriptors an idle
+// connection is closed to make room. Without one the waiting client gets
+// the reserve descriptor and is closed, instead of being reported again and
+// again while it sits in the backlog. io_uring fails accepts for lack of a
+// descriptor before a client arrives, so once nobody is left to turn away
+// accepting waits for a connection to close. Returns 1 if accepting may go
+// on.
+int hs_accept_failed(hs_listener_t* listener, int err) {
+  http_server_t* server = listener->server;
+  if (err != EMFILE && err != ENFILE) return 0;
+  if (hs_evict_idle(server)) return 1;
+  if (server->reserve_fd < 0) {
+    hs_stop_accepting(server);
+    return 0;
+  }
+  close(server->reserve_fd);
+  int sock = accept(listener->socket, NULL, NULL);
+  if (sock >= 0) close(sock);
+  server->reserve_fd = open("/dev/null", O_RDONLY);
+  if (server->reserve_fd >= 0) fcntl(server->reserve_fd, F_SETFD, FD_CLOEXEC);
+#ifdef IO_URING
+  if (sock < 0) hs_stop_accepting(server);
+#endif
+  return sock >= 0;
+}
+
+void hs_accept_connections(hs_listener_t* listener) {
+  http_server_t* server = listener->server;
+  int batch = server->options.accept_batch;
+  int accepted = 0;
+  while (batch <= 0 || accepted < batch) {
+    if (hs_connection_limit(server)) return;
+    int sock = hs_accept(listener);
+    if (sock < 0 && hs_accept_failed(listener, errno)) continue;
+    if (sock <= 0) return;
+    http_request_t* session = hs_new_session(server, sock);
+    if (session) http_session(session);
+    accepted++;
+  }
+}
+
+// Writes the len lowest decimal digits of value, zero padded.
+void hs_format_digits(char* dst, int value, int len) {
+  while (len--) {
+    dst[len] = '0' + value % 10;
+    value /= 10;
+  }
+}
+
+// Formats the current time as RFC 7231 wants it in the Date header. The
+// names are spelled out here so the locale doesn't change them.
+void hs_generate_date_time(char* date) {
+  static char const days[] = "SunMonTueWedThuFriSat";
+  static char const months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  time_t now = time(NULL);
+  struct tm tm;
+  gmtime_r(&now, &tm);
+  memcpy(date, "Thu, 01 Jan 1970 00:00:00 GMT", HS_DATE_LEN + 1);
+  memcpy(date, days + tm.tm_wday * 3, 3);
+  hs_format_digits(date + 5, tm.tm_mday, 2);
+  memcpy(date + 8, months + tm.tm_mon * 3, 3);
+  hs_format_digits(date + 12, tm.tm_year + 1900, 4);
+  hs_format_digits(date + 17, tm.tm_hour, 2);
+  hs_format_digits(date + 20, tm.tm_min, 2);
+  hs_format_digits(date + 23, tm.tm_sec, 2);
+}
+
+http_server_t* http_server_init(int port, void (*handler)(http_request_t*)) {
+  http_server_t* serv = (http_server_t*)malloc(sizeof(http_server_t));
+  assert(serv != NULL);
+  serv->port = port;
+  serv->memused = 0;
+  serv->handler = hs_server_listen_cb;
+  hs_server_init(serv);
+  hs_generate_date_time(serv->date);
+  serv->request_handler = handler;
+  hs_init_status_lines();
+  http_server_options_init(&serv->options);
+#ifdef HTTP_STATIC_MEMORY
+  // Sessions read into buffers of their own.
+  serv->rbuf = NULL;
+  serv->rtokens = NULL;
+#else
+  serv->rbuf = (char*)malloc(HTTP_SHARED_BUF_SIZE);
+  assert(serv->rbuf != NULL);
+  serv->rtokens = (http_token_t*)malloc(HS_SHARED_TOKEN_COUNT * sizeof(http_token_t));
+  assert(serv->rtokens != NULL);
+#endif
+  serv->rbuf_owner = NULL;
+  serv->connections = 0;
+  serv->inflight = 0;
+  serv->accept_paused = 0;
+  serv->deferred_head = NULL;
+  serv->deferred_tail = NULL;
+  serv->resumed = NULL;
+  serv->deferred_turns = 0;
+  serv->idle_head = NULL;
+  serv->idle_tail = NULL;
+  serv->idle_count = 0;
+  serv->evictions = 0;
+  serv->reserve_fd = -1;
+  serv->fd_limit = 0;
+#ifdef HTTP_TRACE
+  memset(serv->trace_ring, 0, sizeof(serv->trace_ring));
+  serv->trace_head = 0;
+#endif
+#ifdef HTTP_WATCHDOG
+  serv->dispatch_start = 0;
+  serv->dispatch_seq = 0;
+  serv->stall_route[0] = '\0';
+  serv->stall_depth = 0;
+  serv->stall_seq = 0;
+  serv->stalls = 0;
+  serv->max_stall_us = 0;
+  serv->stall_cb = NULL;
+#endif
+  return serv;
+}
+
+void http_server_options_init(struct http_server_options_s* options) {
+  memset(options, 0, sizeof(*options));
+  options->backlog = 128;
+  options->use_accept4 = 1;
+  options->max_memory = HTTP_MAX_TOTAL_EST_MEM_USAGE;
+  options->low_priority_slice = 16384;
+  options->low_priority_share = 8;
+  options->fd_headroom = 16;
+#ifdef HTTP_STATIC_MEMORY
+  options->max_connections = HTTP_STATIC_SESSIONS;
+#endif
+}
+
+void http_server_set_options(
+  http_server_t* server,
+  struct http_server_options_s const* options
+) {
+  server->options = *options;
+#ifdef HTTP_STATIC_MEMORY
+  struct http_server_options_s* opts = &server->options;
+  if (opts->max_connections <= 0 || opts->max_connections > HTTP_STATIC_SESSIONS) {
+    opts->max_connections = HTTP_STATIC_SESSIONS;
+  }
+  opts->http2 = 0;
+#endif
+}
+
+// Applies the TCP level options to the listening socket. Linux and the BSDs
+// copy TCP_NODELAY to accepted sockets so it costs nothing per connection.
+void hs_set_listen_options(http_server_t* serv, int sock) {
+  struct http_server_options_s* opts = &serv->options;
+  if (opts->nodelay) {
+    int flag = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+  }
+#ifdef TCP_DEFER_ACCEPT
+  if (opts->defer_accept > 0) {
+    setsockopt(
+      sock, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+      &opts->defer_accept, sizeof(opts->defer_accept)
+    );
+  }
+#endif
+#ifdef TCP_FASTOPEN
+  if (opts->fastopen > 0) {
+    setsockopt(
+      sock, IPPROTO_TCP, TCP_FASTOPEN,
+      &opts->fastopen, sizeof(opts->fastopen)
+    );
+  }
+#endif
+}
+
+// Binds a socket to addr, starts listening on it and adds it to the
+// server's listeners. Exits if the address can't be bound.
+void hs_add_listener(http_server_t* serv, struct sockaddr* addr, socklen_t len) {
+  int sock = socket(addr->sa_family, SOCK_STREAM, 0);
+  int flag = 1;
+  if (addr->sa_family != AF_UNIX) {
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+    hs_set_listen_options(serv, sock);
+  }
+  if (addr->sa_family == AF_INET6) {
+    // IPv4 clients are accepted by the IPv4 listener.
+    setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &flag, sizeof(flag));
+  }
+  if (bind(sock, addr, len) < 0) {
+    exit(1);
+  }
+  int flags = fcntl(sock, F_GETFL, 0);
+  fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+  fcntl(sock, F_SETFD, FD_CLOEXEC);
+  listen(sock, serv->options.backlog);
+  hs_listener_t* listener = &serv->listeners[serv->listener_count++];
+  memset(listener, 0, sizeof(*listener));
+  listener->handler = hs_server_listen_cb;
+  listener->server = serv;
+  listener->socket = sock;
+}
+
+void hs_listen_unix(http_server_t* serv) {
+  char const * path = serv->options.unix_socket;
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    exit(1);
+  }
+  strcpy(addr.sun_path, path);
+  // A socket file left behind by an earlier run would fail the bind.
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+  hs_add_listener(serv, (struct sockaddr *)&addr, sizeof(addr));
+  if (serv->options.unix_socket_mode > 0) {
+    chmod(path, serv->options.unix_socket_mode);
+  }
+}
+
+void http_listen(http_server_t* serv) {
+  // Ignore SIGPIPE. We handle these errors at the call site.
+  signal(SIGPIPE, SIG_IGN);
+  serv->listener_count = 0;
+  if (serv->port > 0) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(serv->port);
+    hs_add_listener(serv, (struct sockaddr *)&addr, sizeof(addr));
+  }
+  if (serv->port > 0 && serv->options.ipv6) {
+    struct sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(serv->port);
+    hs_add_listener(serv, (struct sockaddr *)&addr, sizeof(addr));
+  }
+  if (serv->options.unix_socket) hs_listen_unix(serv);
+#ifdef HTTP_TLS
+  hs_tls_init(serv);
+#endif
+#ifdef HTTP_WATCHDOG
+  hs_watchdog_start(serv);
+#endif
+  struct rlimit limit;
+  serv->fd_limit = INT_MAX;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < INT_MAX) {
+    serv->fd_limit = (int)limit.rlim_cur;
+  }
+  serv->reserve_fd = open("/dev/null", O_RDONLY);
+  if (serv->reserve_fd >= 0) fcntl(serv->reserve_fd, F_SETFD, FD_CLOEXEC);
+  hs_add_server_sock_events(serv);
+}
+
+int http_server_listen_poll(http_server_t* serv) {
+  http_listen(serv);
+  return 0;
+}
 
 int http_server_loop(http_server_t* server) {
   return server->loop;
 }
 
+http_watch_t* http_server_watch(
+  http_server_t* server,
+  int fd,
+  int events,
+  void (*cb)(int fd, int events, void* data),
+  void* data
+) {
+  http_watch_t* watch = (http_watch_t*)calloc(1, sizeof(http_watch_t));
+  assert(watch != NULL);
+  watch->server = server;
+  watch->fd = fd;
+  watch->events = events & (HTTP_READABLE | HTTP_WRITABLE);
+  watch->cb = cb;
+  watch->data = data;
+  if (watch->events == 0 || hs_add_watch(watch) != 0) {
+    free(watch);
+    return NULL;
+  }
+  return watch;
+}
+
+void http_server_unwatch(http_watch_t* watch) {
+  hs_delete_watch(watch);
+}
+
+http_timer_t* http_server_timer(
+  http_server_t* server,
+  int ms,
+  int repeat,
+  void (*cb)(void* data),
+  void* data
+) {
+  http_timer_t* timer = (http_timer_t*)calloc(1, sizeof(http_timer_t));
+  assert(timer != NULL);
+  timer->server = server;
+  // A zero timerfd interval would disarm it.
+  timer->ms = ms > 0 ? ms : 1;
+  timer->repeat = repeat;
+  timer->cb = cb;
+  timer->data = data;
+  if (hs_add_timer(timer) != 0) {
+    free(timer);
+    return NULL;
+  }
+  return timer;
+}
+
+void http_server_cancel_timer(http_timer_t* timer) {
+  hs_delete_timer(timer);
+}
+
+// One-shot timers are freed before their callback is called so the
+// callback is free to create a new one.
+void hs_fire_timer(http_timer_t* timer) {
+  if (timer->repeat) return timer->cb(timer->data);
+  void (*cb)(void*) = timer->cb;
+  void* data = timer->data;
+  free(timer);
+  cb(data);
+}
+
+// Maps the readiness reported by the backend to the watched events.
+int hs_watch_events(http_watch_t* watch, int readable, int writable, int error) {
+  if (error) return watch->events;
+  int events = 0;
+  if (readable) events |= HTTP_READABLE;
+  if (writable) events |= HTTP_WRITABLE;
+  return events & watch->events;
+}
+
 // *** http request ***
 
 http_string_t http_get_token_string(http_request_t* request, int token_type) {
   http_string_t str = { 0, 0 };
   if (request->tokens.buf == NULL) return str;
-  for (int i = 0; i < request->tokens.size; i++) {
-    http_token_t token = request->tokens.buf[i];
-    if (token.type == token_type) {
-      str.buf = &request->buf[token.index];
-      str.len = token.len;
-      return str;
-    }
+  http_token_t token = request->slots[token_type == HTTP_BODY ? HS_SLOT_BODY : token_type];
+  if (token.type == token_type) {
+    str.buf = &request->buf[token.index];
+    str.len = token.len;
   }
   return str;
 }
@@ -1220,6 +3319,123 @@ int hs_case_insensitive_cmp(char const * a, char const * b, int len) {
   return 1;
 }
 
+unsigned int hs_header_hash(char const * key, int len) {
+  unsigned int hash = 0;
+  for (int i = 0; i < len; i++) {
+    char c = key[i] >= 'A' && key[i] <= 'Z' ? key[i] + 32 : key[i];
+    hash = hash * 31 + (unsigned char)c;
+  }
+  return hash & (HS_HEADER_BUCKETS - 1);
+}
+
+// The well-known header names all have different lengths so the length alone
+// picks the single candidate to compare against.
+int hs_known_header_id(char const * key, int len) {
+  char const * name;
+  int id;
+  switch (len) {
+    case 4: name = "host"; id = HS_H_HOST; break;
+    case 6: name = "expect"; id = HS_H_EXPECT; break;
+    case 7: name = "upgrade"; id = HS_H_UPGRADE; break;
+    case 10: name = "connection"; id = HS_H_CONNECTION; break;
+    case 12: name = "content-type"; id = HS_H_CONTENT_TYPE; break;
+    case 14: name = "content-length"; id = HS_H_CONTENT_LENGTH; break;
+    case 17: name = "transfer-encoding"; id = HS_H_TRANSFER_ENCODING; break;
+    default: return HS_H_UNKNOWN;
+  }
+  return hs_case_insensitive_cmp(key, name, len) ? id : HS_H_UNKNOWN;
+}
+
+// Called for every token the parser emits. Request line and body tokens are
+// stored in fixed slots and header keys are added to the header index so
+// that lookups are O(1) no matter how many headers were sent.
+void hs_index_token(http_request_t* request, http_token_t token) {
+  if (token.type <= HTTP_VERSION) {
+    request->slots[token.type] = token;
+  } else if (token.type == HTTP_BODY) {
+    request->slots[HS_SLOT_BODY] = token;
+  } else if (token.type == HTTP_HEADER_KEY) {
+    int n = (request->tokens.size - 1 - request->header_base) / 2 + 1;
+    if (n > HTTP_MAX_HEADER_COUNT + 1) return;
+    char const * key = &request->buf[token.index];
+    int id = hs_known_header_id(key, token.len);
+    if (id != HS_H_UNKNOWN && request->known_headers[id] == 0) {
+      request->known_headers[id] = n;
+    }
+    // Append to the end of the chain so duplicate headers resolve to the
+    // first occurrence.
+    request->header_next[n] = 0;
+    unsigned char* link = &request->header_buckets[hs_header_hash(key, token.len)];
+    while (*link) link = &request->header_next[*link];
+    *link = n;
+  }
+}
+
+http_string_t hs_header_value(http_request_t* request, int n) {
+  if (n == 0 || request->tokens.buf == NULL) return (http_string_t) { };
+  int i = HS_HEADER_KEY_TOKEN(request, n) + 1;
+  if (i >= request->tokens.size) return (http_string_t) { };
+  http_token_t token = request->tokens.buf[i];
+  return (http_string_t) {
+    .buf = &request->buf[token.index],
+    .len = token.len
+  };
+}
+
+// Finds a header in the raw head of a request whose headers haven't been
+// tokenized, for the few the server looks at itself. Returns the first one
+// with the name, its value without leading whitespace.
+http_string_t hs_scan_header(http_request_t* request, char const * name, int len) {
+  http_token_t version = request->slots[HTTP_VERSION];
+  if (version.type != HTTP_VERSION || request->buf == NULL) return (http_string_t) { };
+  char const * buf = request->buf;
+  int end = request->slots[HS_SLOT_BODY].type == HTTP_BODY ?
+    request->parser.body_start_index : request->bytes;
+  for (int i = version.index + version.len + 2; i + len < end; ) {
+    char const * cr = (char const *)memchr(&buf[i], '\r', end - i);
+    int eol = cr ? (int)(cr - buf) : end;
+    if (eol == i) break;
+    if (buf[i + len] == ':' && hs_case_insensitive_cmp(&buf[i], name, len)) {
+      int v = i + len + 1;
+      while (v < eol && (buf[v] == ' ' || buf[v] == '\t')) v++;
+      return (http_string_t) { .buf = &buf[v], .len = eol - v };
+    }
+    i = eol + 2;
+  }
+  return (http_string_t) { };
+}
+
+// Tokenizes and indexes the headers of a request parsed with the
+// lazy_headers option by parsing its head a second time. Their tokens are
+// appended after the body token.
+void hs_index_headers(http_request_t* request) {
+  if (!HTTP_FLAG_CHECK(request->parser.flags, HS_PF_LAZY)) return;
+  if (request->tokens.buf == NULL) return;
+  HTTP_FLAG_CLEAR(request->parser.flags, HS_PF_LAZY);
+  request->header_base = request->tokens.size;
+  http_parser_t parser = { };
+  parser.start = parser.token_start_index = request->slots[HTTP_METHOD].index;
+  http_token_t token;
+  do {
+    token = http_parse(&parser, request->buf, request->bytes);
+    if (token.type == HTTP_HEADER_KEY || token.type == HTTP_HEADER_VALUE) {
+      http_token_dyn_push(&request->tokens, token);
+      hs_index_token(request, token);
+    }
+  } while (token.type != HTTP_NONE && token.type != HTTP_BODY);
+}
+
+http_string_t hs_request_known_header(http_request_t* request, int id) {
+  if (HTTP_FLAG_CHECK(request->parser.flags, HS_PF_LAZY)) {
+    static char const * const names[HS_H_COUNT] = {
+      "host", "expect", "upgrade", "connection",
+      "content-type", "content-length", "transfer-encoding"
+    };
+    return hs_scan_header(request, names[id], strlen(names[id]));
+  }
+  return hs_header_value(request, request->known_headers[id]);
+}
+
 http_string_t http_request_method(http_request_t* request) {
   return http_get_token_string(request, HTTP_METHOD);
 }
@@ -1238,8 +3454,9 @@ int hs_assign_iteration_headers(
   http_string_t* val,
   int* iter
 ) {
+  if (*iter + 1 >= request->tokens.size) return 0;
   http_token_t token = request->tokens.buf[*iter];
-  if (request->tokens.buf[*iter].type == HTTP_BODY) return 0;
+  if (token.type != HTTP_HEADER_KEY) return 0;
   *key = (http_string_t) {
     .buf = &request->buf[token.index],
     .len = token.len
@@ -1259,32 +3476,25 @@ int http_request_iterate_headers(
   http_string_t* val,
   int* iter
 ) {
+  if (request->tokens.buf == NULL) return 0;
+  hs_index_headers(request);
   if (*iter == 0) {
-    for ( ; *iter < request->tokens.size; (*iter)++) {
-      http_token_t token = request->tokens.buf[*iter];
-      if (token.type == HTTP_HEADER_KEY) {
-        return hs_assign_iteration_headers(request, key, val, iter);
-      }
-    }
-    return 0;
+    *iter = request->header_base;
   } else {
     (*iter)++;
-    return hs_assign_iteration_headers(request, key, val, iter);
   }
+  return hs_assign_iteration_headers(request, key, val, iter);
 }
 
 http_string_t http_request_header(http_request_t* request, char const * key) {
+  if (request->tokens.buf == NULL) return (http_string_t) { };
+  hs_index_headers(request);
   int len = strlen(key);
-  for (int i = 0; i < request->tokens.size; i++) {
-    http_token_t token = request->tokens.buf[i];
-    if (token.type == HTTP_HEADER_KEY && token.len == len) {
-      if (hs_case_insensitive_cmp(&request->buf[token.index], key, len)) {
-        token = request->tokens.buf[i + 1];
-        return (http_string_t) {
-          .buf = &request->buf[token.index],
-          .len = token.len
-        };
-      }
+  int n = request->header_buckets[hs_header_hash(key, len)];
+  for ( ; n; n = request->header_next[n]) {
+    http_token_t token = request->tokens.buf[HS_HEADER_KEY_TOKEN(request, n)];
+    if (token.len == len && hs_case_insensitive_cmp(&request->buf[token.index], key, len)) {
+      return hs_header_value(request, n);
     }
   }
   return (http_string_t) { };
@@ -1302,11 +3512,19 @@ void http_request_set_userdata(http_request_t* request, void* data) {
   request->data = data;
 }
 
+http_server_t* http_request_server(http_request_t* request) {
+  return request->server;
+}
+
+void http_request_on_close(http_request_t* request, void (*close_cb)(http_request_t*)) {
+  request->close_cb = close_cb;
+}
+
 void hs_auto_detect_keep_alive(http_request_t* request) {
   http_string_t str = http_get_token_string(request, HTTP_VERSION);
   if (str.buf == NULL) return;
   int version = str.buf[str.len - 1] == '1';
-  str = http_request_header(request, "Connection");
+  str = hs_request_known_header(request, HS_H_CONNECTION);
   if (
     (str.len == 5 && hs_case_insensitive_cmp(str.buf, "close", 5)) ||
     (str.len == 0 && version == HTTP_1_0)
@@ -1317,6 +3535,21 @@ void hs_auto_detect_keep_alive(http_request_t* request) {
   }
 }
 
+void http_request_set_priority(http_request_t* request, int priority) {
+  request->priority = priority;
+}
+
+int http_request_early_data(http_request_t* request) {
+#ifdef HTTP_TLS
+  // Streams are handled as soon as their frames are read.
+  http_request_t* session = request->stream ? request->stream->session : request;
+  return session && session->tls && session->early_data;
+#else
+  (void)request;
+  return 0;
+#endif
+}
+
 void http_request_connection(http_request_t* request, int directive) {
   if (directive == HTTP_KEEP_ALIVE) {
     HTTP_FLAG_CLEAR(request->flags, HTTP_AUTOMATIC);
@@ -1327,27 +3560,102 @@ void http_request_connection(http_request_t* request, int directive) {
   }
 }
 
+int hs_chunk_wraps(http_request_t* request) {
+  hs_ring_t* ring = &request->ring;
+  int end = request->token.index + request->token.len;
+  return HTTP_FLAG_CHECK(request->parser.flags, HS_PF_CHUNKED) &&
+    request->token.index < ring->size && end > ring->size;
+}
+
 http_string_t http_request_chunk(struct http_request_s* request) {
+  if (hs_chunk_wraps(request)) hs_ring_linearize(request);
+  int index = request->token.index;
+  if (HTTP_FLAG_CHECK(request->parser.flags, HS_PF_CHUNKED)) {
+    index = hs_ring_index(&request->ring, index);
+  }
   return (http_string_t) {
-    .buf = &request->buf[request->token.index],
+    .buf = &request->buf[index],
     .len = request->token.len
   };
 }
 
+int http_request_chunk_spans(struct http_request_s* request, http_string_t spans[2]) {
+  if (request->token.len == 0) return 0;
+  if (!HTTP_FLAG_CHECK(request->parser.flags, HS_PF_CHUNKED)) {
+    spans[0] = http_request_chunk(request);
+    return 1;
+  }
+  hs_ring_t* ring = &request->ring;
+  int index = hs_ring_index(ring, request->token.index);
+  int len = ring->start + ring->size - index;
+  if (len >= request->token.len) {
+    spans[0] = (http_string_t) { &request->buf[index], request->token.len };
+    return 1;
+  }
+  spans[0] = (http_string_t) { &request->buf[index], len };
+  spans[1] = (http_string_t) { &request->buf[ring->start], request->token.len - len };
+  return 2;
+}
+
 // *** http response ***
 
+#ifdef HTTP_STATIC_MEMORY
+
+static http_response_t hs_static_responses[HS_STATIC_RESPONSES];
+
+// Takes a free response from the pool. Slots are claimed with a CAS as
+// responses may be created on other threads for http_respond_async.
+http_response_t* hs_static_response() {
+  for (int i = 0; i < HS_STATIC_RESPONSES; i++) {
+    http_response_t* response = &hs_static_responses[i];
+    char used = 0;
+    if (!__atomic_compare_exchange_n(
+      &response->used, &used, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED
+    )) {
+      continue;
+    }
+    response->headers = NULL;
+    response->body = NULL;
+    response->parts = NULL;
+    response->part_count = 0;
+    response->content_length = 0;
+    response->async_request = NULL;
+    response->async_next = NULL;
+    response->header_count = 0;
+    response->overflow = 0;
+    return response;
+  }
+  return NULL;
+}
+
+#endif
+
 http_response_t* http_response_init() {
+#ifdef HTTP_STATIC_MEMORY
+  http_response_t* response = hs_static_response();
+#else
   http_response_t* response = (http_response_t*)calloc(1, sizeof(http_response_t));
+#endif
   assert(response != NULL);
   response->status = 200;
   return response;
 }
 
 void http_response_header(http_response_t* response, char const * key, char const * value) {
+#ifdef HTTP_STATIC_MEMORY
+  if (response->header_count == HTTP_STATIC_RESPONSE_HEADERS) {
+    response->overflow = 1;
+    return;
+  }
+  http_header_t* header = &response->header_slots[response->header_count++];
+#else
   http_header_t* header = (http_header_t*)malloc(sizeof(http_header_t));
   assert(header != NULL);
+#endif
   header->key = key;
   header->value = value;
+  header->key_len = strlen(key);
+  header->value_len = strlen(value);
   http_header_t* prev = response->headers;
   header->next = prev;
   response->headers = header;
@@ -1359,14 +3667,35 @@ void http_response_status(http_response_t* response, int status) {
 
 void http_response_body(http_response_t* response, char const * body, int length) {
   response->body = body;
+  response->parts = NULL;
   response->content_length = length;
 }
 
+void http_response_body_parts(
+  http_response_t* response,
+  struct http_string_s const * parts,
+  int count
+) {
+  response->body = NULL;
+  response->parts = parts;
+  response->part_count = count;
+  response->content_length = 0;
+  for (int i = 0; i < count; i++) response->content_length += parts[i].len;
+}
+
 typedef struct {
   char* buf;
   int capacity;
   int size;
   long* memused;
+#ifdef HTTP_STATIC_MEMORY
+  // A fixed buffer doesn't grow, what doesn't fit sets overflow instead.
+  char fixed;
+  char overflow;
+  // Set for the chunks after the first of a chunked response, whose head
+  // has been sent already.
+  char continued;
+#endif
 } grwprintf_t;
 
 void grwprintf_init(grwprintf_t* ctx, int capacity, long* memused) {
@@ -1376,9 +3705,35 @@ void grwprintf_init(grwprintf_t* ctx, int capacity, long* memused) {
   *ctx->memused += capacity;
   assert(ctx->buf != NULL);
   ctx->capacity = capacity;
+#ifdef HTTP_STATIC_MEMORY
+  ctx->fixed = 0;
+#endif
 }
 
-void grwmemcpy(grwprintf_t* ctx, char const * src, int size) {
+// Starts a response in the session's write buffer.
+void hs_response_buffer_init(http_request_t* request, grwprintf_t* ctx) {
+#ifdef HTTP_STATIC_MEMORY
+  ctx->memused = &request->server->memused;
+  ctx->size = 0;
+  ctx->buf = ((hs_static_session_t*)request)->out;
+  ctx->capacity = HTTP_STATIC_RESPONSE_SIZE;
+  ctx->fixed = 1;
+  ctx->overflow = 0;
+  ctx->continued = HTTP_FLAG_CHECK(request->flags, HTTP_CHUNKED_RESPONSE) != 0;
+#else
+  grwprintf_init(ctx, HTTP_RESPONSE_BUF_SIZE, &request->server->memused);
+#endif
+}
+
+// Makes room for size more bytes. Returns 0 if they don't fit a fixed
+// buffer.
+int grwreserve(grwprintf_t* ctx, int size) {
+#ifdef HTTP_STATIC_MEMORY
+  if (ctx->fixed && ctx->size + size > ctx->capacity) {
+    ctx->overflow = 1;
+    return 0;
+  }
+#endif
   if (ctx->size + size > ctx->capacity) {
     *ctx->memused -= ctx->capacity;
     ctx->capacity = ctx->size + size;
@@ -1386,48 +3741,135 @@ void grwmemcpy(grwprintf_t* ctx, char const * src, int size) {
     ctx->buf = (char*)realloc(ctx->buf, ctx->capacity);
     assert(ctx->buf != NULL);
   }
+  return 1;
+}
+
+void grwmemcpy(grwprintf_t* ctx, char const * src, int size) {
+  if (!grwreserve(ctx, size)) return;
   memcpy(ctx->buf + ctx->size, src, size);
   ctx->size += size;
 }
 
-void grwprintf(grwprintf_t* ctx, char const * fmt, ...) {
-  va_list args;
-  va_start(args, fmt);
+// Response heads are serialized in two passes. The first adds up their exact
+// size so the buffer grows at most once, the second copies the parts in
+// without any formatting.
+
+static char hs_status_lines[HS_STATUS_LINES_SIZE];
+static unsigned short hs_status_line_at[600];
+static unsigned char hs_status_line_len[600];
+
+// Builds the status line of every status from hs_status_text, once per
+// process.
+void hs_init_status_lines() {
+  if (hs_status_line_len[200]) return;
+  int at = 0;
+  for (int status = 100; status < 600; status++) {
+    int len = snprintf(
+      hs_status_lines + at, HS_STATUS_LINES_SIZE - at,
+      "HTTP/1.1 %d %s\r\n", status, hs_status_text[status]
+    );
+    assert(at + len < HS_STATUS_LINES_SIZE);
+    hs_status_line_at[status] = at;
+    hs_status_line_len[status] = len;
+    at += len;
+  }
+}
 
-  int bytes = vsnprintf(ctx->buf + ctx->size, ctx->capacity - ctx->size, fmt, args);
-  if (bytes + ctx->size > ctx->capacity) {
-    *ctx->memused -= ctx->capacity;
-    while (bytes + ctx->size > ctx->capacity) ctx->capacity *= 2;
-    *ctx->memused += ctx->capacity;
-    ctx->buf = (char*)realloc(ctx->buf, ctx->capacity);
-    assert(ctx->buf != NULL);
-    bytes += vsnprintf(ctx->buf + ctx->size, ctx->capacity - ctx->size, fmt, args);
+// Writes value in the given base, 10 or 16, and returns the number of
+// digits.
+int hs_format_int(char* dst, unsigned value, unsigned base) {
+  char digits[16];
+  int n = 0;
+  do {
+    digits[n++] = "0123456789ABCDEF"[value % base];
+    value /= base;
+  } while (value);
+  for (int i = 0; i < n; i++) dst[i] = digits[n - 1 - i];
+  return n;
+}
+
+char* hs_copy(char* dst, char const * src, int len) {
+  if (len > 0) memcpy(dst, src, len);
+  return dst + len;
+}
+
+int hs_body_length(http_response_t* response) {
+  return response->body || response->parts ? response->content_length : 0;
+}
+
+// Copies the body, gathering it from its parts if it has them.
+char* hs_copy_body(char* dst, http_response_t* response) {
+  if (response->body) return hs_copy(dst, response->body, response->content_length);
+  for (int i = 0; i < response->part_count; i++) {
+    dst = hs_copy(dst, response->parts[i].buf, response->parts[i].len);
   }
-  ctx->size += bytes;
- 
-  va_end(args);
+  return dst;
 }
 
-void http_buffer_headers(
+// Size of the header lines and the empty line that ends the head. The
+// Content-Length is formatted into length on the way.
+int hs_header_lines_size(
   http_request_t* request,
   http_response_t* response,
-  grwprintf_t* printctx
+  char* length,
+  int* length_len
 ) {
-  http_header_t* header = response->headers;
-  while (header) {
-    grwprintf(printctx, "%s: %s\r\n", header->key, header->value);
-    header = header->next;
+  int size = 2;
+  for (http_header_t* header = response->headers; header; header = header->next) {
+    size += header->key_len + header->value_len + 4;
   }
+  *length_len = 0;
   if (!HTTP_FLAG_CHECK(request->flags, HTTP_CHUNKED_RESPONSE)) {
-    grwprintf(printctx, "Content-Length: %d\r\n", response->content_length);
+    *length_len = hs_format_int(length, response->content_length, 10);
+    size += sizeof("Content-Length: \r\n") - 1 + *length_len;
+  }
+  return size;
+}
+
+char* hs_write_header_lines(
+  char* dst,
+  http_response_t* response,
+  char const * length,
+  int length_len
+) {
+  for (http_header_t* header = response->headers; header; header = header->next) {
+    dst = hs_copy(dst, header->key, header->key_len);
+    dst = hs_copy(dst, ": ", 2);
+    dst = hs_copy(dst, header->value, header->value_len);
+    dst = hs_copy(dst, "\r\n", 2);
   }
-  grwprintf(printctx, "\r\n");
+  if (length_len) {
+    dst = hs_copy(dst, "Content-Length: ", 16);
+    dst = hs_copy(dst, length, length_len);
+    dst = hs_copy(dst, "\r\n", 2);
+  }
+  return hs_copy(dst, "\r\n", 2);
+}
+
+// Writes the header lines, or the trailers of a chunked response. Room is
+// made for tail more bytes that follow them at the same time.
+void http_buffer_headers(
+  http_request_t* request,
+  http_response_t* response,
+  grwprintf_t* printctx,
+  int tail
+) {
+  char length[16];
+  int length_len;
+  int size = hs_header_lines_size(request, response, length, &length_len);
+  if (!grwreserve(printctx, size + tail)) return;
+  char* dst = printctx->buf + printctx->size;
+  dst = hs_write_header_lines(dst, response, length, length_len);
+  printctx->size = dst - printctx->buf;
 }
 
+// Writes the response head. Room is made for tail more bytes that follow it,
+// e.g. the body, at the same time.
 void http_respond_headers(
   http_request_t* request,
   http_response_t* response,
-  grwprintf_t* printctx
+  grwprintf_t* printctx,
+  int tail
 ) {
   if (HTTP_FLAG_CHECK(request->flags, HTTP_AUTOMATIC)) {
     hs_auto_detect_keep_alive(request);
@@ -1437,26 +3879,75 @@ void http_respond_headers(
   } else {
     http_response_header(response, "Connection", "close");
   }
-  grwprintf(
-    printctx, "HTTP/1.1 %d %s\r\nDate: %.24s\r\n",
-    response->status, hs_status_text[response->status], request->server->date
-  );
-  http_buffer_headers(request, response, printctx);
+  char length[16];
+  int length_len;
+  int status = response->status;
+  int size = hs_status_line_len[status] + sizeof("Date: \r\n") - 1 + HS_DATE_LEN;
+  size += hs_header_lines_size(request, response, length, &length_len);
+  if (!grwreserve(printctx, size + tail)) return;
+  char* dst = printctx->buf + printctx->size;
+  dst = hs_copy(dst, hs_status_lines + hs_status_line_at[status], hs_status_line_len[status]);
+  dst = hs_copy(dst, "Date: ", 6);
+  dst = hs_copy(dst, request->server->date, HS_DATE_LEN);
+  dst = hs_copy(dst, "\r\n", 2);
+  dst = hs_write_header_lines(dst, response, length, length_len);
+  printctx->size = dst - printctx->buf;
 }
 
-void http_end_response(http_request_t* request, http_response_t* response, grwprintf_t* printctx) {
+void hs_free_response(http_response_t* response) {
+#ifdef HTTP_STATIC_MEMORY
+  __atomic_store_n(&response->used, 0, __ATOMIC_RELEASE);
+#else
   http_header_t* header = response->headers;
   while (header) {
     http_header_t* tmp = header;
     header = tmp->next;
     free(tmp);
   }
-  hs_free_buffer(request);
   free(response);
+#endif
+}
+
+#ifdef HTTP_STATIC_MEMORY
+
+static char const hs_overflow_response[] =
+  "HTTP/1.1 500 Internal Server Error\r\n"
+  "Content-Length: 0\r\n"
+  "Connection: close\r\n"
+  "\r\n";
+
+// The response didn't fit into the session's buffers. Answers with a 500
+// instead, or, if the head of a chunked response has gone out already, ends
+// the connection once what was sent before has been written.
+void hs_response_overflow(http_request_t* request, grwprintf_t* printctx) {
+  printctx->size = 0;
+  if (!printctx->continued) {
+    memcpy(printctx->buf, hs_overflow_response, sizeof(hs_overflow_response) - 1);
+    printctx->size = sizeof(hs_overflow_response) - 1;
+  }
+  HTTP_FLAG_CLEAR(request->flags, HTTP_CHUNKED_RESPONSE);
+  http_request_connection(request, HTTP_CLOSE);
+}
+
+#endif
+
+void http_end_response(http_request_t* request, http_response_t* response, grwprintf_t* printctx) {
+#ifdef HTTP_STATIC_MEMORY
+  if (printctx->overflow || response->overflow) {
+    hs_response_overflow(request, printctx);
+  }
+#endif
+  hs_free_response(response);
+  hs_free_buffer(request);
   request->buf = printctx->buf;
   request->written = 0;
   request->bytes = printctx->size;
   request->capacity = printctx->capacity;
+  hs_response_ready(request);
+}
+
+// Starts writing what is in the session's buffer.
+void hs_response_ready(http_request_t* request) {
   request->state = HTTP_SESSION_WRITE;
   // Signal that the response is ready for writing.
   HTTP_FLAG_SET(request->flags, HTTP_RESPONSE_READY);
@@ -1468,11 +3959,17 @@ void http_end_response(http_request_t* request, http_response_t* response, grwpr
 }
 
 void http_respond(http_request_t* request, http_response_t* response) {
+#ifdef HTTP_TRACE
+  hs_trace_response(request, response);
+#endif
+  request->close_cb = NULL;
+  int length = hs_body_length(response);
+  if (request->stream) return hs_h2_respond(request, response, NULL, 1, length);
   grwprintf_t printctx;
-  grwprintf_init(&printctx, HTTP_RESPONSE_BUF_SIZE, &request->server->memused);
-  http_respond_headers(request, response, &printctx);
-  if (response->body) {
-    grwmemcpy(&printctx, response->body, response->content_length);
+  hs_response_buffer_init(request, &printctx);
+  http_respond_headers(request, response, &printctx, length);
+  if (length > 0 && grwreserve(&printctx, length)) {
+    printctx.size = hs_copy_body(printctx.buf + printctx.size, response) - printctx.buf;
   }
   http_end_response(request, response, &printctx);
 }
@@ -1482,40 +3979,2086 @@ void http_respond_chunk(
   http_response_t* response,
   void (*cb)(http_request_t*)
 ) {
+#ifdef HTTP_TRACE
+  hs_trace_response(request, response);
+#endif
+  if (request->stream) return hs_h2_respond(request, response, cb, 0, -1);
   grwprintf_t printctx;
-  grwprintf_init(&printctx, HTTP_RESPONSE_BUF_SIZE, &request->server->memused);
+  hs_response_buffer_init(request, &printctx);
+  char size[8];
+  int size_len = hs_format_int(size, response->content_length, 16);
+  int chunk = size_len + response->content_length + 4;
   if (!HTTP_FLAG_CHECK(request->flags, HTTP_CHUNKED_RESPONSE)) {
     HTTP_FLAG_SET(request->flags, HTTP_CHUNKED_RESPONSE);
     http_response_header(response, "Transfer-Encoding", "chunked");
-    http_respond_headers(request, response, &printctx);
+    http_respond_headers(request, response, &printctx, chunk);
   }
   request->chunk_cb = cb;
-  grwprintf(&printctx, "%X\r\n", response->content_length);
-  grwmemcpy(&printctx, response->body, response->content_length);
-  grwprintf(&printctx, "\r\n");
+  if (response->content_length > 0 && grwreserve(&printctx, chunk)) {
+    char* dst = printctx.buf + printctx.size;
+    dst = hs_copy(dst, size, size_len);
+    dst = hs_copy(dst, "\r\n", 2);
+    dst = hs_copy_body(dst, response);
+    dst = hs_copy(dst, "\r\n", 2);
+    printctx.size = dst - printctx.buf;
+  }
   http_end_response(request, response, &printctx);
 }
 
 void http_respond_chunk_end(http_request_t* request, http_response_t* response) {
+  request->close_cb = NULL;
+  if (request->stream) return hs_h2_respond(request, response, NULL, 1, -1);
   grwprintf_t printctx;
-  grwprintf_init(&printctx, HTTP_RESPONSE_BUF_SIZE, &request->server->memused);
-  grwprintf(&printctx, "0\r\n");
-  http_buffer_headers(request, response, &printctx);
-  grwprintf(&printctx, "\r\n");
+  hs_response_buffer_init(request, &printctx);
+  grwmemcpy(&printctx, "0\r\n", 3);
+  // The trailers end with the empty line that ends the body.
+  http_buffer_headers(request, response, &printctx, 0);
   HTTP_FLAG_CLEAR(request->flags, HTTP_CHUNKED_RESPONSE);
   http_end_response(request, response, &printctx);
 }
 
+// *** async responses ***
+
+void http_request_async(http_request_t* request) {
+  HTTP_FLAG_SET(request->flags, HTTP_ASYNC);
+  // The request data is read from another thread so it can't stay in the
+  // shared read buffer.
+  hs_own_buffer(request);
+}
+
+void http_respond_async(http_request_t* request, http_response_t* response) {
+  http_server_t* server = request->server;
+  response->async_request = request;
+  // The response belongs to the loop thread as soon as the CAS succeeds so
+  // only the local copy of the old head may be used afterwards.
+  http_response_t* head = __atomic_load_n(&server->async_head, __ATOMIC_RELAXED);
+  do {
+    response->async_next = head;
+  } while (!__atomic_compare_exchange_n(
+    &server->async_head, &head, response,
+    1, __ATOMIC_RELEASE, __ATOMIC_RELAXED
+  ));
+  // Only the producer that finds the queue empty needs to wake the loop. The
+  // others are picked up by the same drain.
+  if (head == NULL) hs_wake_loop(server);
+}
+
+// Runs on the loop thread after the wakeup has been consumed.
+void hs_drain_async(http_server_t* server) {
+  http_response_t* list = __atomic_exchange_n(&server->async_head, NULL, __ATOMIC_ACQUIRE);
+  // Reverse the list to respond in the order the responses were queued.
+  http_response_t* fifo = NULL;
+  while (list) {
+    http_response_t* next = list->async_next;
+    list->async_next = fifo;
+    fifo = list;
+    list = next;
+  }
+  while (fifo) {
+    http_response_t* response = fifo;
+    http_request_t* request = response->async_request;
+    fifo = response->async_next;
+    HTTP_FLAG_CLEAR(request->flags, HTTP_ASYNC);
+    if (HTTP_FLAG_CHECK(request->flags, HTTP_ENDED)) {
+      // The connection went away while the response was being prepared.
+      hs_free_response(response);
+      hs_release_session(request);
+    } else {
+      http_respond(request, response);
+    }
+  }
+}
+
+#ifndef KQUEUE
+
+void hs_wake_loop(http_server_t* serv) {
+  uint64_t one = 1;
+  int bytes = write(serv->async_fd, &one, sizeof(one));
+  (void)bytes; // suppress warning
+}
+
+#endif
+
+// *** broadcasts ***
+
+http_broadcast_t* http_broadcast_init(http_server_t* server, int backlog, int policy) {
+  http_broadcast_t* broadcast = (http_broadcast_t*)calloc(1, sizeof(http_broadcast_t));
+  assert(broadcast != NULL);
+  broadcast->server = server;
+  broadcast->backlog = backlog > 0 ? backlog : 1;
+  broadcast->policy = policy;
+  return broadcast;
+}
+
+void hs_release_chunk(http_server_t* server, hs_shared_chunk_t* chunk) {
+  if (--chunk->refs > 0) return;
+  server->memused -= chunk->len;
+  free(chunk);
+}
+
+// The subscriber's chunk has been written, the next queued one goes out.
+void hs_broadcast_next(http_request_t* request);
+
+// Writes the chunk to the subscriber, which holds a reference to it. HTTP/1
+// sessions write it from the shared buffer. HTTP/2 streams have to frame it
+// so it is copied there like any chunk.
+void hs_broadcast_write(hs_subscriber_t* sub, hs_shared_chunk_t* chunk) {
+  http_request_t* request = sub->request;
+  sub->busy = 1;
+  if (request->stream) {
+    http_response_t* response = http_response_init();
+    http_response_body(response, chunk->buf + chunk->head, chunk->len - chunk->head - 2);
+    hs_h2_respond(request, response, hs_broadcast_next, 0, -1);
+    return hs_release_chunk(request->server, chunk);
+  }
+  hs_free_buffer(request);
+  request->shared = chunk;
+  request->buf = chunk->buf;
+  request->written = 0;
+  request->bytes = chunk->len;
+  request->capacity = chunk->len;
+  hs_response_ready(request);
+}
+
+void hs_broadcast_next(http_request_t* request) {
+  hs_subscriber_t* sub = request->subscriber;
+  sub->busy = 0;
+  if (sub->count == 0) return;
+  hs_shared_chunk_t* chunk = sub->queue[sub->head];
+  sub->head = (sub->head + 1) % sub->broadcast->backlog;
+  sub->count--;
+  hs_broadcast_write(sub, chunk);
+}
+
+void hs_broadcast_end(http_request_t* request) {
+  http_respond_chunk_end(request, http_response_init());
+}
+
+// Closes the connection of a subscriber that can't keep up, or resets its
+// stream on HTTP/2 connections.
+void hs_broadcast_disconnect(hs_subscriber_t* sub) {
+  http_request_t* request = sub->request;
+  if (request->stream == NULL) return hs_end_session(request);
+  http_request_t* session = request->stream->session;
+  hs_h2_rst(session, request->stream->id, HS_H2_CANCEL);
+  hs_h2_close_stream(request->stream);
+  hs_h2_run(session, 0);
+}
+
+void http_broadcast_subscribe(
+  http_broadcast_t* broadcast,
+  http_request_t* request,
+  http_response_t* response
+) {
+  int queue_size = broadcast->backlog * sizeof(hs_shared_chunk_t*);
+  hs_subscriber_t* sub = (hs_subscriber_t*)calloc(1, sizeof(hs_subscriber_t) + queue_size);
+  assert(sub != NULL);
+  broadcast->server->memused += sizeof(hs_subscriber_t) + queue_size;
+  sub->queue = (hs_shared_chunk_t**)(sub + 1);
+  sub->broadcast = broadcast;
+  sub->request = request;
+  sub->next = broadcast->subscribers;
+  if (sub->next) sub->next->prev = sub;
+  broadcast->subscribers = sub;
+  broadcast->count++;
+  request->subscriber = sub;
+  sub->busy = 1;
+  http_respond_chunk(request, response, hs_broadcast_next);
+}
+
+void hs_broadcast_remove(hs_subscriber_t* sub) {
+  http_broadcast_t* broadcast = sub->broadcast;
+  if (broadcast->cursor == sub) broadcast->cursor = sub->next;
+  if (sub->prev) {
+    sub->prev->next = sub->next;
+  } else {
+    broadcast->subscribers = sub->next;
+  }
+  if (sub->next) sub->next->prev = sub->prev;
+  broadcast->count--;
+  http_server_t* server = broadcast->server;
+  for (; sub->count > 0; sub->count--) {
+    hs_release_chunk(server, sub->queue[sub->head]);
+    sub->head = (sub->head + 1) % broadcast->backlog;
+  }
+  sub->request->subscriber = NULL;
+  server->memused -= sizeof(hs_subscriber_t) + broadcast->backlog * sizeof(hs_shared_chunk_t*);
+  free(sub);
+}
+
+void http_broadcast_send(http_broadcast_t* broadcast, char const * body, int length) {
+  if (length <= 0 || broadcast->subscribers == NULL) return;
+  char size[8];
+  int size_len = hs_format_int(size, length, 16);
+  int len = size_len + length + 4;
+  hs_shared_chunk_t* chunk = (hs_shared_chunk_t*)malloc(sizeof(hs_shared_chunk_t) + len);
+  assert(chunk != NULL);
+  broadcast->server->memused += len;
+  chunk->buf = (char*)(chunk + 1);
+  chunk->len = len;
+  chunk->head = size_len + 2;
+  // The send holds a reference of its own until every subscriber has one.
+  chunk->refs = 1;
+  char* dst = hs_copy(chunk->buf, size, size_len);
+  dst = hs_copy(dst, "\r\n", 2);
+  dst = hs_copy(dst, body, length);
+  hs_copy(dst, "\r\n", 2);
+  broadcast->cursor = broadcast->subscribers;
+  while (broadcast->cursor) {
+    hs_subscriber_t* sub = broadcast->cursor;
+    broadcast->cursor = sub->next;
+    if (!sub->busy) {
+      chunk->refs++;
+      hs_broadcast_write(sub, chunk);
+    } else if (sub->count < broadcast->backlog) {
+      chunk->refs++;
+      sub->queue[(sub->head + sub->count) % broadcast->backlog] = chunk;
+      sub->count++;
+    } else if (broadcast->policy == HTTP_BROADCAST_DISCONNECT) {
+      hs_broadcast_disconnect(sub);
+    }
+  }
+  hs_release_chunk(broadcast->server, chunk);
+}
+
+void http_broadcast_unsubscribe(http_request_t* request) {
+  hs_subscriber_t* sub = request->subscriber;
+  if (sub == NULL) return;
+  int busy = sub->busy;
+  hs_broadcast_remove(sub);
+  if (busy) {
+    request->chunk_cb = hs_broadcast_end;
+  } else {
+    hs_broadcast_end(request);
+  }
+}
+
+int http_broadcast_count(http_broadcast_t* broadcast) {
+  return broadcast->count;
+}
+
+void http_broadcast_free(http_broadcast_t* broadcast) {
+  while (broadcast->subscribers) {
+    http_broadcast_unsubscribe(broadcast->subscribers->request);
+  }
+  free(broadcast);
+}
+
+#if defined(HTTP_TRACE) || defined(HTTP_WATCHDOG)
+
+uint64_t hs_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Copies the request line into a label of HS_LABEL_SIZE bytes. Anything that
+// would need escaping in JSON is replaced.
+void hs_request_label(http_request_t* request, char* label) {
+  http_string_t parts[2] = {
+    http_request_method(request),
+    http_request_target(request)
+  };
+  int len = 0;
+  for (int i = 0; i < 2; i++) {
+    if (i > 0 && len < HS_LABEL_SIZE - 1) label[len++] = ' ';
+    for (int j = 0; j < parts[i].len && len < HS_LABEL_SIZE - 1; j++) {
+      char c = parts[i].buf[j];
+      label[len++] = c < 0x20 || c == '"' || c == '\\' ? '?' : c;
+    }
+  }
+  label[len] = '\0';
+}
+
+#endif
+
+// *** tracing ***
+
+#ifdef HTTP_TRACE
+
+// Appends the completed request to the ring. The record is marked as being
+// written first so a reader copying it at the same time drops the copy.
+void hs_trace_push(http_request_t* request) {
+  http_server_t* server = request->server;
+  unsigned head = server->trace_head;
+  hs_trace_record_t* record = &server->trace_ring[head & (HTTP_TRACE_RING_SIZE - 1)];
+  unsigned seq = record->seq;
+  __atomic_store_n(&record->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  record->id = head;
+  memcpy(record->stamps, request->trace.stamps, sizeof(record->stamps));
+  memcpy(record->label, request->trace.label, sizeof(record->label));
+  __atomic_store_n(&record->seq, seq + 2, __ATOMIC_RELEASE);
+  __atomic_store_n(&server->trace_head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Records the first time the request reaches the stage. Completion moves the
+// request into the ring and leaves the session clean for the next request on
+// the connection.
+void hs_trace_stamp(http_request_t* request, int stage) {
+  hs_trace_t* trace = &request->trace;
+  if (trace->stamps[stage]) return;
+  trace->stamps[stage] = hs_now_ns();
+  if (stage == HS_TRACE_HANDLER) {
+    hs_request_label(request, trace->label);
+  } else if (stage == HS_TRACE_DONE) {
+    hs_trace_push(request);
+    memset(trace->stamps, 0, sizeof(trace->stamps));
+  }
+}
+
+double hs_trace_ms(uint64_t from, uint64_t to) {
+  return from && to > from ? (to - from) / 1e6 : 0;
+}
+
+// Called with the first response of the request, before its headers are
+// written.
+void hs_trace_response(http_request_t* request, http_response_t* response) {
+  hs_trace_t* trace = &request->trace;
+  if (trace->stamps[HS_TRACE_RESPOND]) return;
+  hs_trace_stamp(request, HS_TRACE_RESPOND);
+  if (!request->server->options.server_timing) return;
+  uint64_t* stamps = trace->stamps;
+  snprintf(
+    trace->timing, sizeof(trace->timing), "recv;dur=%.3f, app;dur=%.3f",
+    hs_trace_ms(stamps[HS_TRACE_READ], stamps[HS_TRACE_HANDLER]),
+    hs_trace_ms(stamps[HS_TRACE_HANDLER], stamps[HS_TRACE_RESPOND])
+  );
+  http_response_header(response, "Server-Timing", trace->timing);
+}
+
+// Copies a record from the ring. Returns 0 if it was being written.
+int hs_trace_read(hs_trace_record_t* record, hs_trace_record_t* copy) {
+  unsigned seq = __atomic_load_n(&record->seq, __ATOMIC_ACQUIRE);
+  if (seq & 1) return 0;
+  memcpy(copy, record, sizeof(*copy));
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&record->seq, __ATOMIC_RELAXED) == seq;
+}
+
+// Phases of a request as trace events, the span between two stamps each.
+static struct {
+  char const * name;
+  int from;
+  int to;
+} const hs_trace_phases[] = {
+  { "connect", HS_TRACE_ACCEPT, HS_TRACE_READ },
+  { "read", HS_TRACE_READ, HS_TRACE_PARSED },
+  { "body", HS_TRACE_PARSED, HS_TRACE_HANDLER },
+  { "handler", HS_TRACE_HANDLER, HS_TRACE_HANDLER_EXIT },
+  { "wait", HS_TRACE_HANDLER_EXIT, HS_TRACE_RESPOND },
+  { "write", HS_TRACE_RESPOND, HS_TRACE_DONE },
+};
+
+#define HS_TRACE_PHASE_COUNT (sizeof(hs_trace_phases) / sizeof(hs_trace_phases[0]))
+
+// Writes the events of one request. Returns the number of bytes written or
+// 0 if they don't all fit.
+int hs_trace_events(hs_trace_record_t* record, char* buf, int len) {
+  int pos = 0;
+  uint64_t* stamps = record->stamps;
+  for (unsigned i = 0; i < HS_TRACE_PHASE_COUNT; i++) {
+    uint64_t from = stamps[hs_trace_phases[i].from];
+    uint64_t to = stamps[hs_trace_phases[i].to];
+    // A response from the handler is written once it returns.
+    if (hs_trace_phases[i].to == HS_TRACE_DONE) {
+      uint64_t exit = stamps[HS_TRACE_HANDLER_EXIT];
+      if (exit > from) from = exit;
+    }
+    if (!from || to < from) continue;
+    int n = snprintf(
+      buf + pos, len - pos,
+      "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+      "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"request\":\"%s\"}}",
+      pos ? "," : "", hs_trace_phases[i].name, record->id,
+      from / 1e3, (to - from) / 1e3, record->label
+    );
+    if (n >= len - pos) return 0;
+    pos += n;
+  }
+  if (stamps[HS_TRACE_WRITE]) {
+    int n = snprintf(
+      buf + pos, len - pos,
+      "%s{\"name\":\"first byte\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,"
+      "\"tid\":%u,\"ts\":%.3f}",
+      pos ? "," : "", record->id, stamps[HS_TRACE_WRITE] / 1e3
+    );
+    if (n >= len - pos) return 0;
+    pos += n;
+  }
+  return pos;
+}
+
+int http_server_trace_json(http_server_t* server, char* buf, int len) {
+  static char const open[] = "{\"traceEvents\":[";
+  static char const close[] = "]}";
+  // Room for the closing brackets, a separator and the terminator.
+  int end = len - (int)sizeof(close) - 1;
+  if (end < (int)sizeof(open)) return 0;
+  memcpy(buf, open, sizeof(open) - 1);
+  int pos = sizeof(open) - 1;
+  unsigned head = __atomic_load_n(&server->trace_head, __ATOMIC_ACQUIRE);
+  unsigned oldest = head > HTTP_TRACE_RING_SIZE ? head - HTTP_TRACE_RING_SIZE : 0;
+  for (unsigned id = head; id-- != oldest;) {
+    hs_trace_record_t record;
+    hs_trace_record_t* slot = &server->trace_ring[id & (HTTP_TRACE_RING_SIZE - 1)];
+    // Skip records overwritten since head was read.
+    if (!hs_trace_read(slot, &record) || record.id != id) continue;
+    int sep = pos > (int)sizeof(open) - 1;
+    if (sep) buf[pos] = ',';
+    int n = hs_trace_events(&record, buf + pos + sep, end - pos - sep);
+    if (n == 0) break;
+    pos += n + sep;
+  }
+  memcpy(buf + pos, close, sizeof(close));
+  return pos + sizeof(close) - 1;
+}
+
+#endif
+
+void http_server_stats(http_server_t* server, struct http_server_stats_s* stats) {
+  stats->connections = server->connections;
+  stats->inflight = server->inflight;
+  stats->memused = server->memused;
+  stats->idle = server->idle_count;
+  stats->evictions = server->evictions;
+#ifdef HTTP_WATCHDOG
+  stats->stalls = server->stalls;
+  stats->max_stall_us = server->max_stall_us;
+#else
+  stats->stalls = 0;
+  stats->max_stall_us = 0;
+#endif
+}
+
+// *** watchdog ***
+
+#ifdef HTTP_WATCHDOG
+
+// The server whose event loop runs on this thread.
+static __thread http_server_t* hs_loop_server;
+
+// Samples the stack of the loop thread. backtrace has been called once
+// before so it doesn't need to load anything here.
+void hs_watchdog_signal(int sig) {
+  (void)sig;
+  http_server_t* server = hs_loop_server;
+  if (server == NULL || server->dispatch_start == 0) return;
+  int saved = errno;
+  server->stall_depth = backtrace(server->stall_stack, HTTP_WATCHDOG_STACK_DEPTH);
+  server->stall_seq = server->dispatch_seq;
+  errno = saved;
+}
+
+// Checks on the loop a few times per threshold and interrupts it once per
+// callback that has been running for longer.
+void* hs_watchdog_run(void* arg) {
+  http_server_t* server = (http_server_t*)arg;
+  uint64_t threshold = server->options.stall_threshold * 1000000ull;
+  struct timespec tick;
+  tick.tv_sec = threshold / 4 / 1000000000;
+  tick.tv_nsec = threshold / 4 % 1000000000;
+  unsigned sampled = 0;
+  while (1) {
+    nanosleep(&tick, NULL);
+    unsigned seq = __atomic_load_n(&server->dispatch_seq, __ATOMIC_ACQUIRE);
+    uint64_t start = __atomic_load_n(&server->dispatch_start, __ATOMIC_ACQUIRE);
+    // The start may belong to a newer callback than seq, check again.
+    if (
+      start == 0 ||
+      seq == sampled ||
+      seq != __atomic_load_n(&server->dispatch_seq, __ATOMIC_ACQUIRE) ||
+      hs_now_ns() - start < threshold
+    ) {
+      continue;
+    }
+    sampled = seq;
+    pthread_kill(server->loop_thread, HTTP_WATCHDOG_SIGNAL);
+  }
+  return NULL;
+}
+
+// Called on the loop thread when it starts listening.
+void hs_watchdog_start(http_server_t* server) {
+  hs_loop_server = server;
+  server->loop_thread = pthread_self();
+  if (server->options.stall_threshold <= 0 || !server->options.stall_stacks) return;
+  void* frame;
+  backtrace(&frame, 1);
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = hs_watchdog_signal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(HTTP_WATCHDOG_SIGNAL, &sa, NULL);
+  pthread_create(&server->watchdog, NULL, hs_watchdog_run, server);
+}
+
+void hs_watchdog_begin(http_server_t* server) {
+  if (server->options.stall_threshold <= 0) return;
+  server->stall_route[0] = '\0';
+  __atomic_store_n(&server->dispatch_start, hs_now_ns(), __ATOMIC_RELEASE);
+  __atomic_store_n(&server->dispatch_seq, server->dispatch_seq + 1, __ATOMIC_RELEASE);
+}
+
+void hs_watchdog_report(http_server_t* server, struct http_stall_s const * stall) {
+  (void)server;
+  fprintf(
+    stderr, "httpserver: event loop stalled for %ld ms in %s\n",
+    stall->us / 1000, stall->route[0] ? stall->route : "a callback without a request"
+  );
+  backtrace_symbols_fd(stall->stack, stall->depth, STDERR_FILENO);
+}
+
+void hs_watchdog_end(http_server_t* server) {
+  if (server->options.stall_threshold <= 0) return;
+  uint64_t start = server->dispatch_start;
+  __atomic_store_n(&server->dispatch_start, 0, __ATOMIC_RELEASE);
+  long us = (long)((hs_now_ns() - start) / 1000);
+  if (us < server->options.stall_threshold * 1000l) return;
+  server->stalls++;
+  if (us > server->max_stall_us) server->max_stall_us = us;
+  struct http_stall_s stall;
+  stall.us = us;
+  stall.route = server->stall_route;
+  stall.stack = server->stall_stack;
+  stall.depth = server->stall_seq == server->dispatch_seq ? server->stall_depth : 0;
+  if (server->stall_cb) {
+    server->stall_cb(server, &stall);
+  } else {
+    hs_watchdog_report(server, &stall);
+  }
+}
+
+// The request handler is about to be called for the request.
+void hs_watchdog_route(http_request_t* request) {
+  http_server_t* server = request->server;
+  if (server->options.stall_threshold <= 0) return;
+  hs_request_label(request, request->route);
+  memcpy(server->stall_route, request->route, HS_LABEL_SIZE);
+}
+
+// The connection's session is about to be run.
+void hs_watchdog_session(http_request_t* request) {
+  http_server_t* server = request->server;
+  if (server->options.stall_threshold <= 0) return;
+  memcpy(server->stall_route, request->route, HS_LABEL_SIZE);
+}
+
+void http_server_on_stall(
+  http_server_t* server,
+  void (*stall_cb)(http_server_t* server, struct http_stall_s const * stall)
+) {
+  server->stall_cb = stall_cb;
+}
+
+#endif
+
+// *** tls ***
+
+#ifdef HTTP_TLS
+
+// Picks h2 when HTTP/2 is enabled and the client offers it, http/1.1
+// otherwise. The server's preference wins over the order the client sent.
+int hs_tls_alpn_cb(
+  SSL* ssl,
+  unsigned char const ** out,
+  unsigned char* outlen,
+  unsigned char const * in,
+  unsigned int inlen,
+  void* arg
+) {
+  (void)ssl;
+  static unsigned char const protos[] = "\x02h2\x08http/1.1";
+  http_server_t* serv = (http_server_t*)arg;
+  unsigned char const * ours = serv->options.http2 ? protos : protos + 3;
+  unsigned int len = serv->options.http2 ? 12 : 9;
+  if (SSL_select_next_proto(
+    (unsigned char**)out, outlen, ours, len, in, inlen
+  ) != OPENSSL_NPN_NEGOTIATED) {
+    return SSL_TLSEXT_ERR_NOACK;
+  }
+  return SSL_TLSEXT_ERR_OK;
+}
+
+void hs_tls_init(http_server_t* serv) {
+  struct http_server_options_s* opts = &serv->options;
+  serv->tls = NULL;
+  if (!opts->tls_cert || !opts->tls_key) return;
+  SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+  if (
+    !ctx ||
+    !SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION) ||
+    SSL_CTX_use_certificate_chain_file(ctx, opts->tls_cert) != 1 ||
+    SSL_CTX_use_PrivateKey_file(ctx, opts->tls_key, SSL_FILETYPE_PEM) != 1 ||
+    SSL_CTX_check_private_key(ctx) != 1
+  ) {
+    ERR_print_errors_fp(stderr);
+    exit(1);
+  }
+  long options = SSL_OP_NO_RENEGOTIATION;
+#ifdef SSL_OP_ENABLE_KTLS
+  options |= SSL_OP_ENABLE_KTLS;
+#endif
+  SSL_CTX_set_options(ctx, options);
+  // Writes resume from wherever the session got to, like they do on plain
+  // sockets, and idle connections give their record buffers back.
+  SSL_CTX_set_mode(
+    ctx,
+    SSL_MODE_ENABLE_PARTIAL_WRITE |
+    SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+    SSL_MODE_RELEASE_BUFFERS
+  );
+  SSL_CTX_set_alpn_select_cb(ctx, hs_tls_alpn_cb, serv);
+  if (opts->tls_early_data > 0) {
+    // Announced in the session tickets and accepted on resumption. The
+    // anti-replay check that makes tickets single use is on by default.
+    SSL_CTX_set_max_early_data(ctx, opts->tls_early_data);
+    SSL_CTX_set_recv_max_early_data(ctx, opts->tls_early_data);
+  }
+  serv->tls = ctx;
+}
+
+void hs_tls_new_session(http_request_t* session) {
+  session->tls = SSL_new(session->server->tls);
+  assert(session->tls != NULL);
+  SSL_set_fd(session->tls, session->socket);
+  SSL_set_accept_state(session->tls);
+  session->state = HTTP_SESSION_HANDSHAKE;
+  session->tls_early = session->server->options.tls_early_data > 0;
+}
+
+// Maps a failed SSL_read, SSL_write or handshake step to 0 if it only has to
+// wait for the socket and -1 if the connection is lost.
+int hs_tls_error(http_request_t* session, int rc) {
+  switch (SSL_get_error(session->tls, rc)) {
+    case SSL_ERROR_WANT_WRITE:
+      hs_add_write_event(session);
+      // fallthrough
+    case SSL_ERROR_WANT_READ:
+      return 0;
+    case SSL_ERROR_ZERO_RETURN:
+      // The client closed cleanly, answer its close_notify on the way out.
+      return -1;
+  }
+  // Don't send close_notify on a connection OpenSSL has given up on.
+  SSL_set_quiet_shutdown(session->tls, 1);
+  ERR_clear_error();
+  return -1;
+}
+
+void hs_tls_handshake_done(http_request_t* session) {
+#ifdef BIO_get_ktls_send
+  // OpenSSL has moved the keys into the kernel if it could. From here on
+  // responses are plain writes to the socket.
+  session->ktls_send = BIO_get_ktls_send(SSL_get_wbio(session->tls));
+#else
+  (void)session;
+#endif
+}
+
+// Advances the handshake. Returns 1 once it is done, 0 while it waits for the
+// socket and -1 if it failed. With early data the session goes on to read
+// the request right away, the handshake is finished by the reads.
+int hs_tls_handshake(http_request_t* session) {
+  if (session->tls_early) return 1;
+  int rc = SSL_do_handshake(session->tls);
+  if (rc != 1) return hs_tls_error(session, rc);
+  hs_tls_handshake_done(session);
+  return 1;
+}
+
+// Same as read(2), so -1 if nothing is waiting. Reads go through OpenSSL even
+// with kTLS so it can deal with alerts and other records that aren't data.
+int hs_tls_read(http_request_t* session, char* dst, int len) {
+  while (session->tls_early) {
+    size_t n = 0;
+    int rc = SSL_read_early_data(session->tls, dst, len, &n);
+    if (rc == SSL_READ_EARLY_DATA_ERROR) return hs_tls_error(session, 0) == 0 ? -1 : 0;
+    // Without early data this is as soon as the ClientHello has been read.
+    if (rc == SSL_READ_EARLY_DATA_FINISH) session->tls_early = 0;
+    if (n > 0) {
+      session->early_data = 1;
+      return (int)n;
+    }
+  }
+  int finished = SSL_is_init_finished(session->tls);
+  int rc = SSL_read(session->tls, dst, len);
+  if (!finished && SSL_is_init_finished(session->tls)) hs_tls_handshake_done(session);
+  if (rc > 0) {
+    session->early_data = 0;
+    return rc;
+  }
+  return hs_tls_error(session, rc) == 0 ? -1 : 0;
+}
+
+int hs_tls_write(http_request_t* session) {
+  if (session->written == session->bytes) return 1;
+  if (session->tls_early) {
+    // Answers a request that came in early data before the client has
+    // finished the handshake.
+    size_t n = 0;
+    char const * buf = session->buf + session->written;
+    if (SSL_write_early_data(session->tls, buf, hs_write_len(session), &n) == 1) {
+      session->written += n;
+      return 1;
+    }
+    return hs_tls_error(session, 0) == 0;
+  }
+  int rc = SSL_write(session->tls, session->buf + session->written, hs_write_len(session));
+  if (rc > 0) {
+    session->written += rc;
+    return 1;
+  }
+  return hs_tls_error(session, rc) == 0;
+}
+
+void hs_tls_close(http_request_t* session) {
+  if (SSL_is_init_finished(session->tls)) SSL_shutdown(session->tls);
+  SSL_free(session->tls);
+  session->tls = NULL;
+}
+
+#endif
+
+// *** http/2 ***
+
+// Connections that open with the HTTP/2 connection preface, or upgrade with
+// Upgrade: h2c, are switched to frames. The connection session only
+// multiplexes from then on. Every stream gets a request of its own whose head
+// is rebuilt in HTTP/1 form from the decoded header block so the request API
+// works unchanged. Responses are encoded as HEADERS and DATA frames and
+// written through the session buffer.
+
+// RFC 7541 appendix A. Index 0 is unused.
+static char const * const hs_hpack_static[HS_HPACK_STATIC_COUNT][2] = {
+  { "", "" }, { ":authority", "" }, { ":method", "GET" }, { ":method", "POST" },
+  { ":path", "/" }, { ":path", "/index.html" }, { ":scheme", "http" },
+  { ":scheme", "https" }, { ":status", "200" }, { ":status", "204" },
+  { ":status", "206" }, { ":status", "304" }, { ":status", "400" },
+  { ":status", "404" }, { ":status", "500" }, { "accept-charset", "" },
+  { "accept-encoding", "gzip, deflate" }, { "accept-language", "" },
+  { "accept-ranges", "" }, { "accept", "" },
+  { "access-control-allow-origin", "" }, { "age", "" }, { "allow", "" },
+  { "authorization", "" }, { "cache-control", "" },
+  { "content-disposition", "" }, { "content-encoding", "" },
+  { "content-language", "" }, { "content-length", "" },
+  { "content-location", "" }, { "content-range", "" }, { "content-type", "" },
+  { "cookie", "" }, { "date", "" }, { "etag", "" }, { "expect", "" },
+  { "expires", "" }, { "from", "" }, { "host", "" }, { "if-match", "" },
+  { "if-modified-since", "" }, { "if-none-match", "" }, { "if-range", "" },
+  { "if-unmodified-since", "" }, { "last-modified", "" }, { "link", "" },
+  { "location", "" }, { "max-forwards", "" }, { "proxy-authenticate", "" },
+  { "proxy-authorization", "" }, { "range", "" }, { "referer", "" },
+  { "refresh", "" }, { "retry-after", "" }, { "server", "" },
+  { "set-cookie", "" }, { "strict-transport-security", "" },
+  { "transfer-encoding", "" }, { "user-agent", "" }, { "vary", "" },
+  { "via", "" }, { "www-authenticate", "" }
+};
+
+// The HPACK Huffman code is canonical so it is described by the symbols in
+// code order and the number of codes of each bit length (RFC 7541 appendix B).
+// Symbol 256 is EOS.
+static unsigned short const hs_huff_symbols[257] = {
+  48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37,
+  45, 46, 47, 51, 52, 53, 54, 55, 56, 57, 61, 65,
+  95, 98, 100, 102, 103, 104, 108, 109, 110, 112, 114, 117,
+  58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+  77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89,
+  106, 107, 113, 118, 119, 120, 121, 122, 38, 42, 44, 59,
+  88, 90, 33, 34, 40, 41, 63, 39, 43, 124, 35, 62,
+  0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+  195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161,
+  167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129,
+  132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170,
+  173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+  233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150,
+  151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182,
+  183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148, 159,
+  171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+  200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243,
+  255, 203, 204, 211, 212, 214, 221, 222, 223, 241, 244, 245,
+  246, 247, 248, 250, 251, 252, 253, 254, 2, 3, 4, 5,
+  6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+  21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220,
+  249, 10, 13, 22, 256
+};
+
+static unsigned char const hs_huff_counts[31] = {
+  0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+  0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4
+};
+
+// Decodes a Huffman coded string into dst, which needs room for len * 8 / 5
+// bytes. Returns the decoded length or -1 if the string is invalid.
+int hs_huff_decode(unsigned char const * src, int len, char* dst) {
+  int out = 0;
+  long pos = 0;
+  long end = (long)len * 8;
+  while (1) {
+    // Canonical decoding one bit at a time. code - first is the rank of the
+    // code among the codes of the current length.
+    int code = 0, first = 0, index = 0, ones = 1, bits = 0;
+    for (bits = 1; bits < 31; bits++) {
+      if (pos == end) {
+        // Only a prefix of EOS, i.e. up to 7 one bits, may pad the string.
+        return bits - 1 < 8 && ones ? out : -1;
+      }
+      int bit = (src[pos >> 3] >> (7 - (pos & 7))) & 1;
+      pos++;
+      ones &= bit;
+      code |= bit;
+      int count = hs_huff_counts[bits];
+      if (code - count < first) break;
+      index += count;
+      first += count;
+      first <<= 1;
+      code <<= 1;
+    }
+    if (bits == 31) return -1;
+    int sym = hs_huff_symbols[index + code - first];
+    if (sym == 256) return -1;
+    dst[out++] = (char)sym;
+  }
+}
+
+// Reads an integer with an n bit prefix. Returns -1 if it is truncated or too
+// large.
+int hs_hpack_get_int(unsigned char const ** p, unsigned char const * end, int n) {
+  int max = (1 << n) - 1;
+  int value = **p & max;
+  (*p)++;
+  if (value < max) return value;
+  for (int shift = 0; shift <= 21; shift += 7) {
+    if (*p == end) return -1;
+    int b = **p;
+    (*p)++;
+    value += (b & 127) << shift;
+    if (!(b & 128)) return value;
+  }
+  return -1;
+}
+
+// Reads a string literal. Huffman coded strings are decoded to *scratch which
+// is advanced past them.
+int hs_hpack_get_string(
+  unsigned char const ** p,
+  unsigned char const * end,
+  char** scratch,
+  char const ** str,
+  int* len
+) {
+  if (*p == end) return 0;
+  int huffman = **p & 0x80;
+  int n = hs_hpack_get_int(p, end, 7);
+  if (n < 0 || n > end - *p) return 0;
+  if (huffman) {
+    int decoded = hs_huff_decode(*p, n, *scratch);
+    if (decoded < 0) return 0;
+    *str = *scratch;
+    *len = decoded;
+    *scratch += decoded;
+  } else {
+    *str = (char const *)*p;
+    *len = n;
+  }
+  *p += n;
+  return 1;
+}
+
+hs_hpack_entry_t* hs_hpack_at(hs_hpack_table_t* table, int i) {
+  return table->entries[(table->head + i) % HS_HPACK_MAX_ENTRIES];
+}
+
+int hs_hpack_lookup(
+  hs_hpack_table_t* table,
+  int index,
+  char const ** name,
+  int* name_len,
+  char const ** value,
+  int* value_len
+) {
+  if (index <= 0) return 0;
+  if (index < HS_HPACK_STATIC_COUNT) {
+    *name = hs_hpack_static[index][0];
+    *name_len = strlen(*name);
+    *value = hs_hpack_static[index][1];
+    *value_len = strlen(*value);
+    return 1;
+  }
+  index -= HS_HPACK_STATIC_COUNT;
+  if (index >= table->count) return 0;
+  hs_hpack_entry_t* entry = hs_hpack_at(table, index);
+  *name = (char const *)(entry + 1);
+  *name_len = entry->name_len;
+  *value = *name + entry->name_len;
+  *value_len = entry->value_len;
+  return 1;
+}
+
+void hs_hpack_evict(hs_hpack_table_t* table, int size) {
+  while (table->count && table->size > size) {
+    table->count--;
+    hs_hpack_entry_t* entry = hs_hpack_at(table, table->count);
+    table->size -= entry->name_len + entry->value_len + 32;
+    free(entry);
+  }
+}
+
+// The name and value may point into an entry that is evicted to make room so
+// they are copied first.
+void hs_hpack_add(
+  hs_hpack_table_t* table,
+  char const * name,
+  int name_len,
+  char const * value,
+  int value_len
+) {
+  int size = name_len + value_len + 32;
+  if (size > table->max_size) return hs_hpack_evict(table, 0);
+  hs_hpack_entry_t* entry = (hs_hpack_entry_t*)malloc(
+    sizeof(hs_hpack_entry_t) + name_len + value_len
+  );
+  assert(entry != NULL);
+  entry->name_len = name_len;
+  entry->value_len = value_len;
+  memcpy((char*)(entry + 1), name, name_len);
+  memcpy((char*)(entry + 1) + name_len, value, value_len);
+  hs_hpack_evict(table, table->max_size - size);
+  table->head = (table->head + HS_HPACK_MAX_ENTRIES - 1) % HS_HPACK_MAX_ENTRIES;
+  table->entries[table->head] = entry;
+  table->count++;
+  table->size += size;
+}
+
+// Request head rebuilt from a header block.
+typedef struct {
+  grwprintf_t headers;
+  grwprintf_t pseudo;
+  grwprintf_t cookie;
+  // :method, :path, :scheme and :authority in the pseudo buffer. A length of
+  // -1 means the pseudo header was not sent.
+  int at[4];
+  int len[4];
+  int count;
+  int regular;
+  int host;
+  int malformed;
+} hs_h2_head_t;
+
+int hs_h2_pseudo_id(char const * name, int len) {
+  if (len == 7 && memcmp(name, ":method", 7) == 0) return 0;
+  if (len == 5 && memcmp(name, ":path", 5) == 0) return 1;
+  if (len == 7 && memcmp(name, ":scheme", 7) == 0) return 2;
+  if (len == 10 && memcmp(name, ":authority", 10) == 0) return 3;
+  return -1;
+}
+
+// Headers that only have a meaning for a single HTTP/1 connection.
+int hs_h2_connection_header(char const * name, int len) {
+  switch (len) {
+    case 7: return hs_case_insensitive_cmp(name, "upgrade", 7);
+    case 10:
+      return hs_case_insensitive_cmp(name, "connection", 10) ||
+        hs_case_insensitive_cmp(name, "keep-alive", 10);
+    case 16: return hs_case_insensitive_cmp(name, "proxy-connection", 16);
+    case 17: return hs_case_insensitive_cmp(name, "transfer-encoding", 17);
+  }
+  return 0;
+}
+
+void hs_h2_field(
+  hs_h2_head_t* head,
+  char const * name,
+  int name_len,
+  char const * value,
+  int value_len
+) {
+  if (head->malformed) return;
+  // The head is parsed again as HTTP/1 so nothing may break out of a line.
+  for (int i = 0; i < value_len; i++) {
+    if (value[i] == '\r' || value[i] == '\n' || value[i] == '\0') {
+      head->malformed = 1;
+      return;
+    }
+  }
+  if (name_len > 0 && name[0] == ':') {
+    int id = hs_h2_pseudo_id(name, name_len);
+    if (id < 0 || head->regular || head->len[id] >= 0) {
+      head->malformed = 1;
+      return;
+    }
+    head->at[id] = head->pseudo.size;
+    head->len[id] = value_len;
+    grwmemcpy(&head->pseudo, value, value_len);
+    return;
+  }
+  head->regular = 1;
+  for (int i = 0; i < name_len; i++) {
+    char c = name[i];
+    if (c <= ' ' || c >= 0x7f || c == ':' || (c >= 'A' && c <= 'Z')) {
+      head->malformed = 1;
+      return;
+    }
+  }
+  if (
+    name_len == 0 ||
+    hs_h2_connection_header(name, name_len) ||
+    ++head->count > HTTP_MAX_HEADER_COUNT
+  ) {
+    head->malformed = 1;
+    return;
+  }
+  if (name_len == 6 && memcmp(name, "cookie", 6) == 0) {
+    // Cookies may be split into one field each. They are joined again.
+    if (head->cookie.size) grwmemcpy(&head->cookie, "; ", 2);
+    grwmemcpy(&head->cookie, value, value_len);
+    return;
+  }
+  if (name_len == 4 && memcmp(name, "host", 4) == 0) head->host = 1;
+  grwmemcpy(&head->headers, name, name_len);
+  grwmemcpy(&head->headers, ": ", 2);
+  grwmemcpy(&head->headers, value, value_len);
+  grwmemcpy(&head->headers, "\r\n", 2);
+}
+
+// Decodes the header block collected in the connection. The fields are added
+// to head unless it is NULL, in which case the block is only decoded to keep
+// the dynamic table in sync. Returns 0 on a compression error.
+int hs_hpack_decode(hs_h2_conn_t* conn, hs_h2_head_t* head) {
+  unsigned char const * p = (unsigned char const *)conn->block;
+  unsigned char const * end = p + conn->block_len;
+  // Huffman coding takes at least 5 bits per character.
+  char* scratch = (char*)malloc(conn->block_len * 2 + 1);
+  assert(scratch != NULL);
+  int ok = 1;
+  while (ok && p < end) {
+    char const * name = NULL;
+    char const * value = NULL;
+    int name_len = 0, value_len = 0;
+    char* out = scratch;
+    int b = *p;
+    if (b & 0x80) {
+      // Indexed field.
+      int index = hs_hpack_get_int(&p, end, 7);
+      ok = hs_hpack_lookup(&conn->hpack, index, &name, &name_len, &value, &value_len);
+      if (ok && head) hs_h2_field(head, name, name_len, value, value_len);
+      continue;
+    } else if ((b & 0xe0) == 0x20) {
+      // Dynamic table size update.
+      int size = hs_hpack_get_int(&p, end, 5);
+      ok = size >= 0 && size <= HTTP_H2_HEADER_TABLE_SIZE;
+      if (ok) {
+        conn->hpack.max_size = size;
+        hs_hpack_evict(&conn->hpack, size);
+      }
+      continue;
+    }
+    // Literal field, added to the dynamic table or not.
+    int add = (b & 0xc0) == 0x40;
+    int index = hs_hpack_get_int(&p, end, add ? 6 : 4);
+    if (index != 0) {
+      char const * unused;
+      int unused_len;
+      ok = hs_hpack_lookup(&conn->hpack, index, &name, &name_len, &unused, &unused_len);
+    } else {
+      ok = hs_hpack_get_string(&p, end, &out, &name, &name_len);
+    }
+    ok = ok && hs_hpack_get_string(&p, end, &out, &value, &value_len);
+    if (!ok) break;
+    if (head) hs_h2_field(head, name, name_len, value, value_len);
+    if (add) hs_hpack_add(&conn->hpack, name, name_len, value, value_len);
+  }
+  free(scratch);
+  return ok;
+}
+
+void hs_hpack_byte(grwprintf_t* block, int c) {
+  char b = (char)c;
+  grwmemcpy(block, &b, 1);
+}
+
+void hs_hpack_int(grwprintf_t* block, int first, int n, int value) {
+  int max = (1 << n) - 1;
+  if (value < max) return hs_hpack_byte(block, first | value);
+  hs_hpack_byte(block, first | max);
+  for (value -= max; value >= 128; value >>= 7) {
+    hs_hpack_byte(block, (value & 127) | 128);
+  }
+  hs_hpack_byte(block, value);
+}
+
+// Adds a literal field without indexing. The name is taken from the static
+// table if index is set. Nothing is Huffman coded, the responses are small
+// and it keeps encoding a plain copy.
+void hs_hpack_literal(
+  grwprintf_t* block,
+  int index,
+  char const * name,
+  int name_len,
+  char const * value,
+  int value_len
+) {
+  if (index) {
+    hs_hpack_int(block, 0x00, 4, index);
+  } else {
+    hs_hpack_byte(block, 0x00);
+    hs_hpack_int(block, 0x00, 7, name_len);
+    for (int i = 0; i < name_len; i++) {
+      char c = name[i];
+      hs_hpack_byte(block, c >= 'A' && c <= 'Z' ? c + 32 : c);
+    }
+  }
+  hs_hpack_int(block, 0x00, 7, value_len);
+  grwmemcpy(block, value, value_len);
+}
+
+int hs_hpack_static_name(char const * name, int len) {
+  for (int i = HS_HPACK_FIRST_HEADER; i < HS_HPACK_STATIC_COUNT; i++) {
+    char const * entry = hs_hpack_static[i][0];
+    if ((int)strlen(entry) == len && hs_case_insensitive_cmp(name, entry, len)) {
+      return i;
+    }
+  }
+  return 0;
+}
+
+int hs_hpack_status_index(int status) {
+  switch (status) {
+    case 200: return 8;
+    case 204: return 9;
+    case 206: return 10;
+    case 304: return 11;
+    case 400: return 12;
+    case 404: return 13;
+    case 500: return 14;
+  }
+  return 0;
+}
+
+unsigned int hs_h2_get32(char const * p) {
+  unsigned char const * u = (unsigned char const *)p;
+  return (unsigned)u[0] << 24 | u[1] << 16 | u[2] << 8 | u[3];
+}
+
+void hs_h2_put32(char* p, unsigned int value) {
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+
+void hs_h2_grow(http_server_t* server, char** buf, int* capacity, int size) {
+  if (size <= *capacity) return;
+  int grown = *capacity ? *capacity : HTTP_RESPONSE_BUF_SIZE;
+  while (grown < size) grown *= 2;
+  *buf = (char*)realloc(*buf, grown);
+  assert(*buf != NULL);
+  server->memused += grown - *capacity;
+  *capacity = grown;
+}
+
+// Reserves len bytes at the end of the frames waiting to be written.
+char* hs_h2_reserve(http_request_t* session, int len) {
+  hs_h2_conn_t* conn = session->h2;
+  hs_h2_grow(session->server, &conn->out, &conn->out_cap, conn->out_len + len);
+  char* p = conn->out + conn->out_len;
+  conn->out_len += len;
+  return p;
+}
+
+// Queues a frame and returns its payload to be filled in.
+char* hs_h2_frame(http_request_t* session, int type, int flags, int id, int len) {
+  char* p = hs_h2_reserve(session, HS_H2_FRAME_HEADER + len);
+  p[0] = len >> 16;
+  p[1] = len >> 8;
+  p[2] = len;
+  p[3] = type;
+  p[4] = flags;
+  hs_h2_put32(p + 5, id);
+  return p + HS_H2_FRAME_HEADER;
+}
+
+void hs_h2_rst(http_request_t* session, int id, int code) {
+  hs_h2_put32(hs_h2_frame(session, HS_H2_RST_STREAM, 0, id, 4), code);
+}
+
+void hs_h2_window_update(http_request_t* session, int id, int increment) {
+  hs_h2_put32(hs_h2_frame(session, HS_H2_WINDOW_UPDATE, 0, id, 4), increment);
+}
+
+// Connection errors. The connection is closed once the GOAWAY is written.
+// Returns 0 so frame handlers can return it.
+int hs_h2_goaway(http_request_t* session, int code) {
+  hs_h2_conn_t* conn = session->h2;
+  if (HTTP_FLAG_CHECK(conn->flags, HS_H2C_FAILED)) return 0;
+  char* p = hs_h2_frame(session, HS_H2_GOAWAY, 0, 0, 8);
+  hs_h2_put32(p, conn->last_stream_id);
+  hs_h2_put32(p + 4, code);
+  HTTP_FLAG_SET(conn->flags, HS_H2C_FAILED);
+  return 0;
+}
+
+hs_h2_stream_t* hs_h2_find(hs_h2_conn_t* conn, int id) {
+  hs_h2_stream_t* stream = conn->streams;
+  while (stream && stream->id != id) stream = stream->next;
+  return stream;
+}
+
+hs_h2_stream_t* hs_h2_new_stream(http_request_t* session, int id) {
+  hs_h2_conn_t* conn = session->h2;
+  hs_h2_stream_t* stream = (hs_h2_stream_t*)calloc(1, sizeof(hs_h2_stream_t));
+  http_request_t* request = (http_request_t*)calloc(1, sizeof(http_request_t));
+  assert(stream != NULL && request != NULL);
+  request->server = session->server;
+  request->socket = session->socket;
+  request->state = HTTP_SESSION_NOP;
+  request->stream = stream;
+  hs_init_session(request);
+  HS_TRACE(request, HS_TRACE_READ);
+  stream->request = request;
+  stream->session = session;
+  stream->id = id;
+  stream->window = conn->initial_window;
+  stream->next = conn->streams;
+  conn->streams = stream;
+  conn->stream_count++;
+  return stream;
+}
+
+// Takes the stream off the connection. It stays around for the application
+// if it still has to respond.
+void hs_h2_unlink(hs_h2_stream_t* stream) {
+  hs_h2_conn_t* conn = stream->session->h2;
+  hs_h2_stream_t** link = &conn->streams;
+  while (*link != stream) link = &(*link)->next;
+  *link = stream->next;
+  conn->stream_count--;
+  stream->session = NULL;
+}
+
+void hs_h2_free_stream(hs_h2_stream_t* stream) {
+  http_request_t* request = stream->request;
+  if (stream->session) hs_h2_unlink(stream);
+  if (request->subscriber) hs_broadcast_remove(request->subscriber);
+  request->server->memused -= stream->out_cap;
+  free(stream->out);
+  hs_request_done(request);
+  hs_free_buffer(request);
+  free(request);
+  free(stream);
+}
+
+// The stream is closed on the connection. The request is freed now unless
+// the application is yet to respond to it and has no close callback to be
+// told it needn't. Broadcasts respond for their subscribers.
+void hs_h2_close_stream(hs_h2_stream_t* stream) {
+  if (
+    HTTP_FLAG_CHECK(stream->flags, HS_H2S_HANDLED) &&
+    !HTTP_FLAG_CHECK(stream->flags, HS_H2S_ENDED) &&
+    stream->request->close_cb == NULL &&
+    stream->request->subscriber == NULL
+  ) {
+    hs_h2_unlink(stream);
+  } else {
+    hs_notify_close(stream->request);
+    hs_h2_free_stream(stream);
+  }
+}
+
+// Assembles the HTTP/1 style head the request parser understands. Returns 0
+// if the request is malformed.
+int hs_h2_build_head(http_request_t* request, hs_h2_head_t* head) {
+  if (head->malformed || head->len[0] <= 0 || head->len[1] <= 0) return 0;
+  char const * pseudo = head->pseudo.buf;
+  for (int id = 0; id < 2; id++) {
+    if (memchr(pseudo + head->at[id], ' ', head->len[id])) return 0;
+  }
+  grwprintf_t text;
+  int size = head->pseudo.size + head->headers.size + head->cookie.size + 64;
+  grwprintf_init(&text, size, &request->server->memused);
+  grwmemcpy(&text, pseudo + head->at[0], head->len[0]);
+  grwmemcpy(&text, " ", 1);
+  grwmemcpy(&text, pseudo + head->at[1], head->len[1]);
+  grwmemcpy(&text, " HTTP/2.0\r\n", 11);
+  if (head->len[3] > 0 && !head->host) {
+    grwmemcpy(&text, "host: ", 6);
+    grwmemcpy(&text, pseudo + head->at[3], head->len[3]);
+    grwmemcpy(&text, "\r\n", 2);
+  }
+  grwmemcpy(&text, head->headers.buf, head->headers.size);
+  if (head->cookie.size) {
+    grwmemcpy(&text, "cookie: ", 8);
+    grwmemcpy(&text, head->cookie.buf, head->cookie.size);
+    grwmemcpy(&text, "\r\n", 2);
+  }
+  grwmemcpy(&text, "\r\n", 2);
+  request->buf = text.buf;
+  request->capacity = text.capacity;
+  request->bytes = text.size;
+  http_token_dyn_init(&request->tokens, 32);
+  return 1;
+}
+
+int hs_h2_decode_head(http_request_t* session, hs_h2_stream_t* stream) {
+  hs_h2_conn_t* conn = session->h2;
+  hs_h2_head_t head = { };
+  long* memused = &session->server->memused;
+  grwprintf_init(&head.headers, HTTP_REQUEST_BUF_SIZE, memused);
+  grwprintf_init(&head.pseudo, HTTP_RESPONSE_BUF_SIZE, memused);
+  grwprintf_init(&head.cookie, HTTP_RESPONSE_BUF_SIZE, memused);
+  for (int id = 0; id < 4; id++) head.len[id] = -1;
+  int ok = hs_hpack_decode(conn, &head);
+  if (!ok) {
+    hs_h2_goaway(session, HS_H2_COMPRESSION_ERROR);
+  } else if (!hs_h2_build_head(stream->request, &head)) {
+    hs_h2_rst(session, stream->id, HS_H2_PROTOCOL_ERROR);
+    hs_h2_free_stream(stream);
+  } else {
+    stream->header_len = stream->request->bytes;
+  }
+  grwprintf_t* bufs[] = { &head.headers, &head.pseudo, &head.cookie };
+  for (int i = 0; i < 3; i++) {
+    *memused -= bufs[i]->capacity;
+    free(bufs[i]->buf);
+  }
+  return ok;
+}
+
+// Passes the stream's request to the application. It counts as in flight
+// until the stream is freed.
+void hs_h2_handle(hs_h2_stream_t* stream) {
+  http_request_t* request = stream->request;
+  HTTP_FLAG_SET(stream->flags, HS_H2S_HANDLED);
+  HTTP_FLAG_SET(request->flags, HTTP_INFLIGHT);
+  request->server->inflight++;
+  HS_DISPATCH_ROUTE(request);
+  HS_TRACE(request, HS_TRACE_HANDLER);
+  request->server->request_handler(request);
+  HS_TRACE(request, HS_TRACE_HANDLER_EXIT);
+}
+
+// The request is complete. The head is parsed like an HTTP/1 request, with
+// the body being whatever the DATA frames carried, and the handler is called.
+void hs_h2_end_remote(http_request_t* session, hs_h2_stream_t* stream) {
+  http_request_t* request = stream->request;
+  HTTP_FLAG_SET(stream->flags, HS_H2S_END_REMOTE);
+  hs_parse_tokens(request);
+  HS_TRACE(request, HS_TRACE_PARSED);
+  if (request->token.type != HTTP_BODY) {
+    hs_h2_rst(session, stream->id, HS_H2_PROTOCOL_ERROR);
+    return hs_h2_free_stream(stream);
+  }
+  http_token_t body = request->token;
+  body.index = stream->header_len;
+  body.len = request->bytes - stream->header_len;
+  request->token = body;
+  request->slots[HS_SLOT_BODY] = body;
+  request->tokens.buf[request->tokens.size - 1] = body;
+  hs_h2_handle(stream);
+}
+
+int hs_h2_header_block(http_request_t* session) {
+  hs_h2_conn_t* conn = session->h2;
+  int id = conn->block_stream;
+  int flags = conn->block_flags;
+  conn->block_stream = 0;
+  hs_h2_stream_t* stream = hs_h2_find(conn, id);
+  if (stream) {
+    // Trailers. They are decoded for the dynamic table and dropped.
+    if (
+      HTTP_FLAG_CHECK(stream->flags, HS_H2S_END_REMOTE) ||
+      !HTTP_FLAG_CHECK(flags, HS_H2_END_STREAM)
+    ) {
+      return hs_h2_goaway(session, HS_H2_PROTOCOL_ERROR);
+    }
+    if (!hs_hpack_decode(conn, NULL)) {
+      return hs_h2_goaway(session, HS_H2_COMPRESSION_ERROR);
+    }
+    hs_h2_end_remote(session, stream);
+    return 1;
+  }
+  // Refusing a stream is the HTTP/2 way of a 503, the client knows it can
+  // retry.
+  int refused = conn->stream_count >= HTTP_H2_MAX_STREAMS ||
+    HTTP_FLAG_CHECK(conn->flags, HS_H2C_CLOSING) ||
+    hs_overloaded(session->server);
+  if (id <= conn->last_stream_id || refused) {
+    // A stream that was closed already, e.g. reset by us, or one too many.
+    if (!hs_hpack_decode(conn, NULL)) {
+      return hs_h2_goaway(session, HS_H2_COMPRESSION_ERROR);
+    }
+    if (id > conn->last_stream_id) conn->last_stream_id = id;
+    hs_h2_rst(session, id, refused ? HS_H2_REFUSED_STREAM : HS_H2_STREAM_CLOSED);
+    return 1;
+  }
+  conn->last_stream_id = id;
+  stream = hs_h2_new_stream(session, id);
+  if (!hs_h2_decode_head(session, stream)) return 0;
+  stream = hs_h2_find(conn, id);
+  if (stream && HTTP_FLAG_CHECK(flags, HS_H2_END_STREAM)) {
+    hs_h2_end_remote(session, stream);
+  }
+  return 1;
+}
+
+// Strips the padding off DATA and HEADERS frames.
+int hs_h2_unpad(int flags, char const ** p, int* len) {
+  if (!HTTP_FLAG_CHECK(flags, HS_H2_PADDED)) return 1;
+  if (*len < 1) return 0;
+  int pad = (unsigned char)**p;
+  if (pad >= *len) return 0;
+  (*p)++;
+  *len -= 1 + pad;
+  return 1;
+}
+
+int hs_h2_append_block(http_request_t* session, char const * p, int len) {
+  hs_h2_conn_t* conn = session->h2;
+  if (conn->block_len + len > HS_H2_MAX_HEADER_BLOCK) {
+    return hs_h2_goaway(session, HS_H2_ENHANCE_YOUR_CALM);
+  }
+  hs_h2_grow(session->server, &conn->block, &conn->block_cap, conn->block_len + len);
+  // An empty fragment may come before anything is allocated.
+  if (len > 0) memcpy(conn->block + conn->block_len, p, len);
+  conn->block_len += len;
+  if (HTTP_FLAG_CHECK(conn->block_flags, HS_H2_END_HEADERS)) {
+    return hs_h2_header_block(session);
+  }
+  return 1;
+}
+
+int hs_h2_headers(http_request_t* session, int flags, int id, char const * p, int len) {
+  hs_h2_conn_t* conn = session->h2;
+  if (id == 0 || !(id & 1) || !hs_h2_unpad(flags, &p, &len)) {
+    return hs_h2_goaway(session, HS_H2_PROTOCOL_ERROR);
+  }
+  if (HTTP_FLAG_CHECK(flags, HS_H2_PRIORITY_FLAG)) {
+    // Priorities are not used.
+    if (len < 5) return hs_h2_goaway(session, HS_H2_FRAME_SIZE_ERROR);
+    p += 5;
+    len -= 5;
+  }
+  conn->block_stream = id;
+  conn->block_flags = flags;
+  conn->block_len = 0;
+  return hs_h2_append_block(session, p, len);
+}
+
+int hs_h2_data(http_request_t* session, int flags, int id, char const * p, int len) {
+  hs_h2_conn_t* conn = session->h2;
+  // Padding counts against the window too.
+  int size = len;
+  if (id == 0 || !hs_h2_unpad(flags, &p, &len)) {
+    return hs_h2_goaway(session, HS_H2_PROTOCOL_ERROR);
+  }
+  // Request bodies are buffered so the connection window is handed back
+  // straight away.
+  if (size) hs_h2_window_update(session, 0, size);
+  hs_h2_stream_t* stream = hs_h2_find(conn, id);
+  if (stream == NULL || HTTP_FLAG_CHECK(stream->flags, HS_H2S_END_REMOTE)) {
+    if (id > conn->last_stream_id) return hs_h2_goaway(session, HS_H2_PROTOCOL_ERROR);
+    hs_h2_rst(session, id, HS_H2_STREAM_CLOSED);
+    return 1;
+  }
+  http_request_t* request = stream->request;
+  if (request->bytes - stream->header_len + len > HTTP_MAX_CONTENT_LENGTH) {
+    hs_h2_rst(session, id, HS_H2_CANCEL);
+    hs_h2_free_stream(stream);
+    return 1;
+  }
+  hs_h2_grow(session->server, &request->buf, &request->capacity, request->bytes + len);
+  memcpy(request->buf + request->bytes, p, len);
+  request->bytes += len;
+  if (HTTP_FLAG_CHECK(flags, HS_H2_END_STREAM)) {
+    hs_h2_end_remote(session, stream);
+  } else if (size) {
+    hs_h2_window_update(session, id, size);
+  }
+  return 1;
+}
+
+int hs_h2_apply_settings(http_request_t* session, char const * p, int len) {
+  hs_h2_conn_t* conn = session->h2;
+  if (len % 6) return hs_h2_goaway(session, HS_H2_FRAME_SIZE_ERROR);
+  for (int i = 0; i < len; i += 6) {
+    int key = (unsigned char)p[i] << 8 | (unsigned char)p[i + 1];
+    unsigned int value = hs_h2_get32(p + i + 2);
+    if (key == HS_H2_SETTINGS_ENABLE_PUSH && value > 1) {
+      return hs_h2_goaway(session, HS_H2_PROTOCOL_ERROR);
+    } else if (key == HS_H2_SETTINGS_INITIAL_WINDOW_SIZE) {
+      if (value > 0x7fffffff) return hs_h2_goaway(session, HS_H2_FLOW_CONTROL_ERROR);
+      // The change applies to the windows of all open streams.
+      int delta = (int)value - conn->initial_window;
+      for (hs_h2_stream_t* stream = conn->streams; stream; stream = stream->next) {
+        if (delta > 0 && stream->window > 0x7fffffff - delta) {
+          return hs_h2_goaway(session, HS_H2_FLOW_CONTROL_ERROR);
+        }
+        stream->window += delta;
+      }
+      conn->initial_window = value;
+    } else if (key == HS_H2_SETTINGS_MAX_FRAME_SIZE) {
+      // Larger frames are allowed but never sent.
+      if (value < HS_H2_MAX_FRAME || value > 0xffffff) {
+        return hs_h2_goaway(session, HS_H2_PROTOCOL_ERROR);
+      }
+    }
+  }
+  return 1;
+}
+
+int hs_h2_window(http_request_t* session, int id, char const * p, int len) {
+  hs_h2_conn_t* conn = session->h2;
+  if (len != 4) return hs_h2_goaway(session, HS_H2_FRAME_SIZE_ERROR);
+  int increment = hs_h2_get32(p) & 0x7fffffff;
+  if (id == 0) {
+    if (increment == 0) return hs_h2_goaway(session, HS_H2_PROTOCOL_ERROR);
+    if (conn->window > 0x7fffffff - increment) {
+      return hs_h2_goaway(session, HS_H2_FLOW_CONTROL_ERROR);
+    }
+    conn->window += increment;
+    return 1;
+  }
+  hs_h2_stream_t* stream = hs_h2_find(conn, id);
+  if (stream == NULL) return 1;
+  if (increment == 0 || stream->window > 0x7fffffff - increment) {
+    hs_h2_rst(session, id, increment ? HS_H2_FLOW_CONTROL_ERROR : HS_H2_PROTOCOL_ERROR);
+    hs_h2_close_stream(stream);
+    return 1;
+  }
+  stream->window += increment;
+  return 1;
+}
+
+// Handles one frame. Returns 0 once the connection has failed.
+int hs_h2_on_frame(
+  http_request_t* session,
+  int type,
+  int flags,
+  int id,
+  char const * p,
+  int len
+) {
+  hs_h2_conn_t* conn = session->h2;
+  hs_h2_stream_t* stream;
+  if (conn->block_stream && type != HS_H2_CONTINUATION) {
+    return hs_h2_goaway(session, HS_H2_PROTOCOL_ERROR);
+  }
+  switch (type) {
+    case HS_H2_DATA:
+      return hs_h2_data(session, flags, id, p, len);
+    case HS_H2_HEADERS:
+      return hs_h2_headers(session, flags, id, p, len);
+    case HS_H2_PRIORITY:
+      return len == 5 ? 1 : hs_h2_goaway(session, HS_H2_FRAME_SIZE_ERROR);
+    case HS_H2_RST_STREAM:
+      if (id == 0 || len != 4) return hs_h2_goaway(session, HS_H2_PROTOCOL_ERROR);
+      stream = hs_h2_find(conn, id);
+      if (stream) hs_h2_close_stream(stream);
+      return 1;
+    case HS_H2_SETTINGS:
+      if (id != 0) return hs_h2_goaway(session, HS_H2_PROTOCOL_ERROR);
+      if (HTTP_FLAG_CHECK(flags, HS_H2_ACK)) {
+        return len == 0 ? 1 : hs_h2_goaway(session, HS_H2_FRAME_SIZE_ERROR);
+      }
+      if (!hs_h2_apply_settings(session, p, len)) return 0;
+      hs_h2_frame(session, HS_H2_SETTINGS, HS_H2_ACK, 0, 0);
+      return 1;
+    case HS_H2_PUSH_PROMISE:
+      return hs_h2_goaway(session, HS_H2_PROTOCOL_ERROR);
+    case HS_H2_PING:
+      if (id != 0 || len != 8) return hs_h2_goaway(session, HS_H2_FRAME_SIZE_ERROR);
+      if (!HTTP_FLAG_CHECK(flags, HS_H2_ACK)) {
+        memcpy(hs_h2_frame(session, HS_H2_PING, HS_H2_ACK, 0, 8), p, 8);
+      }
+      return 1;
+    case HS_H2_GOAWAY:
+      // Let the open streams finish, the connection is closed after them.
+      HTTP_FLAG_SET(conn->flags, HS_H2C_CLOSING);
+      return 1;
+    case HS_H2_WINDOW_UPDATE:
+      return hs_h2_window(session, id, p, len);
+    case HS_H2_CONTINUATION:
+      if (conn->block_stream == 0 || id != conn->block_stream) {
+        return hs_h2_goaway(session, HS_H2_PROTOCOL_ERROR);
+      }
+      conn->block_flags |= flags & HS_H2_END_HEADERS;
+      return hs_h2_append_block(session, p, len);
+  }
+  // Unknown frame types are ignored.
+  return 1;
+}
+
+// Handles the complete frames in the read buffer and keeps a partial one at
+// its start.
+int hs_h2_frames(http_request_t* session) {
+  hs_h2_conn_t* conn = session->h2;
+  int pos = 0;
+  if (HTTP_FLAG_CHECK(conn->flags, HS_H2C_FAILED)) return 0;
+  if (HTTP_FLAG_CHECK(conn->flags, HS_H2C_PREFACE)) {
+    int n = conn->rlen < HS_H2_PREFACE_LEN ? conn->rlen : HS_H2_PREFACE_LEN;
+    if (memcmp(conn->rbuf, HS_H2_PREFACE, n) != 0) {
+      return hs_h2_goaway(session, HS_H2_PROTOCOL_ERROR);
+    }
+    if (n < HS_H2_PREFACE_LEN) return 1;
+    HTTP_FLAG_CLEAR(conn->flags, HS_H2C_PREFACE);
+    pos = HS_H2_PREFACE_LEN;
+  }
+  while (conn->rlen - pos >= HS_H2_FRAME_HEADER) {
+    unsigned char const * h = (unsigned char const *)conn->rbuf + pos;
+    int len = h[0] << 16 | h[1] << 8 | h[2];
+    if (len > HS_H2_MAX_FRAME) return hs_h2_goaway(session, HS_H2_FRAME_SIZE_ERROR);
+    if (conn->rlen - pos < HS_H2_FRAME_HEADER + len) break;
+    int id = hs_h2_get32((char const *)h + 5) & 0x7fffffff;
+    char const * payload = conn->rbuf + pos + HS_H2_FRAME_HEADER;
+    if (!hs_h2_on_frame(session, h[3], h[4], id, payload, len)) return 0;
+    pos += HS_H2_FRAME_HEADER + len;
+  }
+  memmove(conn->rbuf, conn->rbuf + pos, conn->rlen - pos);
+  conn->rlen -= pos;
+  return 1;
+}
+
+// Moves as much of the bytes read before the switch into the read buffer as
+// fits. Returns the number of bytes moved.
+int hs_h2_take_input(http_request_t* session) {
+  hs_h2_conn_t* conn = session->h2;
+  int bytes = conn->in_len - conn->in_pos;
+  if (bytes > (int)sizeof(conn->rbuf) - conn->rlen) {
+    bytes = sizeof(conn->rbuf) - conn->rlen;
+  }
+  memcpy(conn->rbuf + conn->rlen, conn->in + conn->in_pos, bytes);
+  conn->in_pos += bytes;
+  if (conn->in_pos == conn->in_len) {
+    session->server->memused -= conn->in_len;
+    free(conn->in);
+    conn->in = NULL;
+  }
+  return bytes;
+}
+
+void hs_h2_read(http_request_t* session) {
+  hs_h2_conn_t* conn = session->h2;
+  if (!hs_h2_frames(session)) return;
+  while (1) {
+    int bytes;
+    if (conn->in) {
+      bytes = hs_h2_take_input(session);
+    } else {
+      char* dst = conn->rbuf + conn->rlen;
+      bytes = hs_recv_client_socket(session, dst, sizeof(conn->rbuf) - conn->rlen);
+      if (bytes < 0) return;
+      if (bytes == 0) {
+        HTTP_FLAG_SET(conn->flags, HS_H2C_FAILED);
+        return;
+      }
+      hs_reset_timeout(session, HTTP_KEEP_ALIVE_TIMEOUT);
+      if (conn->skip) {
+        int n = bytes < conn->skip ? bytes : conn->skip;
+        if (dst[0] != '\n') {
+          hs_h2_goaway(session, HS_H2_PROTOCOL_ERROR);
+          return;
+        }
+        memmove(dst, dst + n, bytes - n);
+        conn->skip -= n;
+        bytes -= n;
+      }
+    }
+    conn->rlen += bytes;
+    if (!hs_h2_frames(session)) return;
+  }
+}
+
+// Frames the next piece of a stream's response within the flow control
+// windows. Returns 1 if anything was queued or the application was notified.
+int hs_h2_pump_stream(http_request_t* session, hs_h2_stream_t* stream) {
+  hs_h2_conn_t* conn = session->h2;
+  if (HTTP_FLAG_CHECK(stream->flags, HS_H2S_DONE)) {
+    hs_h2_free_stream(stream);
+    return 0;
+  }
+  int n = stream->out_len - stream->out_sent;
+  if (n > HS_H2_MAX_FRAME) n = HS_H2_MAX_FRAME;
+  if (n > stream->window) n = stream->window;
+  if (n > conn->window) n = conn->window;
+  if (n < 0) n = 0;
+  int last = HTTP_FLAG_CHECK(stream->flags, HS_H2S_ENDED) &&
+    stream->out_sent + n == stream->out_len;
+  if (n > 0 || last) {
+    char* p = hs_h2_frame(
+      session, HS_H2_DATA, last ? HS_H2_END_STREAM : 0, stream->id, n
+    );
+    memcpy(p, stream->out + stream->out_sent, n);
+    stream->out_sent += n;
+    stream->window -= n;
+    conn->window -= n;
+    if (last) {
+      hs_h2_free_stream(stream);
+      return 1;
+    }
+  }
+  if (stream->out_sent == stream->out_len) {
+    stream->out_sent = stream->out_len = 0;
+    if (HTTP_FLAG_CHECK(stream->flags, HS_H2S_NOTIFY)) {
+      // The chunk is framed, ask the application for the next one.
+      HTTP_FLAG_CLEAR(stream->flags, HS_H2S_NOTIFY);
+      stream->request->chunk_cb(stream->request);
+      return 1;
+    }
+  }
+  return n > 0;
+}
+
+// Takes one frame from each stream in turn so a large response doesn't hold
+// up the others, until the windows are used up or enough is queued.
+int hs_h2_pump(http_request_t* session) {
+  hs_h2_conn_t* conn = session->h2;
+  int progress = 0, moved = 1;
+  while (moved && conn->out_len < HS_H2_OUT_HIGH) {
+    moved = 0;
+    hs_h2_stream_t* next;
+    for (hs_h2_stream_t* stream = conn->streams; stream; stream = next) {
+      next = stream->next;
+      moved |= hs_h2_pump_stream(session, stream);
+    }
+    progress |= moved;
+  }
+  return progress;
+}
+
+// The session buffer holds the frames being written. Frames queued meanwhile
+// are collected in the connection and swapped in when the write completes.
+// Returns 0 if the socket failed.
+int hs_h2_flush(http_request_t* session) {
+  hs_h2_conn_t* conn = session->h2;
+  while (1) {
+    if (session->written == session->bytes) {
+      if (conn->out_len == 0) return 1;
+      char* buf = session->buf;
+      int capacity = buf ? session->capacity : 0;
+      session->buf = conn->out;
+      session->capacity = conn->out_cap;
+      session->bytes = conn->out_len;
+      session->written = 0;
+      conn->out = buf;
+      conn->out_cap = capacity;
+      conn->out_len = 0;
+    }
+    if (!hs_write_client_socket(session)) return 0;
+    if (session->written != session->bytes) {
+      hs_add_write_event(session);
+      return 1;
+    }
+  }
+}
+
+// Reads and handles the waiting frames if read is set, then writes out
+// whatever was queued. Closes the connection once it has failed.
+void hs_h2_run(http_request_t* session, int read) {
+  hs_h2_conn_t* conn = session->h2;
+  if (HTTP_FLAG_CHECK(conn->flags, HS_H2C_BUSY)) return;
+  HTTP_FLAG_SET(conn->flags, HS_H2C_BUSY);
+  if (read) hs_h2_read(session);
+  int ok = 1;
+  while (ok) {
+    int moved = !HTTP_FLAG_CHECK(conn->flags, HS_H2C_FAILED) && hs_h2_pump(session);
+    ok = hs_h2_flush(session);
+    if (!moved || session->written != session->bytes) break;
+  }
+  HTTP_FLAG_CLEAR(conn->flags, HS_H2C_BUSY);
+  if (
+    !ok ||
+    HTTP_FLAG_CHECK(conn->flags, HS_H2C_FAILED) ||
+    (HTTP_FLAG_CHECK(conn->flags, HS_H2C_CLOSING) && conn->streams == NULL)
+  ) {
+    hs_end_session(session);
+  }
+}
+
+// Switches the session to HTTP/2. head is written ahead of the server's
+// connection preface.
+void hs_h2_open(http_request_t* session, char const * head) {
+  hs_h2_conn_t* conn = (hs_h2_conn_t*)calloc(1, sizeof(hs_h2_conn_t));
+  assert(conn != NULL);
+  session->server->memused += sizeof(hs_h2_conn_t);
+  conn->window = HS_H2_DEFAULT_WINDOW;
+  conn->initial_window = HS_H2_DEFAULT_WINDOW;
+  conn->hpack.max_size = HTTP_H2_HEADER_TABLE_SIZE;
+  HTTP_FLAG_SET(conn->flags, HS_H2C_PREFACE);
+  session->h2 = conn;
+  session->state = HTTP_SESSION_H2;
+  if (head) memcpy(hs_h2_reserve(session, strlen(head)), head, strlen(head));
+  char* p = hs_h2_frame(session, HS_H2_SETTINGS, 0, 0, 6);
+  p[0] = 0;
+  p[1] = HS_H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+  hs_h2_put32(p + 2, HTTP_H2_MAX_STREAMS);
+  hs_reset_timeout(session, HTTP_KEEP_ALIVE_TIMEOUT);
+}
+
+// Keeps bytes that were read before the switch, e.g. a client's first flight
+// of frames, to be handled as frames. They may hold any number of them.
+void hs_h2_input(http_request_t* session, char const * src, int len) {
+  hs_h2_conn_t* conn = session->h2;
+  if (len < 0) {
+    hs_h2_goaway(session, HS_H2_PROTOCOL_ERROR);
+    return;
+  }
+  if (len == 0) return;
+  conn->in = (char*)malloc(len);
+  assert(conn->in != NULL);
+  memcpy(conn->in, src, len);
+  conn->in_len = len;
+  conn->in_pos = 0;
+  session->server->memused += len;
+}
+
+// Returns 2 if the read buffer starts with the HTTP/2 connection preface, 1 if
+// it holds a prefix of it and more has to be read to tell and 0 otherwise.
+int hs_h2_preface(http_request_t* request) {
+  if (!request->server->options.http2) return 0;
+  int n = request->bytes < HS_H2_PREFACE_LEN ? request->bytes : HS_H2_PREFACE_LEN;
+  if (n == 0 || memcmp(request->buf, HS_H2_PREFACE, n) != 0) return 0;
+  return n == HS_H2_PREFACE_LEN ? 2 : 1;
+}
+
+void hs_h2_prior_knowledge(http_request_t* session) {
+  hs_h2_open(session, NULL);
+  hs_h2_input(session, session->buf, session->bytes);
+  hs_free_buffer(session);
+  session->bytes = 0;
+  session->written = 0;
+  hs_h2_run(session, 1);
+}
+
+// The upgrade is optional so it is only taken for requests without a body,
+// the others are answered over HTTP/1.1.
+int hs_h2_upgrade_requested(http_request_t* request) {
+  if (!request->server->options.http2 || request->token.len != 0) return 0;
+#ifdef HTTP_TLS
+  // h2 over TLS is negotiated with ALPN instead.
+  if (request->tls) return 0;
+#endif
+  http_string_t upgrade = hs_request_known_header(request, HS_H_UPGRADE);
+  return upgrade.len == 3 && hs_case_insensitive_cmp(upgrade.buf, "h2c", 3) &&
+    http_request_header(request, "http2-settings").buf != NULL;
+}
+
+int hs_base64url_decode(char const * src, int len, char* dst) {
+  int n = 0, bits = 0;
+  unsigned int acc = 0;
+  for (int i = 0; i < len && src[i] != '='; i++) {
+    char c = src[i];
+    int v;
+    if (c >= 'A' && c <= 'Z') v = c - 'A';
+    else if (c >= 'a' && c <= 'z') v = c - 'a' + 26;
+    else if (c >= '0' && c <= '9') v = c - '0' + 52;
+    else if (c == '-' || c == '+') v = 62;
+    else if (c == '_' || c == '/') v = 63;
+    else return -1;
+    acc = (acc << 6 | v) & 0x3fff;
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      dst[n++] = acc >> bits;
+    }
+  }
+  return n;
+}
+
+// Answers an Upgrade: h2c request with 101 Switching Protocols. The request
+// becomes stream 1 and is handled as such.
+void hs_h2_upgrade(http_request_t* session) {
+  hs_own_buffer(session);
+  hs_h2_open(session, HS_H2_SWITCHING);
+  hs_h2_conn_t* conn = session->h2;
+  hs_h2_stream_t* stream = hs_h2_new_stream(session, 1);
+  http_request_t* request = stream->request;
+  request->parser = session->parser;
+  request->buf = session->buf;
+  request->bytes = session->bytes;
+  request->capacity = session->capacity;
+  request->token = session->token;
+  request->tokens = session->tokens;
+  request->header_base = session->header_base;
+  memcpy(request->slots, session->slots, sizeof(request->slots));
+  memcpy(request->header_buckets, session->header_buckets, sizeof(request->header_buckets));
+  memcpy(request->header_next, session->header_next, sizeof(request->header_next));
+  memcpy(request->known_headers, session->known_headers, sizeof(request->known_headers));
+#ifdef HTTP_TRACE
+  request->trace = session->trace;
+#endif
+  session->buf = NULL;
+  session->tokens.buf = NULL;
+  session->bytes = 0;
+  session->written = 0;
+  conn->last_stream_id = 1;
+  stream->header_len = request->token.index;
+  HTTP_FLAG_SET(stream->flags, HS_H2S_END_REMOTE);
+  // The settings the client would have sent first. The 101 acknowledges them.
+  http_string_t value = http_request_header(request, "http2-settings");
+  char* settings = (char*)malloc(value.len);
+  assert(settings != NULL);
+  int len = hs_base64url_decode(value.buf, value.len, settings);
+  if (len < 0) {
+    hs_h2_goaway(session, HS_H2_PROTOCOL_ERROR);
+  } else if (hs_h2_apply_settings(session, settings, len)) {
+    // Anything that followed the request, e.g. the client preface. The
+    // headers are complete once their final CR has been read, the LF may
+    // still be on its way.
+    int rest = request->bytes - request->token.index;
+    if (rest < 0) {
+      conn->skip = -rest;
+      rest = 0;
+    }
+    hs_h2_input(session, request->buf + request->token.index, rest);
+  }
+  free(settings);
+  if (!HTTP_FLAG_CHECK(conn->flags, HS_H2C_FAILED)) {
+    HTTP_FLAG_SET(conn->flags, HS_H2C_BUSY);
+    hs_h2_handle(stream);
+    HTTP_FLAG_CLEAR(conn->flags, HS_H2C_BUSY);
+  }
+  hs_h2_run(session, 1);
+}
+
+// Encodes the response headers. There is no dynamic table on this side, the
+// status and header names come from the static table where possible and
+// everything else is a literal.
+void hs_h2_send_headers(
+  http_request_t* session,
+  hs_h2_stream_t* stream,
+  http_response_t* response,
+  int end_stream,
+  int content_length
+) {
+  grwprintf_t block;
+  grwprintf_init(&block, HTTP_RESPONSE_BUF_SIZE, &session->server->memused);
+  int index = hs_hpack_status_index(response->status);
+  if (index) {
+    hs_hpack_byte(&block, 0x80 | index);
+  } else {
+    char status[4];
+    hs_format_int(status, response->status, 10);
+    hs_hpack_literal(&block, HS_HPACK_STATUS, NULL, 0, status, 3);
+  }
+  hs_hpack_literal(&block, HS_HPACK_DATE, NULL, 0, session->server->date, HS_DATE_LEN);
+  for (http_header_t* header = response->headers; header; header = header->next) {
+    int len = header->key_len;
+    if (hs_h2_connection_header(header->key, len)) continue;
+    hs_hpack_literal(
+      &block, hs_hpack_static_name(header->key, len),
+      header->key, len, header->value, header->value_len
+    );
+  }
+  if (content_length >= 0) {
+    char length[16];
+    int len = hs_format_int(length, content_length, 10);
+    hs_hpack_literal(&block, HS_HPACK_CONTENT_LENGTH, NULL, 0, length, len);
+  }
+  // Blocks larger than a frame continue in CONTINUATION frames.
+  char const * p = block.buf;
+  int left = block.size;
+  int type = HS_H2_HEADERS;
+  int flags = end_stream ? HS_H2_END_STREAM : 0;
+  while (1) {
+    int n = left < HS_H2_MAX_FRAME ? left : HS_H2_MAX_FRAME;
+    if (n == left) flags |= HS_H2_END_HEADERS;
+    memcpy(hs_h2_frame(session, type, flags, stream->id, n), p, n);
+    if (n == left) break;
+    p += n;
+    left -= n;
+    type = HS_H2_CONTINUATION;
+    flags = 0;
+  }
+  session->server->memused -= block.capacity;
+  free(block.buf);
+  HTTP_FLAG_SET(stream->flags, HS_H2S_HEADERS_SENT);
+  if (end_stream) HTTP_FLAG_SET(stream->flags, HS_H2S_DONE);
+}
+
+// http_respond and friends on a stream. The headers are framed right away,
+// the body is copied to the stream and framed as the windows allow. cb is
+// called once the chunk has been framed.
+void hs_h2_respond(
+  http_request_t* request,
+  http_response_t* response,
+  void (*cb)(http_request_t*),
+  int end,
+  int content_length
+) {
+  hs_h2_stream_t* stream = request->stream;
+  http_request_t* session = stream->session;
+  if (session == NULL) {
+    // The stream was reset or the connection closed in the meantime.
+    hs_free_response(response);
+    hs_notify_close(request);
+    return hs_h2_free_stream(stream);
+  }
+  int length = hs_body_length(response);
+  if (!HTTP_FLAG_CHECK(stream->flags, HS_H2S_HEADERS_SENT)) {
+    hs_h2_send_headers(session, stream, response, end && length == 0, content_length);
+  }
+  if (length > 0) {
+    int size = stream->out_len + length;
+    hs_h2_grow(session->server, &stream->out, &stream->out_cap, size);
+    hs_copy_body(stream->out + stream->out_len, response);
+    stream->out_len = size;
+  }
+  if (end) {
+    HTTP_FLAG_SET(stream->flags, HS_H2S_ENDED);
+  } else {
+    request->chunk_cb = cb;
+    HTTP_FLAG_SET(stream->flags, HS_H2S_NOTIFY);
+  }
+  hs_free_response(response);
+  hs_h2_run(session, 0);
+}
+
+// Stream bodies are buffered before the handler is called so they are
+// handed out as a single chunk.
+void hs_h2_read_chunk(http_request_t* request, void (*chunk_cb)(http_request_t*)) {
+  hs_h2_stream_t* stream = request->stream;
+  http_token_t token = request->slots[HS_SLOT_BODY];
+  token.type = HTTP_CHUNK_BODY;
+  if (HTTP_FLAG_CHECK(stream->flags, HS_H2S_BODY_READ)) token.len = 0;
+  HTTP_FLAG_SET(stream->flags, HS_H2S_BODY_READ);
+  request->chunk_cb = chunk_cb;
+  request->token = token;
+  chunk_cb(request);
+}
+
+// Called when the connection goes away. Streams the application still has to
+// respond to are kept until it does.
+void hs_h2_close(http_request_t* session) {
+  hs_h2_conn_t* conn = session->h2;
+  while (conn->streams) hs_h2_close_stream(conn->streams);
+  hs_hpack_evict(&conn->hpack, 0);
+  http_server_t* server = session->server;
+  server->memused -= conn->out_cap + conn->block_cap + sizeof(hs_h2_conn_t);
+  if (conn->in) server->memused -= conn->in_len;
+  free(conn->in);
+  free(conn->out);
+  free(conn->block);
+  free(conn);
+  session->h2 = NULL;
+}
+
 // *** kqueue platform specific ***
 
 #ifdef KQUEUE
 
+// Identifier of the user event used to wake the loop for async responses.
+#define HS_ASYNC_IDENT 1
+
+// The timer and user events are registered with the server, the listening
+// sockets with their listener.
 void hs_server_listen_cb(struct kevent* ev) {
-  http_server_t* server = (http_server_t*)ev->udata;
   if (ev->filter == EVFILT_TIMER) {
-    hs_generate_date_time(&server->date);
+    hs_generate_date_time(((http_server_t*)ev->udata)->date);
+  } else if (ev->filter == EVFILT_USER) {
+    hs_drain_async((http_server_t*)ev->udata);
   } else {
-    hs_accept_connections(server);
+    hs_accept_connections((hs_listener_t*)ev->udata);
   }
 }
 
@@ -1523,7 +6066,7 @@ void hs_session_io_cb(struct kevent* ev) {
   http_request_t* request = (http_request_t*)ev->udata;
   if (ev->filter == EVFILT_TIMER) {
     request->timeout -= 1;
-    if (request->timeout == 0) hs_end_session(request);
+    if (request->timeout == 0) hs_timeout_expired(request);
   } else {
     http_session(request);
   }
@@ -1531,28 +6074,49 @@ void hs_session_io_cb(struct kevent* ev) {
 
 void hs_server_init(http_server_t* serv) {
   serv->loop = kqueue();
+  serv->async_head = NULL;
+  struct kevent ev_set[2];
+  EV_SET(&ev_set[0], 1, EVFILT_TIMER, EV_ADD | EV_ENABLE, NOTE_SECONDS, 1, serv);
+  EV_SET(&ev_set[1], HS_ASYNC_IDENT, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, serv);
+  kevent(serv->loop, ev_set, 2, NULL, 0, NULL);
+}
+
+void hs_wake_loop(http_server_t* serv) {
   struct kevent ev_set;
-  EV_SET(&ev_set, 1, EVFILT_TIMER, EV_ADD | EV_ENABLE, NOTE_SECONDS, 1, serv);
+  EV_SET(&ev_set, HS_ASYNC_IDENT, EVFILT_USER, 0, NOTE_TRIGGER, 0, serv);
   kevent(serv->loop, &ev_set, 1, NULL, 0, NULL);
 }
 
 void hs_add_server_sock_events(http_server_t* serv) {
-  struct kevent ev_set;
-  EV_SET(&ev_set, serv->socket, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, serv);
-  kevent(serv->loop, &ev_set, 1, NULL, 0, NULL);
+  struct kevent ev_set[HS_MAX_LISTENERS];
+  // With an accept batch limit the listener must stay level triggered or the
+  // connections left in the queue would never be reported again.
+  int clear = serv->options.accept_batch > 0 ? 0 : EV_CLEAR;
+  for (int i = 0; i < serv->listener_count; i++) {
+    hs_listener_t* listener = &serv->listeners[i];
+    EV_SET(&ev_set[i], listener->socket, EVFILT_READ, EV_ADD | clear, 0, 0, listener);
+  }
+  kevent(serv->loop, ev_set, serv->listener_count, NULL, 0, NULL);
 }
 
 int http_server_listen(http_server_t* serv) {
   http_listen(serv);
 
   struct kevent ev_list[1];
+  struct timespec ts;
+  memset(&ts, 0, sizeof(ts));
 
   while (1) {
-    int nev = kevent(serv->loop, NULL, 0, ev_list, 1, NULL);
+    // Deferred low priority writes go on once nothing else is ready.
+    int nev = kevent(serv->loop, NULL, 0, ev_list, 1, serv->deferred_head ? &ts : NULL);
+    if (nev == 0) hs_run_deferred(serv);
     for (int i = 0; i < nev; i++) {
       ev_cb_t* ev_cb = (ev_cb_t*)ev_list[i].udata;
+      HS_DISPATCH_BEGIN(serv);
       ev_cb->handler(&ev_list[i]);
+      HS_DISPATCH_END(serv);
     }
+    hs_share_deferred(serv, nev);
   }
   return 0;
 }
@@ -1568,9 +6132,13 @@ int http_server_poll(http_server_t* serv) {
   struct timespec ts;
   memset(&ts, 0, sizeof(ts));
   int nev = kevent(serv->loop, NULL, 0, &ev, 1, &ts);
-  if (nev <= 0) return nev;
+  if (nev == 0) return hs_run_deferred(serv);
+  if (nev < 0) return nev;
   ev_cb_t* ev_cb = (ev_cb_t*)ev.udata;
+  HS_DISPATCH_BEGIN(serv);
   ev_cb->handler(&ev);
+  HS_DISPATCH_END(serv);
+  hs_share_deferred(serv, nev);
   return nev;
 }
 
@@ -1587,12 +6155,742 @@ void hs_add_write_event(http_request_t* request) {
   kevent(request->server->loop, ev_set, 2, NULL, 0, NULL);
 }
 
+void hs_set_accept(http_server_t* serv, int flags) {
+  struct kevent ev_set[HS_MAX_LISTENERS];
+  for (int i = 0; i < serv->listener_count; i++) {
+    hs_listener_t* listener = &serv->listeners[i];
+    EV_SET(&ev_set[i], listener->socket, EVFILT_READ, flags, 0, 0, listener);
+  }
+  kevent(serv->loop, ev_set, serv->listener_count, NULL, 0, NULL);
+}
+
+void hs_pause_accept(http_server_t* serv) {
+  hs_set_accept(serv, EV_DISABLE);
+}
+
+void hs_resume_accept(http_server_t* serv) {
+  hs_set_accept(serv, EV_ENABLE);
+}
+
+// The loop handles a single event per kevent call so watches and timers can
+// be freed right away, no other event refers to them.
+
+void hs_watch_cb(struct kevent* ev) {
+  http_watch_t* watch = (http_watch_t*)ev->udata;
+  int events = hs_watch_events(
+    watch,
+    ev->filter == EVFILT_READ,
+    ev->filter == EVFILT_WRITE,
+    ev->flags & (EV_EOF | EV_ERROR)
+  );
+  watch->cb(watch->fd, events, watch->data);
+}
+
+int hs_add_watch(http_watch_t* watch) {
+  watch->handler = hs_watch_cb;
+  struct kevent ev_set[2];
+  int n = 0;
+  if (HTTP_FLAG_CHECK(watch->events, HTTP_READABLE)) {
+    EV_SET(&ev_set[n++], watch->fd, EVFILT_READ, EV_ADD, 0, 0, watch);
+  }
+  if (HTTP_FLAG_CHECK(watch->events, HTTP_WRITABLE)) {
+    EV_SET(&ev_set[n++], watch->fd, EVFILT_WRITE, EV_ADD, 0, 0, watch);
+  }
+  return kevent(watch->server->loop, ev_set, n, NULL, 0, NULL) < 0 ? -1 : 0;
+}
+
+void hs_delete_watch(http_watch_t* watch) {
+  struct kevent ev_set[2];
+  int n = 0;
+  if (HTTP_FLAG_CHECK(watch->events, HTTP_READABLE)) {
+    EV_SET(&ev_set[n++], watch->fd, EVFILT_READ, EV_DELETE, 0, 0, watch);
+  }
+  if (HTTP_FLAG_CHECK(watch->events, HTTP_WRITABLE)) {
+    EV_SET(&ev_set[n++], watch->fd, EVFILT_WRITE, EV_DELETE, 0, 0, watch);
+  }
+  kevent(watch->server->loop, ev_set, n, NULL, 0, NULL);
+  free(watch);
+}
+
+void hs_timer_cb(struct kevent* ev) {
+  // One-shot timers have been deleted by the kernel.
+  hs_fire_timer((http_timer_t*)ev->udata);
+}
+
+// Timers are identified by their address, which can't collide with the fds
+// the sessions use as timer identifiers.
+int hs_add_timer(http_timer_t* timer) {
+  timer->handler = hs_timer_cb;
+  struct kevent ev_set;
+  int flags = EV_ADD | EV_ENABLE | (timer->repeat ? 0 : EV_ONESHOT);
+  EV_SET(&ev_set, (uintptr_t)timer, EVFILT_TIMER, flags, 0, timer->ms, timer);
+  return kevent(timer->server->loop, &ev_set, 1, NULL, 0, NULL) < 0 ? -1 : 0;
+}
+
+void hs_delete_timer(http_timer_t* timer) {
+  struct kevent ev_set;
+  EV_SET(&ev_set, (uintptr_t)timer, EVFILT_TIMER, EV_DELETE, 0, 0, timer);
+  kevent(timer->server->loop, &ev_set, 1, NULL, 0, NULL);
+  free(timer);
+}
+
+#elif defined(IO_URING)
+
+// *** io_uring platform specific ***
+
+// Operations a session can have in flight. The type is stored in the low
+// bits of the user_data pointer which is at least 8 byte aligned.
+#define HS_OP_RECV 1
+#define HS_OP_SEND 2
+#define HS_OP_TIMEOUT 3
+#define HS_OP_MASK 7
+
+// session io_uring flags
+#define HS_UR_RECV 0x1
+#define HS_UR_SEND 0x2
+#define HS_UR_EOF 0x4
+#define HS_UR_CLOSED 0x8
+#define HS_UR_PAUSED 0x10
+
+#define HS_BUF_GROUP 0
+
+#define HS_UR_SESSION(user_data) \
+  ((http_request_t*)(uintptr_t)((user_data) & ~(__u64)HS_OP_MASK))
+
+void hs_uring_enter(hs_uring_t* ring, unsigned min_complete) {
+  __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+  int rc = (int)syscall(
+    __NR_io_uring_enter, ring->fd, ring->to_submit, min_complete,
+    IORING_ENTER_GETEVENTS, NULL, 0
+  );
+  if (rc > 0) ring->to_submit -= rc;
+}
+
+struct io_uring_sqe* hs_uring_get_sqe(hs_uring_t* ring) {
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if (ring->sq_local_tail - head == ring->sq_entries) {
+    // Submission queue is full, hand what we have to the kernel.
+    hs_uring_enter(ring, 0);
+  }
+  struct io_uring_sqe* sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_local_tail++;
+  ring->to_submit++;
+  return sqe;
+}
+
+void hs_uring_recycle(hs_uring_t* ring, int bid) {
+  // The entries start at the beginning of the ring. Not through br->bufs,
+  // C++ gives the empty struct in front of that flexible array a size.
+  struct io_uring_buf* bufs = (struct io_uring_buf*)ring->br;
+  struct io_uring_buf* buf = &bufs[ring->br_tail & (HTTP_URING_BUF_COUNT - 1)];
+  buf->addr = (uintptr_t)(ring->bufs + bid * HTTP_URING_BUF_SIZE);
+  buf->len = HTTP_URING_BUF_SIZE;
+  buf->bid = bid;
+  ring->br_tail++;
+  __atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+}
+
+void hs_uring_init(hs_uring_t* ring) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+  int fd = (int)syscall(__NR_io_uring_setup, HTTP_URING_ENTRIES, &p);
+  if (fd < 0) {
+    // Older kernels don't know the task run flags.
+    memset(&p, 0, sizeof(p));
+    fd = (int)syscall(__NR_io_uring_setup, HTTP_URING_ENTRIES, &p);
+  }
+  assert(fd >= 0);
+  ring->fd = fd;
+
+  size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  int single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap && cq_size > sq_size) sq_size = cq_size;
+  char* sq = (char*)mmap(
+    NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, IORING_OFF_SQ_RING
+  );
+  assert(sq != MAP_FAILED);
+  char* cq = sq;
+  if (!single_mmap) {
+    cq = (char*)mmap(
+      NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, IORING_OFF_CQ_RING
+    );
+    assert(cq != MAP_FAILED);
+  }
+  ring->sqes = (struct io_uring_sqe*)mmap(
+    NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+    PROT_READ | PROT_WRITE, MAP_SHARED, fd, IORING_OFF_SQES
+  );
+  assert(ring->sqes != MAP_FAILED);
+
+  ring->sq_head = (unsigned*)(sq + p.sq_off.head);
+  ring->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+  ring->sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+  ring->sq_entries = *(unsigned*)(sq + p.sq_off.ring_entries);
+  ring->sq_local_tail = *ring->sq_tail;
+  ring->to_submit = 0;
+  // SQEs are always used in ring order so the indirection array is fixed.
+  unsigned* array = (unsigned*)(sq + p.sq_off.array);
+  for (unsigned i = 0; i < ring->sq_entries; i++) array[i] = i;
+
+  ring->cq_head = (unsigned*)(cq + p.cq_off.head);
+  ring->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+  ring->cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+  // Register the provided buffer ring that multishot receives pick from.
+  ring->br = (struct io_uring_buf_ring*)mmap(
+    NULL, HTTP_URING_BUF_COUNT * sizeof(struct io_uring_buf),
+    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+  );
+  assert(ring->br != MAP_FAILED);
+  ring->bufs = (char*)malloc(HTTP_URING_BUF_COUNT * HTTP_URING_BUF_SIZE);
+  assert(ring->bufs != NULL);
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uintptr_t)ring->br;
+  reg.ring_entries = HTTP_URING_BUF_COUNT;
+  reg.bgid = HS_BUF_GROUP;
+  int rc = (int)syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1);
+  assert(rc == 0);
+  (void)rc;
+  ring->br_tail = 0;
+  for (int i = 0; i < HTTP_URING_BUF_COUNT; i++) hs_uring_recycle(ring, i);
+}
+
+// Dispatches completions to their handlers. The completion is copied and the
+// slot released first so handlers are free to queue new submissions.
+int hs_uring_reap(http_server_t* serv, int max) {
+  hs_uring_t* ring = &serv->ring;
+  unsigned head = *ring->cq_head;
+  int n = 0;
+  while (n != max && head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe cqe = ring->cqes[head & ring->cq_mask];
+    head++;
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    n++;
+    // Completions of cancel requests carry no user data.
+    if (cqe.user_data == 0) continue;
+    ev_cb_t* ev_cb = (ev_cb_t*)HS_UR_SESSION(cqe.user_data);
+    HS_DISPATCH_BEGIN(serv);
+    ev_cb->handler(&cqe);
+    HS_DISPATCH_END(serv);
+  }
+  return n;
+}
+
+void hs_uring_arm_recv(http_request_t* session) {
+  struct io_uring_sqe* sqe = hs_uring_get_sqe(&session->server->ring);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = session->socket;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = HS_BUF_GROUP;
+  sqe->user_data = (uintptr_t)session | HS_OP_RECV;
+  HTTP_FLAG_SET(session->uring_flags, HS_UR_RECV);
+  session->inflight++;
+}
+
+void hs_uring_arm_timeout(http_request_t* session, int seconds) {
+  session->ts.tv_sec = seconds;
+  session->ts.tv_nsec = 0;
+  struct io_uring_sqe* sqe = hs_uring_get_sqe(&session->server->ring);
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->addr = (uintptr_t)&session->ts;
+  sqe->len = 1;
+  sqe->user_data = (uintptr_t)session | HS_OP_TIMEOUT;
+  session->inflight++;
+  session->timeout_end = session->server->ticks + seconds;
+}
+
+void hs_uring_update_timeout(http_request_t* session, int seconds) {
+  if (HTTP_FLAG_CHECK(session->uring_flags, HS_UR_CLOSED)) return;
+  // The kernel copies the time when the update is submitted. If the timer
+  // has fired already the update fails and the completion re-arms it.
+  session->ts.tv_sec = seconds;
+  session->ts.tv_nsec = 0;
+  struct io_uring_sqe* sqe = hs_uring_get_sqe(&session->server->ring);
+  sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+  sqe->addr = (uintptr_t)session | HS_OP_TIMEOUT;
+  sqe->addr2 = (uintptr_t)&session->ts;
+  sqe->timeout_flags = IORING_TIMEOUT_UPDATE;
+  session->timeout_end = session->server->ticks + seconds;
+}
+
+void hs_uring_arm_server_timer(http_server_t* serv) {
+  serv->ts.tv_sec = 1;
+  serv->ts.tv_nsec = 0;
+  struct io_uring_sqe* sqe = hs_uring_get_sqe(&serv->ring);
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->addr = (uintptr_t)&serv->ts;
+  sqe->len = 1;
+  sqe->user_data = (uintptr_t)&serv->timer_handler;
+}
+
+// Stops receiving for a session that has too much unread data. The receive
+// completes with -ECANCELED.
+void hs_uring_pause_recv(http_request_t* session) {
+  HTTP_FLAG_SET(session->uring_flags, HS_UR_PAUSED);
+  if (!HTTP_FLAG_CHECK(session->uring_flags, HS_UR_RECV)) return;
+  struct io_uring_sqe* sqe = hs_uring_get_sqe(&session->server->ring);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = (uintptr_t)session | HS_OP_RECV;
+}
+
+void hs_uring_resume_recv(http_request_t* session) {
+  HTTP_FLAG_CLEAR(session->uring_flags, HS_UR_PAUSED);
+  if (
+    !HTTP_FLAG_CHECK(session->uring_flags, HS_UR_RECV) &&
+    !HTTP_FLAG_CHECK(session->uring_flags, HS_UR_EOF) &&
+    !HTTP_FLAG_CHECK(session->uring_flags, HS_UR_CLOSED)
+  ) {
+    hs_uring_arm_recv(session);
+  }
+}
+
+void hs_uring_consume_pending(http_request_t* session, int n) {
+  session->server->memused -= n;
+  session->pending_len -= n;
+  if (session->pending_len == 0) {
+    free(session->pending);
+    session->pending = NULL;
+  } else {
+    memmove(session->pending, session->pending + n, session->pending_len);
+  }
+  if (
+    HTTP_FLAG_CHECK(session->uring_flags, HS_UR_PAUSED) &&
+    session->pending_len < HTTP_URING_MAX_PENDING / 2
+  ) {
+    hs_uring_resume_recv(session);
+  }
+}
+
+int hs_read_client_socket(http_request_t* session) {
+  hs_init_read_buffer(session);
+  if (session->pending) {
+    int n = hs_append_read_buffer(session, session->pending, session->pending_len);
+    hs_uring_consume_pending(session, n);
+  }
+  if (session->rx_len && !session->pending) {
+    int n = hs_append_read_buffer(session, session->rx, session->rx_len);
+    session->rx += n;
+    session->rx_len -= n;
+  }
+  return !HTTP_FLAG_CHECK(session->uring_flags, HS_UR_EOF);
+}
+
+// Copies up to len received bytes to dst. Returns 0 on EOF and -1 if nothing
+// is waiting.
+int hs_recv_client_socket(http_request_t* session, char* dst, int len) {
+  if (session->pending) {
+    if (len > session->pending_len) len = session->pending_len;
+    memcpy(dst, session->pending, len);
+    hs_uring_consume_pending(session, len);
+    return len;
+  } else if (session->rx_len) {
+    if (len > session->rx_len) len = session->rx_len;
+    memcpy(dst, session->rx, len);
+    session->rx += len;
+    session->rx_len -= len;
+    return len;
+  }
+  return HTTP_FLAG_CHECK(session->uring_flags, HS_UR_EOF) ? 0 : -1;
+}
+
+// Queues a send for the unwritten part of the buffer. The bytes are counted
+// as written when the completion arrives.
+int hs_write_client_socket(http_request_t* session) {
+  if (
+    HTTP_FLAG_CHECK(session->uring_flags, HS_UR_SEND) ||
+    session->written == session->bytes
+  ) {
+    return 1;
+  }
+  struct io_uring_sqe* sqe = hs_uring_get_sqe(&session->server->ring);
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = session->socket;
+  sqe->addr = (uintptr_t)(session->buf + session->written);
+  sqe->len = hs_write_len(session);
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = (uintptr_t)session | HS_OP_SEND;
+  HTTP_FLAG_SET(session->uring_flags, HS_UR_SEND);
+  session->inflight++;
+  return 1;
+}
+
+// Runs the session state machine if it is waiting for input that has already
+// arrived.
+void hs_uring_dispatch(http_request_t* session) {
+  if (
+    session->state == HTTP_SESSION_WRITE ||
+    session->state == HTTP_SESSION_NOP ||
+    HTTP_FLAG_CHECK(session->uring_flags, HS_UR_CLOSED)
+  ) {
+    return;
+  }
+  if (
+    session->rx_len ||
+    session->pending ||
+    HTTP_FLAG_CHECK(session->uring_flags, HS_UR_EOF)
+  ) {
+    http_session(session);
+  }
+}
+
+void hs_uring_recv_cb(http_request_t* session, struct io_uring_cqe* cqe) {
+  hs_uring_t* ring = &session->server->ring;
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    HTTP_FLAG_CLEAR(session->uring_flags, HS_UR_RECV);
+  }
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    if (cqe->res > 0 && !HTTP_FLAG_CHECK(session->uring_flags, HS_UR_CLOSED)) {
+      session->rx = ring->bufs + bid * HTTP_URING_BUF_SIZE;
+      session->rx_len = cqe->res;
+      hs_uring_dispatch(session);
+      if (session->rx_len) {
+        // The session isn't reading right now. Keep the bytes so the buffer
+        // can go back to the kernel.
+        int len = session->pending_len + session->rx_len;
+        session->pending = (char*)realloc(session->pending, len);
+        assert(session->pending != NULL);
+        memcpy(session->pending + session->pending_len, session->rx, session->rx_len);
+        session->server->memused += session->rx_len;
+        session->pending_len = len;
+        session->rx_len = 0;
+        if (
+          len >= HTTP_URING_MAX_PENDING &&
+          !HTTP_FLAG_CHECK(session->uring_flags, HS_UR_PAUSED)
+        ) {
+          hs_uring_pause_recv(session);
+        }
+      }
+    }
+    hs_uring_recycle(ring, bid);
+  } else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+    HTTP_FLAG_SET(session->uring_flags, HS_UR_EOF);
+    hs_uring_dispatch(session);
+  }
+  if (
+    !HTTP_FLAG_CHECK(session->uring_flags, HS_UR_RECV) &&
+    !HTTP_FLAG_CHECK(session->uring_flags, HS_UR_EOF) &&
+    !HTTP_FLAG_CHECK(session->uring_flags, HS_UR_CLOSED) &&
+    !HTTP_FLAG_CHECK(session->uring_flags, HS_UR_PAUSED)
+  ) {
+    // The multishot receive terminated, usually because the buffer ring ran
+    // dry. Re-arm it.
+    hs_uring_arm_recv(session);
+  }
+}
+
+void hs_uring_send_cb(http_request_t* session, struct io_uring_cqe* cqe) {
+  HTTP_FLAG_CLEAR(session->uring_flags, HS_UR_SEND);
+  if (HTTP_FLAG_CHECK(session->uring_flags, HS_UR_CLOSED)) return;
+  if (cqe->res < 0) return hs_end_session(session);
+  session->written += cqe->res;
+  http_session(session);
+  hs_uring_dispatch(session);
+}
+
+void hs_uring_timeout_cb(http_request_t* session, struct io_uring_cqe* cqe) {
+  if (
+    cqe->res != -ETIME ||
+    HTTP_FLAG_CHECK(session->uring_flags, HS_UR_CLOSED)
+  ) {
+    return;
+  }
+  int elapsed = session->server->ticks - session->timeout_start;
+  if (elapsed >= session->timeout && HTTP_FLAG_CHECK(session->flags, HTTP_DEFERRED)) {
+    // See hs_timeout_expired.
+    session->timeout = HTTP_REQUEST_TIMEOUT;
+    session->timeout_start = session->server->ticks;
+    elapsed = 0;
+  }
+  if (elapsed >= session->timeout) return hs_end_session(session);
+  hs_uring_arm_timeout(session, session->timeout - elapsed);
+}
+
+void hs_uring_free_session(http_request_t* session) {
+  hs_free_buffer(session);
+  if (session->pending) {
+    session->server->memused -= session->pending_len;
+    free(session->pending);
+  }
+  free(session);
+}
+
+void hs_session_io_cb(struct io_uring_cqe* cqe) {
+  http_request_t* session = HS_UR_SESSION(cqe->user_data);
+  int op = cqe->user_data & HS_OP_MASK;
+  switch (op) {
+    case HS_OP_RECV:
+      hs_uring_recv_cb(session, cqe);
+      break;
+    case HS_OP_SEND:
+      hs_uring_send_cb(session, cqe);
+      break;
+    case HS_OP_TIMEOUT:
+      hs_uring_timeout_cb(session, cqe);
+      break;
+  }
+  if (op != HS_OP_RECV || !(cqe->flags & IORING_CQE_F_MORE)) {
+    session->inflight--;
+  }
+  if (
+    HTTP_FLAG_CHECK(session->uring_flags, HS_UR_CLOSED) &&
+    !HTTP_FLAG_CHECK(session->flags, HTTP_ASYNC) &&
+    session->inflight == 0
+  ) {
+    hs_uring_free_session(session);
+  }
+}
+
+// The session can only be freed once the kernel has completed every
+// operation that references it. hs_delete_events has made sure they will.
+void hs_release_session(http_request_t* session) {
+  if (session->inflight == 0) hs_uring_free_session(session);
+}
+
+void hs_uring_arm_accept(hs_listener_t* listener) {
+  struct io_uring_sqe* sqe = hs_uring_get_sqe(&listener->server->ring);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listener->socket;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe->user_data = (uintptr_t)listener;
+  listener->accept_armed = 1;
+}
+
+void hs_server_listen_cb(struct io_uring_cqe* cqe) {
+  hs_listener_t* listener = (hs_listener_t*)(uintptr_t)cqe->user_data;
+  http_server_t* server = listener->server;
+  if (cqe->res >= 0) {
+    // Nothing is read here, the first receive completion starts the
+    // session. A few connections the kernel accepted before the cancel took
+    // effect may go over max_connections.
+    hs_new_session(server, cqe->res);
+    hs_connection_limit(server);
+  } else {
+    hs_accept_failed(listener, -cqe->res);
+  }
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    listener->accept_armed = 0;
+    if (!server->accept_paused) hs_uring_arm_accept(listener);
+  }
+}
+
+void hs_server_timer_cb(struct io_uring_cqe* cqe) {
+  http_server_t* server =
+    (http_server_t*)((char*)(uintptr_t)cqe->user_data - sizeof(uring_cb_t));
+  server->ticks++;
+  hs_generate_date_time(server->date);
+  hs_uring_arm_server_timer(server);
+}
+
+void hs_uring_arm_async_read(http_server_t* serv) {
+  struct io_uring_sqe* sqe = hs_uring_get_sqe(&serv->ring);
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = serv->async_fd;
+  sqe->addr = (uintptr_t)&serv->async_count;
+  sqe->len = sizeof(serv->async_count);
+  sqe->user_data = (uintptr_t)&serv->async_handler;
+}
+
+void hs_server_async_cb(struct io_uring_cqe* cqe) {
+  http_server_t* server = (http_server_t*)(
+    (char*)(uintptr_t)cqe->user_data - offsetof(http_server_t, async_handler)
+  );
+  // The eventfd has been read by the kernel already so any wakeup from here
+  // on re-triggers the read.
+  hs_drain_async(server);
+  hs_uring_arm_async_read(server);
+}
+
+void hs_server_init(http_server_t* serv) {
+  hs_uring_init(&serv->ring);
+  serv->loop = serv->ring.fd;
+  serv->ticks = 0;
+  serv->timer_handler = hs_server_timer_cb;
+  hs_uring_arm_server_timer(serv);
+  serv->async_head = NULL;
+  serv->async_fd = eventfd(0, EFD_CLOEXEC);
+  serv->async_handler = hs_server_async_cb;
+  hs_uring_arm_async_read(serv);
+}
+
+void hs_add_server_sock_events(http_server_t* serv) {
+  for (int i = 0; i < serv->listener_count; i++) {
+    hs_uring_arm_accept(&serv->listeners[i]);
+  }
+}
+
+// Cancels the multishot accepts. Their final completions don't re-arm them
+// while accepting is paused.
+void hs_pause_accept(http_server_t* serv) {
+  for (int i = 0; i < serv->listener_count; i++) {
+    if (!serv->listeners[i].accept_armed) continue;
+    struct io_uring_sqe* sqe = hs_uring_get_sqe(&serv->ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uintptr_t)&serv->listeners[i];
+  }
+}
+
+void hs_resume_accept(http_server_t* serv) {
+  for (int i = 0; i < serv->listener_count; i++) {
+    // Still armed if the cancel hasn't completed yet.
+    if (!serv->listeners[i].accept_armed) hs_uring_arm_accept(&serv->listeners[i]);
+  }
+}
+
+int http_server_listen(http_server_t* serv) {
+  http_listen(serv);
+  while (1) {
+    // Submitting and waiting is a single syscall per loop iteration. Deferred
+    // low priority writes go on once no completion is ready.
+    hs_uring_enter(&serv->ring, serv->deferred_head ? 0 : 1);
+    int n = hs_uring_reap(serv, -1);
+    if (n == 0) hs_run_deferred(serv);
+    hs_share_deferred(serv, n);
+  }
+  return 0;
+}
+
+void hs_delete_events(http_request_t* request) {
+  HTTP_FLAG_SET(request->uring_flags, HS_UR_CLOSED);
+  // Shutting down completes the pending receive and any send in flight.
+  shutdown(request->socket, SHUT_RDWR);
+  struct io_uring_sqe* sqe = hs_uring_get_sqe(&request->server->ring);
+  sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+  sqe->addr = (uintptr_t)request | HS_OP_TIMEOUT;
+}
+
+int http_server_poll(http_server_t* serv) {
+  hs_uring_t* ring = &serv->ring;
+  if (
+    ring->to_submit ||
+    *ring->cq_head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)
+  ) {
+    hs_uring_enter(ring, 0);
+  }
+  int n = hs_uring_reap(serv, 1);
+  if (n == 0) return hs_run_deferred(serv);
+  hs_share_deferred(serv, n);
+  return n;
+}
+
+void hs_add_events(http_request_t* request) {
+  hs_uring_arm_recv(request);
+  hs_uring_arm_timeout(request, request->timeout);
+}
+
+void hs_add_write_event(http_request_t* request) {
+  // The send is already queued, its completion resumes the session.
+  (void)request;
+}
+
+// Watches use single shot polls, re-armed before the callback is called.
+// The kernel checks readiness when a poll is armed which makes them level
+// triggered like the other backends. Removing a watch or timer cancels the
+// operation in flight and its completion frees it.
+
+void hs_uring_arm_watch(http_watch_t* watch) {
+  struct io_uring_sqe* sqe = hs_uring_get_sqe(&watch->server->ring);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = watch->fd;
+  sqe->poll32_events = 0;
+  if (HTTP_FLAG_CHECK(watch->events, HTTP_READABLE)) sqe->poll32_events |= POLLIN;
+  if (HTTP_FLAG_CHECK(watch->events, HTTP_WRITABLE)) sqe->poll32_events |= POLLOUT;
+  sqe->user_data = (uintptr_t)watch;
+  watch->armed = 1;
+}
+
+void hs_watch_cb(struct io_uring_cqe* cqe) {
+  http_watch_t* watch = (http_watch_t*)(uintptr_t)cqe->user_data;
+  watch->armed = 0;
+  if (watch->closed) return free(watch);
+  // The fd can't be polled, it stays quiet until unwatched.
+  if (cqe->res < 0) return;
+  int events = hs_watch_events(
+    watch,
+    cqe->res & POLLIN,
+    cqe->res & POLLOUT,
+    cqe->res & (POLLERR | POLLHUP | POLLNVAL)
+  );
+  hs_uring_arm_watch(watch);
+  watch->cb(watch->fd, events, watch->data);
+}
+
+int hs_add_watch(http_watch_t* watch) {
+  watch->handler = hs_watch_cb;
+  hs_uring_arm_watch(watch);
+  return 0;
+}
+
+void hs_delete_watch(http_watch_t* watch) {
+  if (!watch->armed) return free(watch);
+  watch->closed = 1;
+  struct io_uring_sqe* sqe = hs_uring_get_sqe(&watch->server->ring);
+  sqe->opcode = IORING_OP_POLL_REMOVE;
+  sqe->addr = (uintptr_t)watch;
+}
+
+// Deadlines are absolute so repeating timers don't drift. Periods missed
+// while the loop was busy are skipped, the same as a timerfd does.
+void hs_uring_arm_timer(http_timer_t* timer) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long long ns = timer->ts.tv_nsec + (timer->ms % 1000) * 1000000LL;
+  timer->ts.tv_sec += timer->ms / 1000 + ns / 1000000000;
+  timer->ts.tv_nsec = ns % 1000000000;
+  if (
+    timer->ts.tv_sec < now.tv_sec ||
+    (timer->ts.tv_sec == now.tv_sec && timer->ts.tv_nsec < now.tv_nsec)
+  ) {
+    timer->ts.tv_sec = now.tv_sec;
+    timer->ts.tv_nsec = now.tv_nsec;
+    return hs_uring_arm_timer(timer);
+  }
+  struct io_uring_sqe* sqe = hs_uring_get_sqe(&timer->server->ring);
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->addr = (uintptr_t)&timer->ts;
+  sqe->len = 1;
+  sqe->timeout_flags = IORING_TIMEOUT_ABS;
+  sqe->user_data = (uintptr_t)timer;
+}
+
+void hs_timer_cb(struct io_uring_cqe* cqe) {
+  http_timer_t* timer = (http_timer_t*)(uintptr_t)cqe->user_data;
+  if (timer->closed) return free(timer);
+  if (timer->repeat) hs_uring_arm_timer(timer);
+  hs_fire_timer(timer);
+}
+
+int hs_add_timer(http_timer_t* timer) {
+  timer->handler = hs_timer_cb;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  timer->ts.tv_sec = now.tv_sec;
+  timer->ts.tv_nsec = now.tv_nsec;
+  hs_uring_arm_timer(timer);
+  return 0;
+}
+
+// A timer always has a timeout in flight until a one-shot timer fires.
+void hs_delete_timer(http_timer_t* timer) {
+  timer->closed = 1;
+  struct io_uring_sqe* sqe = hs_uring_get_sqe(&timer->server->ring);
+  sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+  sqe->addr = (uintptr_t)timer;
+}
+
 #else
 
 // *** epoll platform specific ***
 
 void hs_server_listen_cb(struct epoll_event* ev) {
-  hs_accept_connections((http_server_t*)ev->data.ptr);
+  hs_accept_connections((hs_listener_t*)ev->data.ptr);
 }
 
 void hs_session_io_cb(struct epoll_event* ev) {
@@ -1604,7 +6902,17 @@ void hs_server_timer_cb(struct epoll_event* ev) {
   uint64_t res;
   int bytes = read(server->timerfd, &res, sizeof(res));
   (void)bytes; // suppress warning
-  hs_generate_date_time(&server->date);
+  hs_generate_date_time(server->date);
+}
+
+void hs_server_async_cb(struct epoll_event* ev) {
+  http_server_t* server = (http_server_t*)(
+    (char*)ev->data.ptr - offsetof(http_server_t, async_handler)
+  );
+  uint64_t res;
+  int bytes = read(server->async_fd, &res, sizeof(res));
+  (void)bytes; // suppress warning
+  hs_drain_async(server);
 }
 
 void hs_request_timer_cb(struct epoll_event* ev) {
@@ -1613,14 +6921,34 @@ void hs_request_timer_cb(struct epoll_event* ev) {
   int bytes = read(request->timerfd, &res, sizeof(res));
   (void)bytes; // suppress warning
   request->timeout -= 1;
-  if (request->timeout == 0) hs_end_session(request);
+  if (request->timeout == 0) hs_timeout_expired(request);
+}
+
+void hs_set_accept(http_server_t* serv, int op, int events) {
+  for (int i = 0; i < serv->listener_count; i++) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = &serv->listeners[i];
+    epoll_ctl(serv->loop, op, serv->listeners[i].socket, &ev);
+  }
 }
 
 void hs_add_server_sock_events(http_server_t* serv) {
-  struct epoll_event ev;
-  ev.events = EPOLLIN | EPOLLET;
-  ev.data.ptr = serv;
-  epoll_ctl(serv->loop, EPOLL_CTL_ADD, serv->socket, &ev);
+  // With an accept batch limit the listener must stay level triggered or the
+  // connections left in the queue would never be reported again.
+  int events = serv->options.accept_batch > 0 ? EPOLLIN : EPOLLIN | EPOLLET;
+  hs_set_accept(serv, EPOLL_CTL_ADD, events);
+}
+
+void hs_pause_accept(http_server_t* serv) {
+  hs_set_accept(serv, EPOLL_CTL_MOD, 0);
+}
+
+void hs_resume_accept(http_server_t* serv) {
+  // Modifying re-checks readiness, so clients that queued up in the meantime
+  // are reported even when edge triggered.
+  int events = serv->options.accept_batch > 0 ? EPOLLIN : EPOLLIN | EPOLLET;
+  hs_set_accept(serv, EPOLL_CTL_MOD, events);
 }
 
 void hs_server_init(http_server_t* serv) {
@@ -1638,17 +6966,30 @@ void hs_server_init(http_server_t* serv) {
   ev.data.ptr = &serv->timer_handler;
   epoll_ctl(serv->loop, EPOLL_CTL_ADD, tfd, &ev);
   serv->timerfd = tfd;
+
+  // Wakeups for responses queued from other threads.
+  serv->async_head = NULL;
+  serv->async_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  serv->async_handler = hs_server_async_cb;
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.ptr = &serv->async_handler;
+  epoll_ctl(serv->loop, EPOLL_CTL_ADD, serv->async_fd, &ev);
 }
 
 int http_server_listen(http_server_t* serv) {
   http_listen(serv);
   struct epoll_event ev_list[1];
   while (1) {
-    int nev = epoll_wait(serv->loop, ev_list, 1, -1);
+    // Deferred low priority writes go on once nothing else is ready.
+    int nev = epoll_wait(serv->loop, ev_list, 1, serv->deferred_head ? 0 : -1);
+    if (nev == 0) hs_run_deferred(serv);
     for (int i = 0; i < nev; i++) {
       ev_cb_t* ev_cb = (ev_cb_t*)ev_list[i].data.ptr;
+      HS_DISPATCH_BEGIN(serv);
       ev_cb->handler(&ev_list[i]);
+      HS_DISPATCH_END(serv);
     }
+    hs_share_deferred(serv, nev);
   }
   return 0;
 }
@@ -1662,9 +7003,13 @@ void hs_delete_events(http_request_t* request) {
 int http_server_poll(http_server_t* serv) {
   struct epoll_event ev;
   int nev = epoll_wait(serv->loop, &ev, 1, 0);
-  if (nev <= 0) return nev;
+  if (nev == 0) return hs_run_deferred(serv);
+  if (nev < 0) return nev;
   ev_cb_t* ev_cb = (ev_cb_t*)ev.data.ptr;
+  HS_DISPATCH_BEGIN(serv);
   ev_cb->handler(&ev);
+  HS_DISPATCH_END(serv);
+  hs_share_deferred(serv, nev);
   return nev;
 }
 
@@ -1692,11 +7037,77 @@ void hs_add_events(http_request_t* request) {
 
 void hs_add_write_event(http_request_t* request) {
   struct epoll_event ev;
-  ev.events = EPOLLOUT | EPOLLET;
+  // Keep watching for input, HTTP/2 connections read while they write.
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
   ev.data.ptr = request;
   epoll_ctl(request->server->loop, EPOLL_CTL_MOD, request->socket, &ev);
 }
 
+// The loop handles a single event per epoll_wait so watches and timers can
+// be freed right away, no other event refers to them.
+
+void hs_watch_cb(struct epoll_event* ev) {
+  http_watch_t* watch = (http_watch_t*)ev->data.ptr;
+  int events = hs_watch_events(
+    watch,
+    ev->events & EPOLLIN,
+    ev->events & EPOLLOUT,
+    ev->events & (EPOLLERR | EPOLLHUP)
+  );
+  watch->cb(watch->fd, events, watch->data);
+}
+
+int hs_add_watch(http_watch_t* watch) {
+  watch->handler = hs_watch_cb;
+  struct epoll_event ev;
+  ev.events = 0;
+  if (HTTP_FLAG_CHECK(watch->events, HTTP_READABLE)) ev.events |= EPOLLIN;
+  if (HTTP_FLAG_CHECK(watch->events, HTTP_WRITABLE)) ev.events |= EPOLLOUT;
+  ev.data.ptr = watch;
+  return epoll_ctl(watch->server->loop, EPOLL_CTL_ADD, watch->fd, &ev);
+}
+
+void hs_delete_watch(http_watch_t* watch) {
+  epoll_ctl(watch->server->loop, EPOLL_CTL_DEL, watch->fd, NULL);
+  free(watch);
+}
+
+void hs_timer_cb(struct epoll_event* ev) {
+  http_timer_t* timer = (http_timer_t*)ev->data.ptr;
+  uint64_t res;
+  int bytes = read(timer->timerfd, &res, sizeof(res));
+  (void)bytes; // suppress warning
+  if (!timer->repeat) {
+    epoll_ctl(timer->server->loop, EPOLL_CTL_DEL, timer->timerfd, NULL);
+    close(timer->timerfd);
+  }
+  hs_fire_timer(timer);
+}
+
+int hs_add_timer(http_timer_t* timer) {
+  timer->handler = hs_timer_cb;
+  int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if (tfd < 0) return -1;
+  struct itimerspec ts = {};
+  ts.it_value.tv_sec = timer->ms / 1000;
+  ts.it_value.tv_nsec = (timer->ms % 1000) * 1000000L;
+  if (timer->repeat) ts.it_interval = ts.it_value;
+  timerfd_settime(tfd, 0, &ts, NULL);
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = timer;
+  epoll_ctl(timer->server->loop, EPOLL_CTL_ADD, tfd, &ev);
+  timer->timerfd = tfd;
+  return 0;
+}
+
+void hs_delete_timer(http_timer_t* timer) {
+  epoll_ctl(timer->server->loop, EPOLL_CTL_DEL, timer->timerfd, NULL);
+  close(timer->timerfd);
+  free(timer);
+}
+
 #endif
 
 #endif
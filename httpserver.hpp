@@ -0,0 +1,279 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+*
+* httpserver.hpp
+*
+* Description:
+*
+*   C++20 coroutine handlers on top of httpserver.h. A handler is a coroutine
+*   that co_awaits the next chunk of the request body, the write of a response
+*   chunk or a timer instead of being split into a chain of callbacks. It runs
+*   on the server's event loop like any other handler, no threads are added.
+*
+* Usage:
+*
+*   Include httpserver.h with HTTPSERVER_IMPL in one C or C++ file as usual
+*   and this file wherever coroutine handlers are written.
+*
+*   http::task stream(struct http_request_s* request) {
+*     struct http_response_s* response = http_response_init();
+*     http_response_status(response, 200);
+*     http_response_body(response, "start\n", 6);
+*     co_await http::respond_chunk(request, response);
+*     for (int i = 0; i < 10; i++) {
+*       co_await http::sleep(request, 1000);
+*       co_await http::respond_chunk(request, "tick\n");
+*     }
+*     http_respond_chunk_end(request, http_response_init());
+*   }
+*
+*   http_server_init(8080, http::handler<stream>);
+*
+*   The coroutine takes over the request's userdata and close callback, don't
+*   set them from a coroutine handler. If the connection goes away while the
+*   coroutine is suspended its frame is destroyed, running the destructors of
+*   its locals, and it is not resumed. Exceptions that escape a handler
+*   terminate the program.
+*
+*   Coroutine frames are allocated from a per thread, and so per event loop,
+*   pool and returned to it when the coroutine finishes. Once the pool has
+*   warmed up handlers don't allocate frames from the heap. Programs built
+*   with HTTP_STATIC_MEMORY can fill it at startup with http::reserve_frames.
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef HTTPSERVER_HPP
+#define HTTPSERVER_HPP
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <new>
+#include <string_view>
+
+#include "httpserver.h"
+
+namespace http {
+
+namespace detail {
+
+// Free lists of frames by power of two size class. Frames larger than the
+// largest class come from the heap. Memory is kept for reuse and never
+// returned.
+class frame_pool {
+ public:
+  static constexpr std::size_t min_size = 128;
+  static constexpr int class_count = 8;
+
+  void* allocate(std::size_t size) {
+    int c = size_class(size);
+    if (c < 0) return ::operator new(size);
+    if (free_[c] == nullptr) return ::operator new(min_size << c);
+    block* b = free_[c];
+    free_[c] = b->next;
+    return b;
+  }
+
+  void deallocate(void* p, std::size_t size) noexcept {
+    int c = size_class(size);
+    if (c < 0) return ::operator delete(p);
+    block* b = static_cast<block*>(p);
+    b->next = free_[c];
+    free_[c] = b;
+  }
+
+  void reserve(std::size_t size, int count) {
+    int c = size_class(size);
+    if (c < 0) return;
+    for (int i = 0; i < count; i++) {
+      deallocate(::operator new(min_size << c), size);
+    }
+  }
+
+ private:
+  struct block {
+    block* next;
+  };
+
+  static int size_class(std::size_t size) {
+    int c = 0;
+    while ((min_size << c) < size) {
+      if (++c == class_count) return -1;
+    }
+    return c;
+  }
+
+  block* free_[class_count] = {};
+};
+
+inline frame_pool& pool() {
+  thread_local frame_pool frames;
+  return frames;
+}
+
+// Suspends the coroutine until the server calls back for the request. The
+// callback may come before the call that waits for it returns, in which case
+// the coroutine carries on without being suspended. If the connection goes
+// away instead the coroutine is destroyed.
+class request_awaiter {
+ public:
+  bool await_ready() const noexcept { return false; }
+
+ protected:
+  explicit request_awaiter(struct http_request_s* request) : request_(request) {}
+
+  template <class Wait>
+  bool suspend(std::coroutine_handle<> handle, Wait wait) {
+    handle_ = handle;
+    http_request_set_userdata(request_, this);
+    http_request_on_close(request_, closed);
+    waiting_ = true;
+    wait();
+    waiting_ = false;
+    if (closed_) {
+      handle.destroy();
+      return true;
+    }
+    return !done_;
+  }
+
+  static void resume(struct http_request_s* request) {
+    request_awaiter* self = static_cast<request_awaiter*>(http_request_userdata(request));
+    http_request_on_close(request, nullptr);
+    if (self->waiting_) {
+      self->done_ = true;
+    } else {
+      self->handle_.resume();
+    }
+  }
+
+  static void closed(struct http_request_s* request) {
+    request_awaiter* self = static_cast<request_awaiter*>(http_request_userdata(request));
+    if (self->cancel_) self->cancel_(self);
+    if (self->waiting_) {
+      self->closed_ = true;
+    } else {
+      self->handle_.destroy();
+    }
+  }
+
+  struct http_request_s* request_;
+  std::coroutine_handle<> handle_;
+  // Undoes whatever the awaiter waits on other than the request.
+  void (*cancel_)(request_awaiter*) = nullptr;
+  bool waiting_ = false;
+  bool done_ = false;
+  bool closed_ = false;
+};
+
+} // namespace detail
+
+// The return type of coroutine handlers. The coroutine starts right away and
+// nothing waits on it, it owns itself until it finishes or the connection
+// goes away.
+class task {
+ public:
+  struct promise_type {
+    task get_return_object() noexcept { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept { std::terminate(); }
+
+    static void* operator new(std::size_t size) {
+      return detail::pool().allocate(size);
+    }
+
+    static void operator delete(void* p, std::size_t size) noexcept {
+      detail::pool().deallocate(p, size);
+    }
+  };
+};
+
+// Adapts a coroutine handler to the handler pointer http_server_init and the
+// callback taking functions expect.
+template <task (*Handler)(struct http_request_s*)>
+void handler(struct http_request_s* request) {
+  Handler(request);
+}
+
+// Puts count frames of up to size bytes into the calling thread's pool.
+inline void reserve_frames(std::size_t size, int count) {
+  detail::pool().reserve(size, count);
+}
+
+// Waits for the next chunk of a chunked or streamed request body, see
+// http_request_read_chunk. The chunk is empty once the body has been read.
+// It is valid until the next read.
+class read_chunk : public detail::request_awaiter {
+ public:
+  explicit read_chunk(struct http_request_s* request) : request_awaiter(request) {}
+
+  bool await_suspend(std::coroutine_handle<> handle) {
+    return suspend(handle, [this] { http_request_read_chunk(request_, resume); });
+  }
+
+  std::string_view await_resume() {
+    struct http_string_s chunk = http_request_chunk(request_);
+    return std::string_view(chunk.buf, chunk.len);
+  }
+};
+
+// Writes the response as the next chunk of a chunked response, see
+// http_respond_chunk, and waits until it has been written so the next chunk
+// isn't produced faster than the client takes them. The body is copied before
+// the coroutine is suspended.
+class respond_chunk : public detail::request_awaiter {
+ public:
+  respond_chunk(struct http_request_s* request, struct http_response_s* response)
+    : request_awaiter(request), response_(response) {}
+
+  respond_chunk(struct http_request_s* request, std::string_view body)
+    : request_awaiter(request), response_(http_response_init()) {
+    http_response_body(response_, body.data(), static_cast<int>(body.size()));
+  }
+
+  bool await_suspend(std::coroutine_handle<> handle) {
+    return suspend(handle, [this] { http_respond_chunk(request_, response_, resume); });
+  }
+
+  void await_resume() const noexcept {}
+
+ private:
+  struct http_response_s* response_;
+};
+
+// Waits ms milliseconds on the server's event loop while holding on to the
+// request.
+class sleep : public detail::request_awaiter {
+ public:
+  sleep(struct http_request_s* request, int ms) : request_awaiter(request), ms_(ms) {}
+
+  bool await_suspend(std::coroutine_handle<> handle) {
+    cancel_ = cancel;
+    return suspend(handle, [this] {
+      timer_ = http_server_timer(http_request_server(request_), ms_, 0, fired, this);
+    });
+  }
+
+  void await_resume() const noexcept {}
+
+ private:
+  static void fired(void* data) {
+    sleep* self = static_cast<sleep*>(data);
+    self->timer_ = nullptr;
+    resume(self->request_);
+  }
+
+  static void cancel(request_awaiter* awaiter) {
+    sleep* self = static_cast<sleep*>(awaiter);
+    if (self->timer_) http_server_cancel_timer(self->timer_);
+    self->timer_ = nullptr;
+  }
+
+  int ms_;
+  struct http_timer_s* timer_ = nullptr;
+};
+
+} // namespace http
+
+#endif
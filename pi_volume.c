@@ -1,6 +1,25 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <arpa/inet.h>
 
-const char * HTML = "" 
+// The page is laid out at compile time as static segments with slots for the
+// live state in between. Rendering only points at the segments and the
+// cached values, the server gathers them right behind the response head.
+enum { SLOT_VOLUME, SLOT_ZONES };
+
+struct segment {
+    const char *text;
+    int len;
+    int slot;
+};
+
+#define TEXT(s) { s, sizeof(s) - 1, -1 }
+#define SLOT(n) { NULL, 0, n }
+
+static const struct segment PAGE[] = {
+    TEXT(
     "<!DOCTYPE html>"
     "<html lang=\"en\">"
 	"<head>"
@@ -12,26 +31,47 @@ const char * HTML = ""
             "* { margin: 0; padding: 0; }"
             "button { font-size:30vh; margin: 0 auto; display: block; background: #111; color: white; border: 0; }"
             "body { font-family: sans-serif; background: #111; padding: 24px; }"
+            "p { font-size: 8vh; color: white; text-align: center; }"
+            "ul { list-style: none; color: #888; text-align: center; }"
+            "label { display: block; color: #888; text-align: center; padding: 12px; }"
         "</style>"
     "</head>"
     "<body>"
         "<form method=\"POST\">"
             "<button name=\"volume\" value=\"up\">▲</button>"
         "</form>"
+        "<p id=\"volume\">"),
+    SLOT(SLOT_VOLUME),
+    TEXT(
+        "</p>"
         "<form method=\"POST\">"
             "<button name=\"volume\" value=\"down\">▼</button>"
         "</form>"
+        "<ul id=\"zones\">"),
+    SLOT(SLOT_ZONES),
+    TEXT(
+        "</ul>"
+        "<label><input type=\"checkbox\" id=\"all\"> All rooms</label>"
         "<script>"
             "document.addEventListener('submit', function(evt) {"
                 "evt.preventDefault();"
                 "window.fetch(window.location.href, {"
                     "method: 'POST',"
-                    "body: `volume=${evt.target.volume.value}`"
+                    "body: `volume=${evt.target.volume.value}${document.getElementById('all').checked ? '&all=1' : ''}`"
+                "}).then(function(response) {"
+                    "return response.text();"
+                "}).then(function(html) {"
+                    "var page = new DOMParser().parseFromString(html, 'text/html');"
+                    "document.getElementById('volume').textContent = page.getElementById('volume').textContent;"
+                    "document.getElementById('zones').innerHTML = page.getElementById('zones').innerHTML;"
                 "});"
             "});"
         "</script>"
     "</body>"
-"</html>";
+"</html>"),
+};
+
+#define PAGE_PARTS (sizeof(PAGE) / sizeof(PAGE[0]))
 
 const char * MANIFEST = ""
 "{"
@@ -47,22 +87,377 @@ int http_string_compare(struct http_string_s s, char expected[]) {
     return strncmp(s.buf, expected, strlen(expected)) == 0;
 }
 
+struct http_server_s *server;
+
+// What the page shows, kept up to date by the taps and the other rooms so
+// rendering never waits on amixer.
+static char volume[8] = "?";
+static int level = -1;
+static char zones[1024];
+
+// Name of this room, the host name unless given on the command line. Every
+// room in the group needs a different one.
+static char zone[32];
+
+// Overridden with the AMIXER environment variable, e.g. to run several
+// instances against stand-ins on one machine.
+static const char *amixer = "/usr/bin/amixer";
+
+// Runs amixer and remembers the volume it reports, both sset and sget print
+// the state of the control.
+void mixer(const char *args)
+{
+    char command[192], line[256];
+    int percent;
+    snprintf(command, sizeof(command), "%s %s", amixer, args);
+    FILE *out = popen(command, "r");
+    if (out == NULL) return;
+    while (fgets(line, sizeof(line), out))
+    {
+        char *bracket = strchr(line, '[');
+        if (bracket && sscanf(bracket, "[%d%%]", &percent) == 1)
+        {
+            snprintf(volume, sizeof(volume), "%d%%", percent);
+            level = percent;
+        }
+    }
+    pclose(out);
+}
+
+// Rooms keep each other in sync over UDP multicast. A tap for all rooms goes
+// to the group as one delta. Every room applies it once, in order, and
+// acknowledges it with its new level; the room it came from repeats the
+// deltas a room hasn't acknowledged yet. Rooms announce their level every
+// few seconds, which is also how they find each other. Messages are a line
+// of text each:
+//
+//   S <zone> <level> <boot> <seq>                  announcement
+//   D <zone> <boot> <seq> <delta>                  change by delta percent
+//   A <zone> <level> <origin> <boot> <seq>         applied origin's deltas
+//                                                  up to seq
+//
+// level is the volume in percent, -1 if the room doesn't know it. It is
+// sent as a number and only turned into text for the page here, anyone on
+// the network can send to the group.
+// boot tells a restarted room from an old one, seq numbers its deltas from
+// 1. Run instances with their own port, zone and AMIXER on one machine to
+// try it out, multicast loops back to the sender's host.
+#define GROUP "239.255.76.67"
+#define GROUP_PORT 7667
+#define ANNOUNCE_MS 2000
+#define RESEND_MS 250
+#define RESENDS 8
+// Deltas kept for repeating. A room further behind misses the older ones.
+#define DELTAS 16
+#define MAX_PEERS 16
+
+struct peer
+{
+    char zone[32];
+    // Volume in percent, -1 while unknown.
+    int level;
+    time_t heard;
+    // The peer's run and the next of its deltas to apply.
+    unsigned boot;
+    unsigned next;
+    // The last of our deltas the peer has applied.
+    unsigned acked;
+};
+
+static struct peer peers[MAX_PEERS];
+static int group = -1;
+static struct sockaddr_in group_addr;
+static unsigned boot;
+static unsigned seq;
+static int deltas[DELTAS];
+static struct http_timer_s *resend_timer;
+static int resends;
+
+void update_zones(void)
+{
+    unsigned len = snprintf(zones, sizeof(zones), "<li>%s %s</li>", zone, volume);
+    for (int i = 0; i < MAX_PEERS && len < sizeof(zones); i++)
+    {
+        if (peers[i].zone[0] == '\0') continue;
+        char text[8] = "?";
+        if (peers[i].level >= 0) snprintf(text, sizeof(text), "%d%%", peers[i].level);
+        len += snprintf(
+            zones + len, sizeof(zones) - len, "<li>%s %s</li>",
+            peers[i].zone, text
+        );
+    }
+}
+
+void change_volume(int delta)
+{
+    char args[32];
+    snprintf(args, sizeof(args), "sset Digital %d%%%c", abs(delta), delta < 0 ? '-' : '+');
+    mixer(args);
+    update_zones();
+}
+
+void group_send(const char *format, ...)
+{
+    char packet[256];
+    va_list args;
+    if (group < 0) return;
+    va_start(args, format);
+    int len = vsnprintf(packet, sizeof(packet), format, args);
+    va_end(args);
+    sendto(group, packet, len, 0, (struct sockaddr *)&group_addr, sizeof(group_addr));
+}
+
+void announce(void)
+{
+    group_send("S %s %d %u %u", zone, level, boot, seq);
+}
+
+// Zone names end up in the page, only take plain ones.
+int valid_zone(const char *name)
+{
+    if (name[0] == '\0') return 0;
+    for (; *name; name++)
+    {
+        if (!isalnum((unsigned char)*name) && !strchr("-_.", *name)) return 0;
+    }
+    return 1;
+}
+
+struct peer *find_peer(const char *name)
+{
+    struct peer *free_peer = NULL;
+    if (!valid_zone(name) || strcmp(name, zone) == 0) return NULL;
+    for (int i = 0; i < MAX_PEERS; i++)
+    {
+        if (strcmp(peers[i].zone, name) == 0) return &peers[i];
+        if (peers[i].zone[0] == '\0' && free_peer == NULL) free_peer = &peers[i];
+    }
+    if (free_peer)
+    {
+        memset(free_peer, 0, sizeof(*free_peer));
+        snprintf(free_peer->zone, sizeof(free_peer->zone), "%s", name);
+        free_peer->level = -1;
+        // Only the deltas from now on are the new room's business.
+        free_peer->acked = seq;
+    }
+    return free_peer;
+}
+
+// Repeats the deltas each room is missing, oldest first, until all have
+// caught up or it has been tried often enough.
+void resend(void *data)
+{
+    int behind = 0;
+    (void)data;
+    for (int i = 0; i < MAX_PEERS; i++)
+    {
+        if (peers[i].zone[0] == '\0' || peers[i].acked >= seq) continue;
+        behind = 1;
+        unsigned from = peers[i].acked + 1;
+        if (seq - from >= DELTAS) from = seq - DELTAS + 1;
+        for (unsigned s = from; s <= seq; s++)
+        {
+            group_send("D %s %u %u %d", zone, boot, s, deltas[s % DELTAS]);
+        }
+    }
+    if (!behind || --resends == 0)
+    {
+        http_server_cancel_timer(resend_timer);
+        resend_timer = NULL;
+    }
+}
+
+void change_all_volumes(int delta)
+{
+    change_volume(delta);
+    seq++;
+    deltas[seq % DELTAS] = delta;
+    group_send("D %s %u %u %d", zone, boot, seq, delta);
+    announce();
+    resends = RESENDS;
+    if (resend_timer == NULL)
+    {
+        resend_timer = http_server_timer(server, RESEND_MS, 1, resend, NULL);
+    }
+}
+
+void receive_delta(struct peer *origin, unsigned origin_boot, unsigned origin_seq, int delta)
+{
+    if (origin->boot != origin_boot)
+    {
+        origin->boot = origin_boot;
+        origin->next = origin_seq;
+    }
+    // Deltas are applied in order, one after a gap comes again once the
+    // missing ones have been repeated.
+    if (origin_seq == origin->next)
+    {
+        change_volume(delta);
+        origin->next++;
+    }
+    group_send("A %s %d %s %u %u", zone, level, origin->zone, origin->boot, origin->next - 1);
+}
+
+void group_receive(int fd, int events, void *data)
+{
+    char packet[256], name[32], origin[32];
+    unsigned peer_boot, peer_seq;
+    int peer_level, delta;
+    ssize_t len;
+    struct peer *peer;
+    (void)events;
+    (void)data;
+    while ((len = recv(fd, packet, sizeof(packet) - 1, 0)) > 0)
+    {
+        packet[len] = '\0';
+        if (sscanf(packet, "S %31s %d %u %u", name, &peer_level, &peer_boot, &peer_seq) == 4)
+        {
+            if ((peer = find_peer(name)) == NULL) continue;
+            if (peer->boot != peer_boot)
+            {
+                peer->boot = peer_boot;
+                peer->next = peer_seq + 1;
+            }
+        }
+        else if (sscanf(packet, "D %31s %u %u %d", name, &peer_boot, &peer_seq, &delta) == 4)
+        {
+            if ((peer = find_peer(name)) == NULL) continue;
+            receive_delta(peer, peer_boot, peer_seq, delta);
+            peer_level = peer->level;
+        }
+        else if (sscanf(packet, "A %31s %d %31s %u %u", name, &peer_level, origin, &peer_boot, &peer_seq) == 5)
+        {
+            if ((peer = find_peer(name)) == NULL) continue;
+            if (strcmp(origin, zone) == 0 && peer_boot == boot && peer_seq > peer->acked && peer_seq <= seq)
+            {
+                peer->acked = peer_seq;
+            }
+        }
+        else
+        {
+            continue;
+        }
+        peer->heard = time(NULL);
+        peer->level = peer_level >= 0 && peer_level <= 100 ? peer_level : -1;
+        update_zones();
+    }
+}
+
+// Announces this room and forgets the ones that have gone quiet.
+void group_tick(void *data)
+{
+    time_t now = time(NULL);
+    (void)data;
+    for (int i = 0; i < MAX_PEERS; i++)
+    {
+        if (peers[i].zone[0] && now - peers[i].heard > 3 * ANNOUNCE_MS / 1000)
+        {
+            peers[i].zone[0] = '\0';
+            update_zones();
+        }
+    }
+    announce();
+}
+
+// Joins the group on the interface with the given address, any if NULL.
+void group_join(const char *interface)
+{
+    struct ip_mreq membership;
+    struct sockaddr_in addr;
+    int on = 1;
+    boot = (unsigned)time(NULL) ^ ((unsigned)getpid() << 16);
+    group = socket(AF_INET, SOCK_DGRAM, 0);
+    setsockopt(group, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(GROUP_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    memset(&membership, 0, sizeof(membership));
+    membership.imr_multiaddr.s_addr = inet_addr(GROUP);
+    membership.imr_interface.s_addr = interface ? inet_addr(interface) : htonl(INADDR_ANY);
+    if (
+        bind(group, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        setsockopt(group, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) < 0
+    )
+    {
+        perror("pi_volume: not syncing with other rooms");
+        close(group);
+        group = -1;
+        return;
+    }
+    setsockopt(group, IPPROTO_IP, IP_MULTICAST_IF, &membership.imr_interface, sizeof(membership.imr_interface));
+    fcntl(group, F_SETFL, fcntl(group, F_GETFL, 0) | O_NONBLOCK);
+    group_addr = addr;
+    group_addr.sin_addr = membership.imr_multiaddr;
+    http_server_watch(server, group, HTTP_READABLE, group_receive, NULL);
+    http_server_timer(server, ANNOUNCE_MS, 1, group_tick, NULL);
+    announce();
+}
+
+void render_page(struct http_string_s parts[PAGE_PARTS])
+{
+    struct http_string_s slots[] = {
+        [SLOT_VOLUME] = { volume, strlen(volume) },
+        [SLOT_ZONES] = { zones, strlen(zones) },
+    };
+    for (unsigned i = 0; i < PAGE_PARTS; i++)
+    {
+        if (PAGE[i].slot < 0)
+        {
+            parts[i] = (struct http_string_s){ PAGE[i].text, PAGE[i].len };
+        }
+        else
+        {
+            parts[i] = slots[PAGE[i].slot];
+        }
+    }
+}
+
+#ifdef HTTP_TRACE
+// Load in chrome://tracing or ui.perfetto.dev to see where taps spend time.
+static char trace[1 << 20];
+#endif
+
 void handle_request(struct http_request_s *request)
 {    
+    struct http_string_s parts[PAGE_PARTS];
+    if (http_string_compare(http_request_method(request), "POST") && http_request_early_data(request))
+    {
+        // A replayed tap would change the volume again. Browsers don't send
+        // POSTs in early data, other clients send it again once the
+        // handshake is done.
+        struct http_response_s *response = http_response_init();
+        http_response_status(response, 425);
+        http_respond(request, response);
+        return;
+    }
     if (http_string_compare(http_request_method(request), "POST"))
     {
-        if (http_string_compare(http_request_body(request), "volume=up"))
+        struct http_string_s body = http_request_body(request);
+        int delta = http_string_compare(body, "volume=up") ? 5 : -5;
+        if (memmem(body.buf, body.len, "all=1", 5))
         {
-            system("/usr/bin/amixer sset Digital 5%+");
+            change_all_volumes(delta);
         }
         else
         {
-            system("/usr/bin/amixer sset Digital 5%-");
+            change_volume(delta);
+            announce();
         }
     }
 
     struct http_response_s *response = http_response_init();
     http_response_status(response, 200);
+#ifdef HTTP_TRACE
+    if (http_string_compare(http_request_target(request), "/trace"))
+    {
+        // The dump can be a megabyte, don't let it hold up volume taps.
+        http_request_set_priority(request, HTTP_PRIORITY_LOW);
+        http_response_header(response, "Content-Type", "application/json");
+        http_response_body(response, trace, http_server_trace_json(server, trace, sizeof(trace)));
+    }
+    else
+#endif
     if (http_string_compare(http_request_target(request), "/manifest.json"))
     {
         http_response_header(response, "Content-Type", "application/json");
@@ -71,13 +466,49 @@ void handle_request(struct http_request_s *request)
     else
     {
         http_response_header(response, "Content-Type", "text/html");
-        http_response_body(response, HTML, strlen(HTML));
+        render_page(parts);
+        http_response_body_parts(response, parts, PAGE_PARTS);
     }
     http_respond(request, response);
 }
 
-int main()
+// pi_volume [port [zone [multicast interface address]]]
+int main(int argc, char **argv)
 {
-    struct http_server_s *server = http_server_init(8080, handle_request);
+    char host[64] = "";
+    gethostname(host, sizeof(host) - 1);
+    snprintf(zone, sizeof(zone), "%s", argc > 2 ? argv[2] : host);
+    if (getenv("AMIXER")) amixer = getenv("AMIXER");
+    mixer("sget Digital");
+    update_zones();
+
+    server = http_server_init(argc > 1 ? atoi(argv[1]) : 8080, handle_request);
+    struct http_server_options_s options;
+    http_server_options_init(&options);
+    options.nodelay = 1;
+    // Only the method, target and body are read, skip tokenizing the rest.
+    options.lazy_headers = 1;
+#ifdef HTTP_TRACE
+    options.server_timing = 1;
+#endif
+#ifdef HTTP_WATCHDOG
+    // amixer runs on the event loop, report when a tap holds it up.
+    options.stall_threshold = 100;
+    // Reads from amixer's pipe and waiting for it are restarted after the
+    // sampling signal, so it doesn't cut a stall short.
+    options.stall_stacks = 1;
+#endif
+#ifdef HTTP_TLS
+    // Browsers only allow installing the page as an app from a secure
+    // context. Create a self-signed pair with `make cert`.
+    options.tls_cert = "build/cert.pem";
+    options.tls_key = "build/key.pem";
+    options.http2 = 1;
+    // Page loads from a phone coming back to the app skip a round trip.
+    // Taps are POSTs and wait for the handshake.
+    options.tls_early_data = 16384;
+#endif
+    http_server_set_options(server, &options);
+    group_join(argc > 3 ? argv[3] : NULL);
     http_server_listen(server);
 }
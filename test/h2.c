@@ -0,0 +1,250 @@
+// Regression test for the two ways a connection becomes HTTP/2 with bytes
+// already read, prior knowledge and Upgrade: h2c. Clients may send their
+// first requests and bodies along with the connection preface, more than a
+// frame's worth, and the final LF of an upgrade request may only arrive with
+// the frames that follow it. Also covers header blocks split into fragments
+// that may be empty.
+//
+//   make test
+//
+// builds it with the sanitizers and runs it. Prints each case and exits
+// non-zero if one fails. Linux only.
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#define HTTPSERVER_IMPL
+#include "../httpserver.h"
+
+#define TEST_PORT 8090
+// More than a frame so a body takes two DATA frames.
+#define TEST_BODY 20000
+#define TEST_STREAMS 8
+
+static char test_body[TEST_BODY];
+
+static void test_handle_request(struct http_request_s* request) {
+  char length[16];
+  struct http_string_s body = http_request_body(request);
+  struct http_response_s* response = http_response_init();
+  http_response_status(response, 200);
+  http_response_body(response, length, snprintf(length, sizeof(length), "%d", body.len));
+  http_respond(request, response);
+}
+
+static void* test_serve(void* arg) {
+  http_server_listen((struct http_server_s*)arg);
+  return NULL;
+}
+
+static int test_connect() {
+  struct sockaddr_in addr = { };
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(TEST_PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  while (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    close(sock);
+    usleep(1000);
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+  }
+  struct timeval timeout = { 2, 0 };
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  return sock;
+}
+
+static int test_write(int sock, char const * buf, int len) {
+  return write(sock, buf, len) == len;
+}
+
+static char* test_frame(char* dst, int type, int flags, int id, char const * payload, int len) {
+  dst[0] = len >> 16;
+  dst[1] = len >> 8;
+  dst[2] = len;
+  dst[3] = type;
+  dst[4] = flags;
+  hs_h2_put32(dst + 5, id);
+  if (len) memcpy(dst + 9, payload, len);
+  return dst + 9 + len;
+}
+
+// The preface and an empty SETTINGS frame.
+static char* test_preface(char* dst) {
+  memcpy(dst, HS_H2_PREFACE, HS_H2_PREFACE_LEN);
+  return test_frame(dst + HS_H2_PREFACE_LEN, HS_H2_SETTINGS, 0, 0, NULL, 0);
+}
+
+// POST / with the test body as two DATA frames.
+static char* test_post(char* dst, int id) {
+  char block[16];
+  int len = 0;
+  block[len++] = 0x83; // :method POST
+  block[len++] = 0x86; // :scheme http
+  block[len++] = 0x84; // :path /
+  block[len++] = 0x0f; // content-length, not indexed
+  block[len++] = 0x0d;
+  block[len++] = 5;
+  len += sprintf(block + len, "%d", TEST_BODY);
+  dst = test_frame(dst, HS_H2_HEADERS, HS_H2_END_HEADERS, id, block, len);
+  dst = test_frame(dst, HS_H2_DATA, 0, id, test_body, HS_H2_MAX_FRAME);
+  return test_frame(
+    dst, HS_H2_DATA, HS_H2_END_STREAM, id, test_body + HS_H2_MAX_FRAME,
+    TEST_BODY - HS_H2_MAX_FRAME
+  );
+}
+
+static int test_upgrade_head(char* dst) {
+  return sprintf(
+    dst, "GET / HTTP/1.1\r\nHost: localhost\r\nConnection: Upgrade, HTTP2-Settings\r\n"
+    "Upgrade: h2c\r\nHTTP2-Settings: AAMAAABk\r\n\r\n"
+  );
+}
+
+// Reads responses until each of the streams has ended and checks that they
+// were answered with 200 and the length of the request body. If upgraded the
+// frames follow a 101.
+static int test_responses(
+  int sock,
+  int upgraded,
+  int const * ids,
+  char const * const * bodies,
+  int count
+) {
+  static char buf[1 << 18];
+  char received[TEST_STREAMS][16] = { };
+  int status[TEST_STREAMS] = { };
+  int ended = 0, bytes = 0, pos = 0;
+  while (upgraded) {
+    int n = read(sock, buf + bytes, sizeof(buf) - bytes);
+    if (n <= 0) return 0;
+    bytes += n;
+    char* end = memmem(buf, bytes, "\r\n\r\n", 4);
+    if (end == NULL) continue;
+    if (memcmp(buf, "HTTP/1.1 101 ", 13) != 0) return 0;
+    pos = end + 4 - buf;
+    break;
+  }
+  while (ended < count) {
+    if (bytes - pos < HS_H2_FRAME_HEADER) {
+      int n = read(sock, buf + bytes, sizeof(buf) - bytes);
+      if (n <= 0) return 0;
+      bytes += n;
+      continue;
+    }
+    unsigned char* h = (unsigned char*)buf + pos;
+    int len = h[0] << 16 | h[1] << 8 | h[2];
+    if (bytes - pos < HS_H2_FRAME_HEADER + len) {
+      int n = read(sock, buf + bytes, sizeof(buf) - bytes);
+      if (n <= 0) return 0;
+      bytes += n;
+      continue;
+    }
+    int id = hs_h2_get32((char*)h + 5) & 0x7fffffff;
+    char* payload = buf + pos + HS_H2_FRAME_HEADER;
+    pos += HS_H2_FRAME_HEADER + len;
+    if (h[3] == HS_H2_GOAWAY || h[3] == HS_H2_RST_STREAM) return 0;
+    if (h[3] != HS_H2_HEADERS && h[3] != HS_H2_DATA) continue;
+    int i = 0;
+    while (i < count && ids[i] != id) i++;
+    if (i == count) return 0;
+    if (h[3] == HS_H2_HEADERS) {
+      // The static table entry for :status 200.
+      status[i] = len > 0 && (unsigned char)payload[0] == 0x88 ? 200 : -1;
+    } else {
+      int have = strlen(received[i]);
+      if (have + len >= (int)sizeof(received[i])) return 0;
+      memcpy(received[i] + have, payload, len);
+    }
+    if (h[4] & HS_H2_END_STREAM) ended++;
+  }
+  for (int i = 0; i < count; i++) {
+    if (status[i] != 200 || strcmp(received[i], bodies[i]) != 0) return 0;
+  }
+  return 1;
+}
+
+static int test_prior_knowledge() {
+  static char buf[1 << 17];
+  int ids[] = { 1, 3, 5 };
+  char const * bodies[] = { "20000", "20000", "20000" };
+  char* p = test_preface(buf);
+  for (int i = 0; i < 3; i++) p = test_post(p, ids[i]);
+  int sock = test_connect();
+  int ok = test_write(sock, buf, p - buf) && test_responses(sock, 0, ids, bodies, 3);
+  close(sock);
+  return ok;
+}
+
+static int test_upgrade_first_flight() {
+  static char buf[1 << 17];
+  int ids[] = { 1, 3, 5 };
+  char const * bodies[] = { "0", "20000", "20000" };
+  char* p = buf + test_upgrade_head(buf);
+  p = test_preface(p);
+  p = test_post(p, 3);
+  p = test_post(p, 5);
+  int sock = test_connect();
+  int ok = test_write(sock, buf, p - buf) && test_responses(sock, 1, ids, bodies, 3);
+  close(sock);
+  return ok;
+}
+
+static int test_upgrade_split_head() {
+  static char buf[1 << 17];
+  int ids[] = { 1, 3 };
+  char const * bodies[] = { "0", "20000" };
+  int head = test_upgrade_head(buf);
+  char* p = test_preface(buf + head);
+  p = test_post(p, 3);
+  int sock = test_connect();
+  // Everything but the final LF, then the rest once the server has read it.
+  int ok = test_write(sock, buf, head - 1);
+  usleep(50000);
+  ok = ok && test_write(sock, buf + head - 1, p - buf - head + 1);
+  ok = ok && test_responses(sock, 1, ids, bodies, 2);
+  close(sock);
+  return ok;
+}
+
+// GET / with its header block in a CONTINUATION after an empty HEADERS.
+static int test_empty_fragment() {
+  static char buf[256];
+  int ids[] = { 1 };
+  char const * bodies[] = { "0" };
+  // GET http / and :authority localhost, not indexed.
+  char const block[] = "\x82\x86\x84\x01\x09localhost";
+  char* p = test_preface(buf);
+  p = test_frame(p, HS_H2_HEADERS, HS_H2_END_STREAM, 1, NULL, 0);
+  p = test_frame(p, HS_H2_CONTINUATION, HS_H2_END_HEADERS, 1, block, sizeof(block) - 1);
+  int sock = test_connect();
+  int ok = test_write(sock, buf, p - buf) && test_responses(sock, 0, ids, bodies, 1);
+  close(sock);
+  return ok;
+}
+
+int main() {
+  memset(test_body, 'b', sizeof(test_body));
+  struct http_server_s* server = http_server_init(TEST_PORT, test_handle_request);
+  struct http_server_options_s options;
+  http_server_options_init(&options);
+  options.http2 = 1;
+  http_server_set_options(server, &options);
+  pthread_t thread;
+  pthread_create(&thread, NULL, test_serve, server);
+
+  struct {
+    char const * name;
+    int (*run)();
+  } cases[] = {
+    { "prior knowledge, requests in the first flight", test_prior_knowledge },
+    { "upgrade, requests in the first flight", test_upgrade_first_flight },
+    { "upgrade, head split before its last byte", test_upgrade_split_head },
+    { "empty header block fragment", test_empty_fragment },
+  };
+  int failed = 0;
+  for (int i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); i++) {
+    int ok = cases[i].run();
+    printf("%s: %s\n", ok ? "ok" : "FAILED", cases[i].name);
+    failed += !ok;
+  }
+  return failed != 0;
+}